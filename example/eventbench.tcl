@@ -0,0 +1,52 @@
+#!/usr/bin/tclsh
+#
+# Measure the cost of event callback dispatch per event.
+#
+# usage: eventbench.tcl videofile ?seconds?
+#
+# The video is played into a tiny photo image so that frame uploads are
+# negligible, with an empty event callback subscribed to all events. The
+# time spent in the event loop, minus the cost of idle [update] calls,
+# divided by the number of callbacks is the dispatch cost per event.
+# Run it against different builds of tkvlc to compare them.
+
+package require Tk
+package require tkvlc
+
+if {[llength $argv] < 1} {
+    puts stderr "usage: $argv0 videofile ?seconds?"
+    exit 1
+}
+set file [lindex $argv 0]
+set secs [expr {[llength $argv] > 1 ? [lindex $argv 1] : 10}]
+
+proc cb {args} {
+    incr ::count
+}
+
+# cost of an update call without work
+set idle [lindex [time {update} 10000] 0]
+
+set photo [image create photo]
+::tkvlc::init bench $photo
+bench size 16x16
+bench event cb -values 1
+bench open $file
+bench volume 0
+bench play
+
+set count 0
+set calls 0
+set busy 0.0
+set end [expr {[clock milliseconds] + $secs * 1000}]
+while {[clock milliseconds] < $end} {
+    set busy [expr {$busy + [lindex [time {update}] 0]}]
+    incr calls
+}
+bench stop
+bench destroy
+
+set work [expr {$busy - $calls * $idle}]
+puts [format "%d callbacks in %d s, %.2f us per event" $count $secs \
+    [expr {$count ? $work / $count : 0.0}]]
+exit
@@ -0,0 +1,208 @@
+/*
+ * shmreader.c
+ *
+ * Read the frames exported by "HANDLE export shm NAME" in another
+ * process and check that their sequence numbers are continuous.
+ *
+ * usage: shmreader NAME ?frames?
+ *
+ * build: cc -O2 -I../generic -o shmreader shmreader.c
+ *        (add -lrt for glibc older than 2.34)
+ *
+ * Frames are read in place without copying: a checksum of the pixels
+ * is computed, and the frame counts when its slot was not rewritten
+ * meanwhile. Frames overwritten before they were read are missed,
+ * which happens when the reader is slower than the decoder. Frames
+ * found out of sequence mean a broken ring. The reader stops after
+ * the given number of frames or when none arrived for five seconds,
+ * and exits with status 1 when frames were out of sequence.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "tkvlcshm.h"
+
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define FENCE()     __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define IDLE_MS     5000
+
+/*
+ * Sleep for a millisecond.
+ */
+
+static void Nap(void)
+{
+  struct timespec ts = { 0, 1000000 };
+
+  nanosleep(&ts, NULL);
+}
+
+/*
+ * Wall clock time in microseconds, as the writer stamps frames.
+ */
+
+static int64_t Now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Map the whole object read-only, NULL on failure.
+ */
+
+static TkvlcShmHeader *Map(int fd, size_t *sizePtr)
+{
+  struct stat st;
+  void *map;
+
+  if (fstat(fd, &st) != 0 || st.st_size < TKVLC_SHM_ALIGN) {
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  *sizePtr = st.st_size;
+  return (TkvlcShmHeader *) map;
+}
+
+int main(int argc, char **argv)
+{
+  TkvlcShmHeader *hdr = NULL;
+  char path[256];
+  size_t size = 0;
+  uint64_t want = 0, next, seq;
+  uint64_t frames = 0, missed = 0, broken = 0;
+  uint32_t gen, mapgen = 0, width = 0, height = 0, sum = 0;
+  int64_t latency = 0;
+  int fd = -1, idle;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s NAME ?frames?\n", argv[0]);
+    return 2;
+  }
+  snprintf(path, sizeof(path), "%s%s", (argv[1][0] == '/') ? "" : "/",
+           argv[1]);
+  if (argc > 2) {
+    want = strtoull(argv[2], NULL, 10);
+  }
+
+  /* the writer may not be there yet */
+  for (idle = 0; idle < IDLE_MS; idle++) {
+    if (fd < 0) {
+      fd = shm_open(path, O_RDONLY, 0);
+    }
+    if (fd >= 0 && hdr == NULL) {
+      hdr = Map(fd, &size);
+    }
+    if (hdr != NULL && memcmp(hdr->magic, TKVLC_SHM_MAGIC, 8) == 0) {
+      break;
+    }
+    Nap();
+  }
+  if (idle == IDLE_MS) {
+    fprintf(stderr, "%s: no frame export \"%s\": %s\n", argv[0], path,
+            (fd < 0) ? strerror(errno) : "not initialized");
+    return 2;
+  }
+  if (hdr->version != TKVLC_SHM_VERSION) {
+    fprintf(stderr, "%s: unsupported version %u\n", argv[0], hdr->version);
+    return 2;
+  }
+  mapgen = LOAD(hdr->generation);
+  seq = LOAD(hdr->seq);
+  next = (seq > 0) ? seq : 1;
+
+  idle = 0;
+  while (want == 0 || frames < want) {
+    const TkvlcShmSlot *slot;
+    const unsigned char *data;
+    uint64_t fseq;
+    uint32_t lock, fsum = 0;
+    size_t i, bytes;
+    int fits;
+
+    gen = LOAD(hdr->generation);
+    if (gen & 1) {
+      /* layout changes */
+      Nap();
+      continue;
+    }
+    if (gen != mapgen) {
+      /* grown, map it again */
+      munmap(hdr, size);
+      if ((hdr = Map(fd, &size)) == NULL) {
+        fprintf(stderr, "%s: remap failed: %s\n", argv[0], strerror(errno));
+        return 2;
+      }
+      mapgen = gen;
+      continue;
+    }
+    seq = LOAD(hdr->seq);
+    if (seq < next) {
+      if (++idle >= IDLE_MS) {
+        break;
+      }
+      Nap();
+      continue;
+    }
+    idle = 0;
+    if (seq - next >= hdr->nslots) {
+      /* fell behind by more than the ring holds */
+      missed += seq - hdr->nslots + 1 - next;
+      next = seq - hdr->nslots + 1;
+    }
+    slot = TKVLC_SHM_SLOT(hdr, next);
+    lock = LOAD(slot->lock);
+    if (lock & 1) {
+      /* overwritten right now */
+      missed++;
+      next++;
+      continue;
+    }
+    fseq = slot->seq;
+    bytes = (size_t) slot->width * slot->height * slot->pixel_size;
+    fits = TKVLC_SHM_ALIGN + bytes <= hdr->slot_size;
+    if (fits) {
+      data = TKVLC_SHM_DATA(slot);
+      for (i = 0; i < bytes; i++) {
+        fsum += data[i];
+      }
+    }
+    FENCE();
+    if (!fits || LOAD(slot->lock) != lock ||
+        LOAD(hdr->generation) != gen || fseq == 0 || fseq > next) {
+      /* overwritten or discarded while reading */
+      missed++;
+    } else if (fseq < next) {
+      broken++;
+    } else {
+      frames++;
+      width = slot->width;
+      height = slot->height;
+      latency += Now() - slot->time_us;
+      sum += fsum;
+    }
+    next++;
+  }
+
+  printf("%llu frames, %llu missed, %llu out of sequence, "
+         "last %ux%u, latency %lld us, checksum %08x\n",
+         (unsigned long long) frames, (unsigned long long) missed,
+         (unsigned long long) broken, width, height,
+         (long long) (frames ? latency / (int64_t) frames : 0), sum);
+  munmap(hdr, size);
+  close(fd);
+  return broken ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+#!/usr/bin/tclsh
+#
+# Compare the cost of rendering frames into a photo image with libvlc's
+# RGBA conversion against tkvlc's own planar YUV conversion.
+#
+# usage: yuvbench.tcl videofile ?seconds?
+#
+# For each format and frame size the video is played for some seconds
+# and the average time from lock to display of a frame ("render", which
+# includes libvlc's scaling and conversion) and the time of tkvlc's YUV
+# to RGBA conversion ("convert") are reported in microseconds.
+
+package require Tk
+package require tkvlc
+
+if {[llength $argv] < 1} {
+    puts stderr "usage: $argv0 videofile ?seconds?"
+    exit 1
+}
+set file [lindex $argv 0]
+set secs [expr {[llength $argv] > 1 ? [lindex $argv 1] : 5}]
+
+set photo [image create photo]
+label .l -image $photo
+pack .l
+
+puts [format "%-6s %-10s %8s %8s %8s %8s %s" \
+    format size frames dropped render convert converter]
+foreach fmt {rgba i420 nv12} {
+    foreach size {1280x720 1920x1080 3840x2160} {
+        ::tkvlc::init bench $photo -format $fmt -buffers 4
+        bench size $size
+        bench open $file
+        bench play
+        after [expr {$secs * 1000}] {set done 1}
+        vwait done
+        array set info [bench info]
+        bench stop
+        bench destroy
+        puts [format "%-6s %-10s %8d %8d %8d %8d %s" $fmt $size \
+            $info(frames) $info(dropped) $info(render) $info(convert) \
+            $info(converter)]
+        update
+    }
+}
+exit
@@ -22,7 +22,9 @@ extern "C" {
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
+#include <math.h>
 #include <vlc/vlc.h>
 #include <vlc/libvlc_version.h>
 
@@ -30,6 +32,34 @@ extern "C" {
 #include <windows.h>
 #endif
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/*
+ * Frame export to POSIX shared memory, for photo images.
+ */
+
+#if defined(USE_TK_PHOTO) && !defined(_WIN32)
+#define TKVLC_HAVE_SHM 1
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tkvlcshm.h"
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define TKVLC_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 /*
  * Only the _Init function is exported.
  */
@@ -46,17 +76,116 @@ extern DLLEXPORT int Tkvlc_Init(Tcl_Interp * interp);
 
 #ifdef USE_TK_PHOTO
 
+/*
+ * Atomic helpers for the lock-free frame ring shared between
+ * the libvlc decoder thread and the Tcl thread. Counters which
+ * both threads bump use TKVLC_INCR.
+ */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TKVLC_LOAD(x)       __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define TKVLC_STORE(x, v)   __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define TKVLC_XCHG(x, v)    __atomic_exchange_n(&(x), (v), __ATOMIC_ACQ_REL)
+#define TKVLC_INCR(x)       __atomic_fetch_add(&(x), 1, __ATOMIC_ACQ_REL)
+#define TKVLC_FENCE()       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#elif defined(_WIN32)
+#define TKVLC_LOAD(x)       InterlockedCompareExchange((LONG volatile *) &(x), 0, 0)
+#define TKVLC_STORE(x, v)   InterlockedExchange((LONG volatile *) &(x), (LONG) (v))
+#define TKVLC_XCHG(x, v)    InterlockedExchange((LONG volatile *) &(x), (LONG) (v))
+#define TKVLC_INCR(x)       InterlockedIncrement((LONG volatile *) &(x))
+#define TKVLC_FENCE()       MemoryBarrier()
+#else
+#error "no atomic operations available"
+#endif
+
 /*
  * Frame buffer when rendering to a photo image.
  */
 
 typedef struct {
   struct libVLCData *p;     /* libvlc/Tcl instance data. */
-  struct libVLCEvent *e;    /* Queued frame event or NULL. */
-  int busy;                 /* True during rendering and event being queued. */
-  unsigned char *pixels;    /* RGB frame buffer, size is width*height*3. */
+  int index;                /* Slot in frame ring or -1 for scratch buffer. */
+  unsigned char *pixels;    /* RGB(A) frame buffer, width*height*pixel_size. */
+  unsigned char *yuv[3];    /* Planes decoded by libvlc in planar formats. */
+  unsigned char *dirty;     /* Changed tiles in delta mode or NULL. */
+  int full;                 /* True when whole frame must be uploaded. */
 } libVLCFrame;
 
+/*
+ * Single-producer/single-consumer queue of frame buffer indices.
+ * The head is only advanced by the producer, the tail only by the
+ * consumer, both are free running counters.
+ */
+
+typedef struct {
+  unsigned int head;        /* Next element to write, atomic. */
+  unsigned int tail;        /* Next element to read, atomic. */
+  unsigned int mask;        /* Capacity minus one, a power of two. */
+  int *slots;               /* Queued frame buffer indices. */
+} libVLCRing;
+
+#define TKVLC_MIN_BUFFERS 2
+#define TKVLC_MAX_BUFFERS 64
+#define TKVLC_MAX_SIZE    16384
+#define TKVLC_MAX_WORKERS 7
+#define TKVLC_MAX_FPS     1000
+
+/*
+ * Longest stall in ms of the decoder waiting for a free frame buffer
+ * with -backpressure block, after which the frame is dropped anyway.
+ */
+
+#define TKVLC_BLOCK_MS 1000
+
+/*
+ * Number of slots of a shared memory export.
+ */
+
+#define TKVLC_MIN_SHM_SLOTS 2
+#define TKVLC_MAX_SHM_SLOTS 256
+#define TKVLC_SHM_SLOTS     4
+
+/*
+ * Captured audio with -audiolevel: channels metered at most, bytes of
+ * PCM buffered for the PCM channel (a power of two), and the level in
+ * dBFS reported for silence.
+ */
+
+#define TKVLC_MAX_CHANNELS 8
+#define TKVLC_PCM_RING     (1 << 18)
+#define TKVLC_MIN_DB       -100.0
+
+/*
+ * Tile size in pixels for comparing frames in delta mode.
+ */
+
+#define TKVLC_TILE 32
+
+/*
+ * Pixel formats requested from libvlc. RGBA matches the memory
+ * layout of Tk's photo image store, thus Tk_PhotoPutBlock() can
+ * copy whole frames with a single memcpy().
+ */
+
+#define FMT_RGB  0                      /* "rgb", chroma RV24 */
+#define FMT_RGBA 1                      /* "rgba", chroma RGBA */
+#define FMT_I420 2                      /* "i420", converted to RGBA */
+#define FMT_NV12 3                      /* "nv12", converted to RGBA */
+
+#define FMT_PLANAR(fmt) ((fmt) >= FMT_I420)
+
+static const char *FMT_strs[] = {
+  "rgb", "rgba", "i420", "nv12", NULL
+};
+
+/*
+ * Row converter from YUV to RGBA, see libVLCYuvRow* below.
+ */
+
+typedef void (libVLCYuvRowProc)(const unsigned char *y,
+    const unsigned char *u, const unsigned char *v, unsigned char *dst,
+    int width);
+
 /*
  * Event types for event callback
  */
@@ -67,6 +196,15 @@ typedef struct {
 #define EV_POS_CHANGED   3              /* "position" */
 #define EV_AUDIO_CHANGED 4              /* "audio" */
 #define EV_NEW_FRAME     5              /* "frame" */
+#define EV_LEVEL         6              /* "level" */
+
+#define EV_ALL           0x7F           /* Mask of all event types. */
+
+#define TKVLC_STATIC_OBJV 16            /* Callback words without alloc. */
+
+static const char *EV_strs[] = {
+  "media", "state", "time", "position", "audio", "frame", "level", NULL
+};
 
 /*
  * Event type for Tcl_QueueEvent()
@@ -75,11 +213,47 @@ typedef struct {
 typedef struct libVLCEvent {
   Tcl_Event header;             /* Mandatory header. */
   int type;                     /* See EV_* defines above. */
-  libVLCFrame *f;               /* Pointer to a frame buffer or NULL. */
   struct libVLCData *p;         /* Pointer to libvlc instance data. */
-  struct libVLCEvent *next;     /* Linkage, unused for frame events. */
 } libVLCEvent;
 
+/*
+ * Pending media player event. Records are carved from per player
+ * slabs and recycled through a free list, and pending records are
+ * kept in a doubly linked list, all guarded by ev_lock. A single
+ * Tcl event per burst wakes up the Tcl thread to drain the list.
+ */
+
+typedef struct libVLCRecord {
+  int type;                     /* See EV_* defines above. */
+  int detail;                   /* libvlc event type. */
+  Tcl_WideInt stamp;            /* Time of event in milliseconds. */
+  struct libVLCRecord *prev;    /* Linkage in pending or free list. */
+  struct libVLCRecord *next;    /* Ditto. */
+} libVLCRecord;
+
+#define TKVLC_SLAB 64
+
+typedef struct libVLCSlab {
+  struct libVLCSlab *next;      /* Next slab of player. */
+  libVLCRecord recs[TKVLC_SLAB];
+} libVLCSlab;
+
+/*
+ * Coalescing state of high frequency (time, position and level) events,
+ * at most one of each is pending per media player.
+ */
+
+typedef struct libVLCCoalesce {
+  struct libVLCData *p;         /* Pointer to libvlc instance data. */
+  int type;                     /* EV_TIME_CHANGED, EV_POS_CHANGED or
+                                 * EV_LEVEL. */
+  int pending;                  /* Event or timer outstanding, ev_lock. */
+  double value;                 /* Latest value, ev_lock. */
+  Tcl_WideInt stamp;            /* Time of latest value, ev_lock. */
+  Tcl_Time last;                /* Time of last callback. */
+  Tcl_TimerToken timer;         /* Timer to enforce interval or NULL. */
+} libVLCCoalesce;
+
 #else
 
 #ifdef _WIN32
@@ -90,516 +264,847 @@ uint32_t drawable;
 
 #endif
 
+#ifdef USE_TK_PHOTO
+
+/*
+ * Asynchronous open: the media is created and parsed on a thread, the
+ * result is handed back to the Tcl thread with a libVLCOpenEvent.
+ */
+
+typedef struct libVLCOpen {
+  struct libVLCData *p;                 /* Handle, NULL when destroyed. */
+  struct libVLCOpen *next;              /* Next open in flight on handle. */
+  Tcl_Obj *cmd;                         /* Completion callback. */
+  char *name;                           /* File name or URL. */
+  int is_location;                      /* True for URLs. */
+  libvlc_instance_t *vlc_inst;          /* Referenced libvlc instance. */
+  Tcl_ThreadId tid;                     /* Thread of the handle. */
+  Tcl_Mutex lock;                       /* Guards parsed and cancelled. */
+  Tcl_Condition cond;                   /* Signalled on parse or cancel. */
+  int parsed;                           /* True when parsing ended. */
+  int cancelled;                        /* True when open is cancelled. */
+  libvlc_media_t *media;                /* The media or NULL. */
+  const char *error;                    /* Static error message or NULL. */
+  libvlc_time_t duration;               /* Duration in ms or -1. */
+  int width, height;                    /* Size of first video track. */
+  int ntracks[3];                       /* Audio, video, subtitle tracks. */
+} libVLCOpen;
+
+typedef struct libVLCOpenEvent {
+  Tcl_Event header;                     /* Must be first. */
+  libVLCOpen *o;                        /* Finished open. */
+} libVLCOpenEvent;
+
+/*
+ * Export of frames to a shared memory ring, see tkvlcshm.h. Written
+ * by the decoder thread, replaced by the Tcl thread, both holding
+ * the shm_lock of the handle.
+ */
+
+typedef struct libVLCShm {
+  Tcl_Obj *name;                        /* Name as given to export. */
+  char *path;                           /* Name for shm_open(). */
+  int fd;                               /* Descriptor of the object. */
+  int nslots;                           /* Number of frame slots. */
+  void *hdr;                            /* Mapping, a TkvlcShmHeader. */
+  size_t size;                          /* Size of the mapping. */
+  int error;                            /* errno of a failed resize. */
+} libVLCShm;
+
+#endif
+
 /*
  * libvlc instance data as used as ClientData of the Tcl command.
  */
 
 typedef struct libVLCData {
   libvlc_instance_t *vlc_inst;          /* libvlc library instance data. */
+  int shared;                           /* True when vlc_inst is shared. */
+  Tcl_Obj *vlc_args;                    /* Extra libvlc arguments or NULL. */
+  Tcl_Obj *target;                      /* Photo or window given to init. */
   Tcl_Interp *interp;                   /* Associated Tcl interpreter. */
   Tcl_Command cmd;                      /* Tcl command token. */
   libvlc_media_player_t *media_player;  /* libvlc media player. */
 #ifdef USE_TK_PHOTO
   int repeat;                           /* If true, replay media. */
+  int restarting;                       /* Nonzero while restarting for a new
+                                         * video format, read by libvlc
+                                         * threads. */
+  int restart_pending;                  /* True when a new video format
+                                         * waits for "play". */
+  int loop_a, loop_b;                   /* A-B loop in ms, loop_b 0 if off,
+                                         * read by libvlc threads. */
   int tk_checked;                       /* True when Tk available. */
   Tcl_WideInt window_id;                /* Platform handle, if photo unused. */
 #endif
   Tcl_Obj *file_name;                   /* Filename of last opened media. */
+#ifdef USE_TK_PHOTO
+  libVLCOpen *opening;                  /* Asynchronous open or NULL. */
+  libVLCOpen *opens;                    /* All opens not yet completed. */
+  libvlc_media_list_t *mlist;           /* Playlist or NULL. */
+  libvlc_media_list_player_t *mlplayer; /* Player of playlist or NULL. */
+  Tcl_Obj *playlist;                    /* Names of playlist items. */
+#endif
   int is_location;                      /* Indicate to use location api */
 #ifdef USE_TK_PHOTO
   Tcl_Obj *photo_name;                  /* Name of photo image or NULL. */
-  int width, height;                    /* Width and height for photo image. */
+  int width, height;                    /* Width and height of frames. */
+  int req_width, req_height;            /* Requested size, 0 for native. */
+  int fit;                              /* True to follow photo size. */
+  Tcl_Mutex frame_lock;                 /* Guards frame buffer (re)allocation. */
+  int format;                           /* Pixel format, see FMT_* above. */
+  int pixel_size;                       /* Bytes per pixel of format. */
+  unsigned pitches[3];                  /* Plane pitches, planar formats. */
+  unsigned lines[3];                    /* Plane lines, planar formats. */
   Tcl_ThreadId tid;                     /* Thread identifier of interpreter. */
-  Tcl_Mutex ev_lock;                    /* Mutex for ev_queue. */
-  libVLCEvent *ev_queue;                /* Queued events minus frame events. */
+  int destroyed;                        /* True when command deleted. */
+  Tcl_Mutex ev_lock;                    /* Mutex for event records. */
+  libVLCRecord pending;                 /* List head of pending records. */
+  libVLCRecord *ev_free;                /* Free records. */
+  libVLCSlab *slabs;                    /* Memory of records. */
+  libVLCEvent *doorbell;                /* Queued drain event or NULL. */
   int nCmdObjs;                         /* Event callback information. */
   Tcl_Obj **cmdObjs;                    /* Ditto. */
   int nSavedCmdObjs;                    /* Ditto. */
   Tcl_Obj **savedCmdObjs;               /* Ditto. */
-  libVLCFrame frames[2];                /* Frame buffers for photo images. */
+  libVLCCoalesce coal[3];               /* Time, position, level events. */
+  int interval;                         /* Minimum ms between those. */
+  int values;                           /* True to pass event values. */
+  int batch;                            /* True to pass events as list. */
+  int ev_mask;                          /* Subscribed event types. */
+  Tcl_Obj *ev_names[EV_LEVEL + 1];      /* Shared event name objects. */
+  int ev_attached;                      /* Event types attached in libvlc. */
+  int nbuffers;                         /* Number of frame buffers. */
+  libVLCFrame *frames;                  /* Frame buffers plus scratch. */
+  int held;                             /* Buffer of frame shown last. */
+  libVLCRing ready;                     /* Rendered frames, to Tcl thread. */
+  libVLCRing free;                      /* Displayed frames, to decoder. */
+  int frame_pending;                    /* Frame event queued, atomic. */
+  libVLCEvent *frame_ev;                /* Queued frame event or NULL. */
+  libVLCEvent *frame_next;              /* Next frame event, allocated by
+                                         * the Tcl thread. */
+  int spare;                            /* Unqueued buffer, decoder only. */
+  int mailbox;                          /* True for latest frame delivery. */
+  int latest;                           /* Undelivered frame, atomic. */
+  int delta;                            /* True for dirty tile uploads. */
+  int tiles_x, tiles_y;                 /* Number of tiles in delta mode. */
+  unsigned char *ref;                   /* Last queued frame, decoder only. */
+  int ref_valid;                        /* True when ref is usable. */
+  int synced;                           /* True when photo shows last frame. */
+  unsigned int nframes;                 /* Rendered frames, atomic. */
+  unsigned int ndropped;                /* Dropped frames, atomic. */
+  unsigned int nunchanged;              /* Frames equal to last, atomic. */
+  Tcl_Time lock_time;                   /* Time of last lock, decoder only. */
+  unsigned int render_us;               /* Average lock to display time. */
+  unsigned int convert_us;              /* Average YUV conversion time. */
+  int maxfps;                           /* Photo refresh limit, 0 for none. */
+  Tcl_WideInt next_frame;               /* Pacing deadline, decoder only. */
+  unsigned int nskipped;                /* Frames skipped by pacing, atomic. */
+  int ticking;                          /* Frame timer running, atomic. */
+  Tcl_TimerToken timer;                 /* Frame timer or NULL. */
+  Tcl_WideInt due;                      /* Time of next frame timer tick. */
+  Tcl_Time last_put;                    /* Time of last photo update. */
+  long interval_us;                     /* Average photo update interval. */
+  long jitter_us;                       /* Mean deviation of the interval. */
+  struct libVLCData *standby;           /* Pre-rolled next clip or NULL. */
+  int hidden;                           /* True while being the standby. */
+  int prerolled;                        /* True when first frame is held. */
+  Tcl_WideInt preload_start;            /* Time of preload in us. */
+  Tcl_WideInt switch_start;             /* Time of switch in us, or 0. */
+  long preroll_us;                      /* Preload to first frame. */
+  long switch_us;                       /* Switch to first frame shown. */
+  int headless;                         /* True when frames go to sinks. */
+  int block;                            /* True to stall decoder when full. */
+  int unblock;                          /* Stalls suspended, atomic. */
+  Tcl_Condition free_cond;              /* Signalled when buffers are freed. */
+  unsigned int nblocked;                /* Decoder stalls, atomic. */
+  Tcl_Obj *sink_cmd;                    /* Frame callback or NULL. */
+  Tcl_Obj *sink_chan;                   /* Name of frame channel or NULL. */
+  Tcl_Obj *sink_frame;                  /* Frame awaiting delivery or NULL. */
+  Tcl_Mutex shm_lock;                   /* Guards shm and its contents. */
+  libVLCShm *shm;                       /* Shared memory export or NULL. */
+  int audiolevel;                       /* True when audio is captured. */
+  int achannels;                        /* Channels of audio, atomic. */
+  unsigned arate;                       /* Sample rate of audio. */
+  unsigned int level_seq;               /* Sequence lock of the levels,
+                                         * odd while written, atomic. */
+  float rms[TKVLC_MAX_CHANNELS];        /* RMS of last audio block. */
+  float peak[TKVLC_MAX_CHANNELS];       /* Peak of last audio block. */
+  unsigned int nablocks;                /* Audio blocks metered, atomic. */
+  Tcl_Obj *pcm_chan;                    /* Name of PCM channel or NULL. */
+  int pcm_on;                           /* True to fill pcm, atomic. */
+  unsigned char *pcm;                   /* PCM ring or NULL. */
+  unsigned int pcm_head;                /* Write offset, audio thread. */
+  unsigned int pcm_tail;                /* Read offset, Tcl thread. */
+  int pcm_pending;                      /* PCM event queued, atomic. */
+  libVLCEvent *pcm_ev;                  /* Queued PCM event or NULL. */
+  unsigned int npcmdropped;             /* Audio blocks not written to the
+                                         * channel, ring full, atomic. */
 #endif
 } libVLCData;
 
 
-#ifdef USE_TK_PHOTO
+/*
+ * libvlc instances are expensive (plugin cache scan, core allocation),
+ * so handles share one instance per set of libvlc arguments. The list
+ * is process wide since handles may live in different interpreters and
+ * threads.
+ */
+
+typedef struct libVLCInstance {
+  libvlc_instance_t *vlc_inst;          /* libvlc library instance, NULL
+                                         * while created or on failure. */
+  char *key;                            /* Arguments as list, NULL if not
+                                         * shared. */
+  int refcount;                         /* Number of handles using it,
+                                         * including waiters. */
+  int creating;                         /* True while libvlc_new runs. */
+  Tcl_Condition cond;                   /* Signalled when created. */
+  struct libVLCInstance *next;          /* Next instance in list. */
+} libVLCInstance;
+
+TCL_DECLARE_MUTEX(instMutex)
+static libVLCInstance *instList = NULL; /* List of instances in use. */
+
+/*
+ * Instances created in advance by ::tkvlc::prewarm on a background
+ * thread. They hold a reference until exit, so handles created later
+ * with the same arguments find the libvlc core ready.
+ */
+
+typedef struct libVLCPrewarm {
+  char *key;                            /* Arguments as list. */
+  libvlc_instance_t *vlc_inst;          /* Instance, set by the thread. */
+  Tcl_ThreadId tid;                     /* Thread creating the instance. */
+  int joinable;                         /* True when tid must be joined. */
+  struct libVLCPrewarm *next;           /* Next prewarmed instance. */
+} libVLCPrewarm;
+
+static libVLCPrewarm *prewarmList = NULL;       /* Guarded by instMutex. */
+static int prewarmHandler = 0;          /* True when exit handler set. */
+
+/*
+ * Media probe: ::tkvlc::probe parses media without creating players on
+ * a pool of threads, each thread taking the next item not found in the
+ * cache. The results are turned into Tcl objects in the calling thread.
+ */
+
+#define TKVLC_MIN_PROBE_THREADS 4
+#define TKVLC_MAX_PROBE_THREADS 64
+
+typedef struct libVLCProbeTrack {
+  int type;                             /* libvlc_track_type_t. */
+  char codec[5];                        /* FourCC as string. */
+  int width, height;                    /* Video size. */
+  unsigned fps_num, fps_den;            /* Video frame rate. */
+  int channels, rate;                   /* Audio format. */
+} libVLCProbeTrack;
+
+typedef struct libVLCProbeItem {
+  struct libVLCProbe *job;              /* Probe the item belongs to. */
+  const char *path;                     /* Normalized file name. */
+  int parsed;                           /* True when parsing ended, guarded
+                                         * by the lock of the job. */
+  const char *error;                    /* Static error message or NULL. */
+  libvlc_time_t duration;               /* Duration in ms or -1. */
+  unsigned ntracks;                     /* Number of tracks. */
+  libVLCProbeTrack *tracks;             /* Tracks or NULL. */
+} libVLCProbeItem;
+
+typedef struct libVLCProbe {
+  libvlc_instance_t *vlc_inst;          /* Referenced libvlc instance. */
+  libVLCProbeItem *items;               /* Items to parse. */
+  int nitems;                           /* Number of items. */
+  int next;                             /* Next item to take. */
+  Tcl_Mutex lock;                       /* Guards next and parsed. */
+  Tcl_Condition cond;                   /* Signalled when parsed. */
+} libVLCProbe;
+
+/*
+ * Thumbnails: ::tkvlc::thumbnail decodes one frame per item on a pool
+ * of threads, each thread with its own muted media player whose vmem
+ * callbacks render RGB at thumbnail size.
+ */
+
+#define TKVLC_MAX_THUMB_THREADS 64
+#define TKVLC_MAX_THUMB_SIZE    4096
+
+typedef struct libVLCThumb {
+  const char *path;                     /* Normalized file name. */
+  double offset;                        /* Time of the frame in seconds. */
+  int width, height;                    /* Size of the thumbnail. */
+  unsigned char *pixels;                /* RGB pixels or NULL on failure. */
+} libVLCThumb;
+
+typedef struct libVLCThumbs {
+  libvlc_instance_t *vlc_inst;          /* Referenced libvlc instance. */
+  libVLCThumb *items;                   /* Items to decode. */
+  int nitems;                           /* Number of items. */
+  int next;                             /* Next item to take. */
+  int max_width, max_height;            /* Bounding box of thumbnails. */
+  int timeout;                          /* Time limit per item in ms. */
+  Tcl_Mutex lock;                       /* Guards next. */
+} libVLCThumbs;
+
+typedef struct libVLCThumbWorker {
+  libVLCThumbs *job;                    /* Thumbnails being made. */
+  libVLCThumb *item;                    /* Item being decoded or NULL. */
+  unsigned char *buffer;                /* Picture buffer of libvlc. */
+  int width, height;                    /* Size of the picture buffer. */
+  int done;                             /* True when the frame is taken. */
+  Tcl_Mutex lock;                       /* Guards item and done. */
+  Tcl_Condition cond;                   /* Signalled when done. */
+} libVLCThumbWorker;
+
+/*
+ * Waveforms: ::tkvlc::waveform decodes the audio of a file through the
+ * smem stream output as fast as possible and keeps the minimum and
+ * maximum sample of each bucket of TKVLC_WAVE_BUCKET samples. Coarser
+ * levels merge TKVLC_WAVE_FACTOR buckets of the level below. The
+ * header is also the header of the cache file, followed by the levels
+ * as pairs of 16 bit minimum and maximum in native byte order.
+ */
+
+#define TKVLC_WAVE_MAGIC      "TKVLCWF1"
+#define TKVLC_WAVE_BUCKET     256
+#define TKVLC_WAVE_FACTOR     16
+#define TKVLC_WAVE_LEVELS     3
+#define TKVLC_MAX_WAVE_LEVELS 6
+
+/*
+ * Limits for trusting a cache file. 2^36 samples per channel are more
+ * than a day at 768 kHz and keep level 0 below 1 GB, so that byte
+ * counts of a level fit a Tcl_Size of Tcl 8.
+ */
+
+#define TKVLC_MAX_WAVE_RATE     768000
+#define TKVLC_MAX_WAVE_CHANNELS 64
+#define TKVLC_MAX_WAVE_FRAMES   ((Tcl_WideInt) 1 << 36)
+
+typedef struct libVLCWaveHeader {
+  char magic[8];                        /* TKVLC_WAVE_MAGIC. */
+  int rate;                             /* Sample rate. */
+  int channels;                         /* Number of channels. */
+  int nlevels;                          /* Number of levels. */
+  int bucket;                           /* Samples per bucket of level 0. */
+  Tcl_WideInt size;                     /* Size of the media file. */
+  Tcl_WideInt mtime;                    /* Modification time of it. */
+  Tcl_WideInt frames;                   /* Samples per channel. */
+} libVLCWaveHeader;
+
+typedef struct libVLCWave {
+  libVLCWaveHeader hdr;                 /* Format and size. */
+  short *peaks[TKVLC_MAX_WAVE_LEVELS];  /* Minimum and maximum per bucket. */
+  Tcl_WideInt count[TKVLC_MAX_WAVE_LEVELS]; /* Buckets per level. */
+  Tcl_WideInt alloc;                    /* Buckets allocated for level 0. */
+  unsigned char *buffer;                /* Render buffer of smem. */
+  size_t bufsize;                       /* Size of the buffer. */
+  float lo, hi;                         /* Bucket being filled. */
+  int filled;                           /* Samples in it. */
+  int bad_format;                       /* True when not float samples. */
+  int too_long;                         /* True when over the frame limit. */
+} libVLCWave;
 
 /*
  *----------------------------------------------------------------------
  *
- * silence --
+ * libVLCFreeInstance --
  *
- *      Dummy procedure to silence libvlc log messages.
+ *      Free an instance list entry no other thread can reach.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      Memory is freed.
  *
  *----------------------------------------------------------------------
  */
 
-static void silence(void *data, int level, const libvlc_log_t *ctx,
-            const char *fmt, va_list args)
+static void libVLCFreeInstance(libVLCInstance *e)
 {
+  Tcl_ConditionFinalize(&e->cond);
+  if (e->key != NULL) {
+    ckfree(e->key);
+  }
+  ckfree(e);
 }
 
-#ifdef linux
 /*
  *----------------------------------------------------------------------
  *
- * Raspi_complain --
+ * libVLCNewInstance --
  *
- *      Half baked check for running on RaspberryPi.
+ *      Return a libvlc instance for the given arguments. When shared
+ *      is true, an existing instance created with the same arguments
+ *      is reused, otherwise a new instance is created. libvlc_new runs
+ *      without instMutex held, only callers asking for the same
+ *      arguments wait for it to finish.
  *
  * Results:
- *      A standard Tcl result; TCL_ERROR when running on RaspberryPi
- *      with and error message.
+ *      The libvlc instance or NULL on error.
  *
  * Side effects:
- *      None.
+ *      The reference count of the instance is incremented.
  *
  *----------------------------------------------------------------------
  */
 
-static int Raspi_complain(Tcl_Interp *interp)
+static libvlc_instance_t *libVLCNewInstance(int argc, const char **argv,
+                                            int shared)
 {
-  FILE *fp;
-
-  fp = fopen("/proc/cpuinfo", "r");
-  if (fp != NULL) {
-    char line[256];
-    int check = 0;
-
-    while (fgets(line, sizeof(line), fp) != NULL) {
-      check = strncmp(line, "Hardware", 8) == 0;
-      if (check) {
+  libVLCInstance *e, **prev;
+  libvlc_instance_t *inst;
+  char *key = Tcl_Merge(argc, argv);
+
+  Tcl_MutexLock(&instMutex);
+  if (shared) {
+    for (e = instList; e != NULL; e = e->next) {
+      if (e->key != NULL && strcmp(e->key, key) == 0) {
+        e->refcount++;
+        while (e->creating) {
+          Tcl_ConditionWait(&e->cond, &instMutex, NULL);
+        }
+        inst = e->vlc_inst;
+        if (inst == NULL && --e->refcount == 0) {
+          /* creation failed, already unlinked */
+          libVLCFreeInstance(e);
+        }
+        Tcl_MutexUnlock(&instMutex);
+        ckfree(key);
+        return inst;
+      }
+    }
+  }
+  e = (libVLCInstance *) ckalloc(sizeof(*e));
+  e->vlc_inst = NULL;
+  e->key = shared ? key : NULL;
+  e->refcount = 1;
+  e->creating = 1;
+  e->cond = NULL;
+  e->next = instList;
+  instList = e;
+  Tcl_MutexUnlock(&instMutex);
+
+  inst = libvlc_new(argc, argv);
+
+  Tcl_MutexLock(&instMutex);
+  e->vlc_inst = inst;
+  e->creating = 0;
+  Tcl_ConditionNotify(&e->cond);
+  if (inst == NULL) {
+    /* later callers try again, waiters free the entry */
+    for (prev = &instList; *prev != NULL; prev = &(*prev)->next) {
+      if (*prev == e) {
+        *prev = e->next;
         break;
       }
     }
-    fclose(fp);
-    if (!check || strstr(line, "BCM2") == NULL) {
-      return TCL_OK;
+    if (--e->refcount == 0) {
+      libVLCFreeInstance(e);
     }
   }
-  Tcl_SetResult(interp, "unsupported hardware", TCL_STATIC);
-  return TCL_ERROR;
+  Tcl_MutexUnlock(&instMutex);
+  if (!shared) {
+    ckfree(key);
+  }
+  return inst;
 }
-#endif
 
 /*
  *----------------------------------------------------------------------
  *
- * Tk_check --
+ * libVLCReleaseInstance --
  *
- *      Lazy load Tk and check for its availability.
+ *      Give up a libvlc instance obtained from libVLCNewInstance.
  *
  * Results:
- *      A standard Tcl result.
+ *      None.
  *
  * Side effects:
- *      Tk package may be loaded.
+ *      The instance is released when its last user goes away.
  *
  *----------------------------------------------------------------------
  */
 
-static int Tk_check(libVLCData *p, Tcl_Interp *interp)
+static void libVLCReleaseInstance(libvlc_instance_t *inst)
 {
-  if (p->tk_checked > 0) {
-    return TCL_OK;
-  } else if (p->tk_checked < 0) {
-    Tcl_SetResult(interp, "can't find package Tk", TCL_STATIC);
-    return TCL_ERROR;
+  libVLCInstance *e, **prev;
+
+  if (inst == NULL) {
+    return;
   }
-#ifdef USE_TK_STUBS
-  if (Tk_InitStubs(interp, TCL_VERSION, 0) == NULL) {
-    p->tk_checked = -1;
-    return TCL_ERROR;
+  Tcl_MutexLock(&instMutex);
+  for (prev = &instList; (e = *prev) != NULL; prev = &e->next) {
+    if (e->vlc_inst == inst) {
+      if (--e->refcount > 0) {
+        e = NULL;
+      } else {
+        *prev = e->next;
+      }
+      break;
+    }
   }
-#else
-  if (Tcl_PkgRequire(interp, "Tk", TCL_VERSION, 0) == NULL) {
-    p->tk_checked = -1;
-    return TCL_ERROR;
+  Tcl_MutexUnlock(&instMutex);
+  if (e != NULL) {
+    libvlc_release(e->vlc_inst);
+    libVLCFreeInstance(e);
   }
-#endif
-  p->tk_checked = 1;
-  return TCL_OK;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * DoEventCallback --
+ * libVLCPrewarmThread --
  *
- *      Perform callback given libVLCEvent.
+ *      Thread procedure creating a prewarmed libvlc instance.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      Many since Tcl code is evaluated.
+ *      A shared libvlc instance is created.
  *
  *----------------------------------------------------------------------
  */
 
-static void DoEventCallback(libVLCData *p, libVLCEvent *e)
+static Tcl_ThreadCreateType libVLCPrewarmThread(ClientData clientData)
 {
-  if (p->nCmdObjs > 0 && p->cmdObjs != NULL) {
-    Tcl_Interp *interp = p->interp;
-    Tcl_InterpState state;
-    int i, ret, nCmdObjs;
-    Tcl_Obj **cmdObjs, *list;
-    const char *evname;
-
-    if (p->repeat && (e->type == EV_STATE_CHANGED)) {
-      if (libvlc_media_player_get_state(p->media_player) == libvlc_Ended) {
-        if (p->file_name != NULL) {
-          char *filename = Tcl_GetString(p->file_name);
-          libvlc_media_t *media;
-
-          if(p->is_location) {
-            media = libvlc_media_new_location(p->vlc_inst, filename);
-          } else {
-            media = libvlc_media_new_path(p->vlc_inst, filename);
-          }
-          if (media != NULL) {
-            libvlc_media_player_set_media(p->media_player, media);
-    #if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
-            int status =
-                    libvlc_media_parse_with_options(media,
-                                libvlc_media_parse_local, -1);
-
-                if (status < 0) {
-                    libvlc_media_release(media);
-                }
-    #else
-            libvlc_media_parse(media);
-    #endif
-            libvlc_media_player_play(p->media_player);
-            libvlc_media_release(media);
-          }
-        }
-      }
-    }
-    Tcl_Preserve(p);
-    Tcl_Preserve(interp);
-    state = Tcl_SaveInterpState(interp, TCL_OK);
-    nCmdObjs = p->nCmdObjs;
-    cmdObjs = p->cmdObjs;
-    p->nCmdObjs = 0;
-    p->cmdObjs = NULL;
-    list = Tcl_NewListObj(nCmdObjs, cmdObjs);
-    switch (e->type) {
-      case EV_MEDIA_CHANGED:
-        evname = "media";
-        break;
-      case EV_STATE_CHANGED:
-        evname = "state";
-        break;
-      case EV_TIME_CHANGED:
-        evname = "time";
-        break;
-      case EV_POS_CHANGED:
-        evname = "position";
-        break;
-      case EV_AUDIO_CHANGED:
-        evname = "audio";
-        break;
-      case EV_NEW_FRAME:
-        evname = "frame";
-        break;
-      default:
-        evname = "unknown";
-        break;
-    }
-    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj(evname, -1));
-    Tcl_IncrRefCount(list);
-    ret = Tcl_GlobalEvalObj(interp, list);
-    Tcl_DecrRefCount(list);
-    if (ret != TCL_OK) {
-      Tcl_AddErrorInfo(interp, "\n    (tkvlc event callback)");
-      Tcl_BackgroundException(interp, ret);
-    }
-    if (p->cmdObjs != NULL) {
-      /* new callback installed */
-      for (i = 0; i < nCmdObjs; i++) {
-          Tcl_DecrRefCount(cmdObjs[i]);
-      }
-      ckfree(cmdObjs);
-    } else {
-      p->nCmdObjs = nCmdObjs;
-      p->cmdObjs = cmdObjs;
-    }
-    Tcl_RestoreInterpState(interp, state);
-    Tcl_Release(interp);
-    Tcl_Release(p);
+  libVLCPrewarm *w = (libVLCPrewarm *) clientData;
+  Tcl_Size argc;
+  const char **argv;
+
+  if (Tcl_SplitList(NULL, w->key, &argc, &argv) == TCL_OK) {
+    w->vlc_inst = libVLCNewInstance(argc, argv, 1);
+    ckfree((char *) argv);
   }
+  TCL_THREAD_CREATE_RETURN;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * libVLChandlerTcl --
+ * libVLCPrewarmExit --
  *
- *      Procedure called in Tcl thread to report a media player event.
+ *      Exit handler to release prewarmed instances.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      A Tcl callback is evaluated.
+ *      Waits for prewarm threads and releases their instances.
  *
  *----------------------------------------------------------------------
  */
 
-static int libVLChandlerTcl(Tcl_Event *ev, int flags)
+static void libVLCPrewarmExit(ClientData clientData)
 {
-  libVLCEvent *e = (libVLCEvent *) ev;
-
-  if (e->p != NULL) {
-    libVLCData *p = e->p;
-    libVLCEvent *this, *prev;
-
-    /* remove event from event */
-    this = p->ev_queue;
-    prev = NULL;
-    while (this != NULL) {
-      if (this == e) {
-        if (prev != NULL) {
-          prev->next = this->next;
-        } else {
-          p->ev_queue = this->next;
-        }
-        break;
-      }
-      prev = this;
-      this = this->next;
+  libVLCPrewarm *w, *list;
+
+  Tcl_MutexLock(&instMutex);
+  list = prewarmList;
+  prewarmList = NULL;
+  prewarmHandler = 0;
+  Tcl_MutexUnlock(&instMutex);
+  while (list != NULL) {
+    w = list;
+    list = w->next;
+    if (w->joinable) {
+      Tcl_JoinThread(w->tid, NULL);
     }
-    /* invoke callback, if any */
-    DoEventCallback(p, e);
+    libVLCReleaseInstance(w->vlc_inst);
+    ckfree(w->key);
+    ckfree(w);
   }
-  return 1;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * libVLChandler --
+ * libVLCStartPrewarm --
  *
- *      Procedure called in libvlc context to report a media player
- *      event.
+ *      Start creating a shared libvlc instance for the given
+ *      arguments on a background thread, unless already done. Without
+ *      thread support the instance is created right away.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      A Tcl event is queued and the thread owning the media player
- *      is alerted.
+ *      Takes ownership of key, a thread may be created.
  *
  *----------------------------------------------------------------------
  */
 
-static void libVLChandler(const struct libvlc_event_t *ev, void *clientData)
+static void libVLCStartPrewarm(char *key)
 {
-  libVLCData *p = (libVLCData *) clientData;
-  libVLCEvent *e;
-  int type;
+  libVLCPrewarm *w;
 
-  if (p->media_player == NULL) {
-    return;
-  }
-  switch (ev->type) {
-    case libvlc_MediaPlayerMediaChanged:
-      type = EV_MEDIA_CHANGED;
-      break;
-    case libvlc_MediaPlayerNothingSpecial:
-    case libvlc_MediaPlayerOpening:
-    case libvlc_MediaPlayerBuffering:
-    case libvlc_MediaPlayerPlaying:
-    case libvlc_MediaPlayerPaused:
-    case libvlc_MediaPlayerStopped:
-    case libvlc_MediaPlayerForward:
-    case libvlc_MediaPlayerBackward:
-    case libvlc_MediaPlayerEndReached:
-    case libvlc_MediaPlayerEncounteredError:
-      type = EV_STATE_CHANGED;
-      break;
-    case libvlc_MediaPlayerTimeChanged:
-      type = EV_TIME_CHANGED;
-      break;
-    case libvlc_MediaPlayerPositionChanged:
-      type = EV_POS_CHANGED;
-      break;
-    case libvlc_MediaPlayerMuted:
-    case libvlc_MediaPlayerUnmuted:
-    case libvlc_MediaPlayerAudioVolume:
-    case libvlc_MediaPlayerAudioDevice:
-      type = EV_AUDIO_CHANGED;
-      break;
-    default:
+  Tcl_MutexLock(&instMutex);
+  for (w = prewarmList; w != NULL; w = w->next) {
+    if (strcmp(w->key, key) == 0) {
+      Tcl_MutexUnlock(&instMutex);
+      ckfree(key);
       return;
+    }
+  }
+  w = (libVLCPrewarm *) ckalloc(sizeof(*w));
+  w->key = key;
+  w->vlc_inst = NULL;
+  w->joinable = 0;
+  w->next = prewarmList;
+  prewarmList = w;
+  if (!prewarmHandler) {
+    Tcl_CreateExitHandler(libVLCPrewarmExit, NULL);
+    prewarmHandler = 1;
+  }
+  /* handles with the same arguments wait for the thread's instance */
+  if (Tcl_CreateThread(&w->tid, libVLCPrewarmThread, w,
+                       TCL_THREAD_STACK_DEFAULT,
+                       TCL_THREAD_JOINABLE) == TCL_OK) {
+    w->joinable = 1;
+  }
+  Tcl_MutexUnlock(&instMutex);
+  if (!w->joinable) {
+    libVLCPrewarmThread(w);
   }
-  e = (libVLCEvent *) ckalloc(sizeof(*e));
-  e->header.proc = libVLChandlerTcl;
-  e->header.nextPtr = NULL;
-  e->type = type;
-  e->f = NULL;
-  e->p = p;
-  Tcl_MutexLock(&p->ev_lock);
-  e->next = p->ev_queue;
-  p->ev_queue = e;
-  Tcl_ThreadQueueEvent(p->tid, &e->header, TCL_QUEUE_TAIL);
-  Tcl_ThreadAlert(p->tid);
-  Tcl_MutexUnlock(&p->ev_lock);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * libVLCready --
+ * libVLCNumCpus --
  *
- *      Procedure called by the Tcl event mechanism. The event
- *      indicates a filled video buffer which is copied to the
- *      photo image.
+ *      Return the number of online processors.
  *
  * Results:
- *      Always true (event handled).
+ *      The number of processors, at least 1.
  *
  * Side effects:
- *      Playback is stopped when the photo image is invalid.
- *      A frame event callback is invoked.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-static int libVLCready(Tcl_Event *ev, int flags)
+static int libVLCNumCpus(void)
 {
-  libVLCEvent *e = (libVLCEvent *) ev;
-  libVLCFrame *f = e->f;
-  libVLCData *p;
-  Tcl_Interp *interp;
-  Tk_PhotoHandle photo;
-  int docb = 0;
+  int ncpus = 1;
 
-  if (f == NULL) {
-    /* about to tear down media player */
-    return 1;
+#ifdef _WIN32
+  SYSTEM_INFO si;
+
+  GetSystemInfo(&si);
+  ncpus = si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return (ncpus < 1) ? 1 : ncpus;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCProbeParsed --
+ *
+ *      libvlc event handler for the end of parsing a probed media.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Wakes up the probe threads.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCProbeParsed(const struct libvlc_event_t *ev,
+                              void *clientData)
+{
+  libVLCProbeItem *item = (libVLCProbeItem *) clientData;
+
+  Tcl_MutexLock(&item->job->lock);
+  item->parsed = 1;
+  Tcl_ConditionNotify(&item->job->cond);
+  Tcl_MutexUnlock(&item->job->lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCProbeMedia --
+ *
+ *      Parse one probed media and record its duration and tracks.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The item is filled in.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCProbeMedia(libVLCProbeItem *item)
+{
+  libVLCProbe *job = item->job;
+  libvlc_media_t *media;
+
+  media = libvlc_media_new_path(job->vlc_inst, item->path);
+  if (media == NULL) {
+    item->error = "libvlc_media_new_path failed.";
+    return;
   }
-  p = f->p;
-  interp = p->interp;
-  photo = Tk_FindPhoto(interp, Tcl_GetString(p->photo_name));
-  if (photo == NULL) {
-    libvlc_media_player_stop(p->media_player);
-  } else if (libvlc_media_player_is_playing(p->media_player) == 1) {
-    Tk_PhotoImageBlock blk;
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
+  {
+    libvlc_event_manager_t *em = libvlc_media_event_manager(media);
+
+    libvlc_event_attach(em, libvlc_MediaParsedChanged, libVLCProbeParsed,
+                        item);
+    if (libvlc_media_parse_with_options(media, libvlc_media_parse_local,
+                                        -1) < 0) {
+      item->error = "libvlc_media_parse_with_options failed.";
+    } else {
+      Tcl_MutexLock(&job->lock);
+      while (!item->parsed && libvlc_media_get_parsed_status(media) == 0) {
+        /* the parsed status is polled, too, in case the event is lost */
+        Tcl_Time t = { 0, 50000 };
 
-    blk.width = p->width;
-    blk.height = p->height;
-    blk.pixelSize = 3;
-    blk.pitch = blk.width * blk.pixelSize;
-    blk.pixelPtr = f->pixels;
-    blk.offset[0] = 0;
-    blk.offset[1] = 1;
-    blk.offset[2] = 2;
-    blk.offset[3] = 3;
-    if (Tk_PhotoExpand(interp, photo, blk.width, blk.height) == TCL_OK) {
-      if (Tk_PhotoPutBlock(interp, photo, &blk, 0, 0, blk.width, blk.height,
-               TK_PHOTO_COMPOSITE_SET) == TCL_OK) {
-          docb = 1;
+        Tcl_ConditionWait(&job->cond, &job->lock, &t);
+      }
+      Tcl_MutexUnlock(&job->lock);
+      if (libvlc_media_get_parsed_status(media) !=
+          libvlc_media_parsed_status_done) {
+        item->error = "parsing media failed";
       }
     }
+    libvlc_event_detach(em, libvlc_MediaParsedChanged, libVLCProbeParsed,
+                        item);
   }
-  Tcl_ResetResult(interp);
-  f->busy = 0;
-  f->e = NULL;
-  if (docb) {
-    /* invoke callback, if any */
-    DoEventCallback(p, e);
+#else
+  libvlc_media_parse(media);
+#endif
+  if (item->error == NULL) {
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(2, 1, 0, 0)
+    libvlc_media_track_t **tracks;
+    unsigned i, n = libvlc_media_tracks_get(media, &tracks);
+
+    if (n > 0) {
+      item->tracks = (libVLCProbeTrack *) ckalloc(n * sizeof(*item->tracks));
+      memset(item->tracks, 0, n * sizeof(*item->tracks));
+    }
+    for (i = 0; i < n; i++) {
+      libVLCProbeTrack *t = &item->tracks[i];
+      int k;
+
+      t->type = tracks[i]->i_type;
+      for (k = 0; k < 4; k++) {
+        t->codec[k] = (char) ((tracks[i]->i_codec >> (8 * k)) & 0xFF);
+      }
+      /* FourCCs are padded with blanks */
+      for (k = 3; k >= 0 && (t->codec[k] == ' ' || t->codec[k] == 0); k--) {
+        t->codec[k] = 0;
+      }
+      if (t->type == libvlc_track_video) {
+        t->width = tracks[i]->video->i_width;
+        t->height = tracks[i]->video->i_height;
+        t->fps_num = tracks[i]->video->i_frame_rate_num;
+        t->fps_den = tracks[i]->video->i_frame_rate_den;
+      } else if (t->type == libvlc_track_audio) {
+        t->channels = tracks[i]->audio->i_channels;
+        t->rate = tracks[i]->audio->i_rate;
+      }
+    }
+    item->ntracks = n;
+    if (n > 0) {
+      libvlc_media_tracks_release(tracks, n);
+    }
+#endif
+    item->duration = libvlc_media_get_duration(media);
   }
-  return 1;
+  libvlc_media_release(media);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * libVLClock --
+ * libVLCProbeThread --
  *
- *      Procedure called in libvlc context when a new video frame is
- *      to be decoded.
+ *      Thread procedure parsing items of a probe until none is left.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      Items of the probe are filled in.
  *
  *----------------------------------------------------------------------
  */
 
-static void *libVLClock(void *clientData, void **planes)
+static Tcl_ThreadCreateType libVLCProbeThread(ClientData clientData)
 {
-  libVLCData *p = (libVLCData *) clientData;
-  int index = 0;
+  libVLCProbe *job = (libVLCProbe *) clientData;
+
+  for (;;) {
+    int i;
 
-  if (!p->frames[index].busy) {
-    ++index;
+    Tcl_MutexLock(&job->lock);
+    i = job->next++;
+    Tcl_MutexUnlock(&job->lock);
+    if (i >= job->nitems) {
+      break;
+    }
+    libVLCProbeMedia(&job->items[i]);
   }
-  p->frames[index].busy = 1;
-  planes[0] = p->frames[index].pixels;
-  return &p->frames[index];
+  TCL_THREAD_CREATE_RETURN;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * libVLCdisplay --
+ * libVLCRunThreads --
  *
- *      Procedure called by libvlc when a new video frame is
- *      to be displayed.
+ *      Run a thread procedure on nthreads threads, the calling thread
+ *      included, and wait for all of them.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      A Tcl event is queued and the thread owning the media player
- *      is alerted.
+ *      Threads are created and joined.
  *
  *----------------------------------------------------------------------
  */
 
-static void libVLCdisplay(void *clientData, void *picture)
+static void libVLCRunThreads(Tcl_ThreadCreateProc *proc,
+                             ClientData clientData, int nthreads)
 {
-  libVLCData *p = (libVLCData *) clientData;
-  libVLCFrame *f = (libVLCFrame *) picture;
-  libVLCEvent *e;
-
-  if ((f == &p->frames[0] && p->frames[1].busy) ||
-      (f == &p->frames[1] && p->frames[0].busy)) {
-    /* other frame buffer still in use, drop frame */
-    return;
+  Tcl_ThreadId *tids;
+  int i, n = 0;
+
+  tids = (Tcl_ThreadId *) ckalloc(nthreads * sizeof(Tcl_ThreadId));
+  for (i = 1; i < nthreads; i++) {
+    if (Tcl_CreateThread(&tids[n], proc, clientData,
+                         TCL_THREAD_STACK_DEFAULT,
+                         TCL_THREAD_JOINABLE) == TCL_OK) {
+      n++;
+    }
   }
-  e = (libVLCEvent *) ckalloc(sizeof(*e));
-  e->header.proc = libVLCready;
-  e->header.nextPtr = NULL;
-  e->type = EV_NEW_FRAME;
-  e->f = f;
-  e->p = NULL;
-  /* not queued to ev_queue but remembered in frame buffer */
-  e->next = NULL;
-  f->e = e;
-  Tcl_ThreadQueueEvent(p->tid, &e->header, TCL_QUEUE_TAIL);
-  Tcl_ThreadAlert(p->tid);
+  proc(clientData);
+  for (i = 0; i < n; i++) {
+    Tcl_JoinThread(tids[i], NULL);
+  }
+  ckfree((char *) tids);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * libVLCstatestr --
+ * libVLCProbeInfo --
  *
- *      Return current state as string.
+ *      Make the dictionary describing a probed item.
  *
  * Results:
- *      String pointer.
+ *      A new Tcl object.
  *
  * Side effects:
  *      None.
@@ -607,912 +1112,8305 @@ static void libVLCdisplay(void *clientData, void *picture)
  *----------------------------------------------------------------------
  */
 
-static const char *libVLCstatestr(libVLCData *p)
+static Tcl_Obj *libVLCProbeInfo(libVLCProbeItem *item)
 {
-  const char *string;
-  libvlc_state_t state;
-
-  /* get the current state of the media player (playing, paused, ...) */
-  state = libvlc_media_player_get_state(p->media_player);
-  if (state == libvlc_NothingSpecial) {
-    string = "idle";
-  } else if (state == libvlc_Opening) {
-    string = "opening";
-  } else if (state == libvlc_Buffering) {
-    string = "buffering";
-  } else if (state == libvlc_Playing) {
-    string = "playing";
-  } else if (state == libvlc_Paused) {
-    string = "paused";
-  } else if (state == libvlc_Stopped) {
-    string = "stopped";
-  } else if (state == libvlc_Ended) {
-    string = "ended";
-  } else if (state == libvlc_Error) {
-    string = "error";
-  } else {
-    string = "unknown";
+  Tcl_Obj *info = Tcl_NewObj(), *tracks = Tcl_NewObj();
+  int width = 0, height = 0, ntracks[3] = { 0, 0, 0 };
+  unsigned i;
+
+  if (item->error != NULL) {
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("error", -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj(item->error, -1));
+    return info;
   }
-  return string;
+  for (i = 0; i < item->ntracks; i++) {
+    libVLCProbeTrack *t = &item->tracks[i];
+    Tcl_Obj *track = Tcl_NewObj();
+    const char *type;
+
+    switch (t->type) {
+      case libvlc_track_audio:
+        type = "audio";
+        ntracks[0]++;
+        break;
+      case libvlc_track_video:
+        type = "video";
+        if (ntracks[1]++ == 0) {
+          width = t->width;
+          height = t->height;
+        }
+        break;
+      case libvlc_track_text:
+        type = "subtitle";
+        ntracks[2]++;
+        break;
+      default:
+        type = "unknown";
+        break;
+    }
+    Tcl_ListObjAppendElement(NULL, track, Tcl_NewStringObj("type", -1));
+    Tcl_ListObjAppendElement(NULL, track, Tcl_NewStringObj(type, -1));
+    Tcl_ListObjAppendElement(NULL, track, Tcl_NewStringObj("codec", -1));
+    Tcl_ListObjAppendElement(NULL, track, Tcl_NewStringObj(t->codec, -1));
+    if (t->type == libvlc_track_video) {
+      Tcl_ListObjAppendElement(NULL, track, Tcl_NewStringObj("width", -1));
+      Tcl_ListObjAppendElement(NULL, track, Tcl_NewIntObj(t->width));
+      Tcl_ListObjAppendElement(NULL, track, Tcl_NewStringObj("height", -1));
+      Tcl_ListObjAppendElement(NULL, track, Tcl_NewIntObj(t->height));
+      Tcl_ListObjAppendElement(NULL, track, Tcl_NewStringObj("fps", -1));
+      Tcl_ListObjAppendElement(NULL, track, Tcl_NewDoubleObj(t->fps_den ?
+          (double) t->fps_num / t->fps_den : 0.0));
+    } else if (t->type == libvlc_track_audio) {
+      Tcl_ListObjAppendElement(NULL, track,
+                               Tcl_NewStringObj("channels", -1));
+      Tcl_ListObjAppendElement(NULL, track, Tcl_NewIntObj(t->channels));
+      Tcl_ListObjAppendElement(NULL, track, Tcl_NewStringObj("rate", -1));
+      Tcl_ListObjAppendElement(NULL, track, Tcl_NewIntObj(t->rate));
+    }
+    Tcl_ListObjAppendElement(NULL, tracks, track);
+  }
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("duration", -1));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewDoubleObj(item->duration < 0 ?
+      -1.0 : item->duration / 1000.0));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("width", -1));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(width));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("height", -1));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(height));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("audio", -1));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(ntracks[0]));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("video", -1));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(ntracks[1]));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("subtitles", -1));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(ntracks[2]));
+  Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("tracks", -1));
+  Tcl_ListObjAppendElement(NULL, info, tracks);
+  return info;
 }
 
-#endif
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCProbeLoad --
+ *
+ *      Read the probe cache file, a dictionary mapping normalized
+ *      file names to lists of size, modification time, and info.
+ *
+ * Results:
+ *      The cache dictionary, empty when the file is missing or
+ *      invalid.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *libVLCProbeLoad(Tcl_Obj *fileObj)
+{
+  Tcl_Obj *cache = Tcl_NewObj();
+  Tcl_Channel chan;
+  Tcl_Size size;
 
+  chan = Tcl_FSOpenFileChannel(NULL, fileObj, "r", 0);
+  if (chan == NULL) {
+    return cache;
+  }
+  Tcl_SetChannelOption(NULL, chan, "-encoding", "utf-8");
+  if (Tcl_ReadChars(chan, cache, -1, 0) < 0 ||
+      Tcl_DictObjSize(NULL, cache, &size) != TCL_OK) {
+    Tcl_SetObjLength(cache, 0);
+  }
+  Tcl_Close(NULL, chan);
+  return cache;
+}
 
 /*
  *----------------------------------------------------------------------
  *
- * libVLCObjCmd --
+ * libVLCSaveFile --
  *
- *      Tcl command to deal with the libvlc media player.
+ *      Write a cache file, as UTF-8 text or binary data. The cache is
+ *      written to a temporary file renamed over the old one, so
+ *      concurrent readers never see a partial file.
  *
  * Results:
  *      A standard Tcl result.
  *
  * Side effects:
- *      Many depending on command arguments.
+ *      The cache file is replaced.
  *
  *----------------------------------------------------------------------
  */
 
-int libVLCObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv)
+static int libVLCSaveFile(Tcl_Interp *interp, Tcl_Obj *fileObj,
+                          Tcl_Obj *cache, int binary)
 {
-  libVLCData *pVLC = (libVLCData *) cd;
-  int choice;
-  int rc = TCL_OK;
+  Tcl_Obj *tmpObj = Tcl_DuplicateObj(fileObj);
+  Tcl_Channel chan;
+  int rc = TCL_ERROR;
+
+  Tcl_IncrRefCount(tmpObj);
+  Tcl_AppendToObj(tmpObj, ".tmp", -1);
+  chan = Tcl_FSOpenFileChannel(interp, tmpObj, "w", 0644);
+  if (chan != NULL) {
+    if (binary) {
+      Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+    } else {
+      Tcl_SetChannelOption(NULL, chan, "-encoding", "utf-8");
+    }
+    if (Tcl_WriteObj(chan, cache) < 0) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\": %s",
+          Tcl_GetString(tmpObj), Tcl_PosixError(interp)));
+      Tcl_Close(NULL, chan);
+    } else if (Tcl_Close(interp, chan) == TCL_OK) {
+      if (Tcl_FSRenameFile(tmpObj, fileObj) == TCL_OK) {
+        rc = TCL_OK;
+      } else {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "error renaming \"%s\": %s", Tcl_GetString(tmpObj),
+            Tcl_PosixError(interp)));
+      }
+    }
+    if (rc != TCL_OK) {
+      Tcl_FSDeleteFile(tmpObj);
+    }
+  }
+  Tcl_DecrRefCount(tmpObj);
+  return rc;
+}
 
-  static const char *VLC_strs[] = {
-    "open", "openurl", "play", "pause", "stop", "isplaying",
-    "mute", "volume", "duration", "time", "position",
-    "rate", "isseekable", "state", "version", "destroy",
-#ifdef USE_TK_PHOTO
-    "event", "repeat", "info",
-#endif
-    NULL
-  };
-  enum VLC_enum {
-    TKVLC_OPEN, TKVLC_OPENURL, TKVLC_PLAY, TKVLC_PAUSE, TKVLC_STOP, TKVLC_ISPLAYING,
-    TKVLC_MUTE, TKVLC_VOLUME, TKVLC_DURATION, TKVLC_TIME, TKVLC_POSITION,
-    TKVLC_RATE, TKVLC_ISSEEKABLE, TKVLC_STATE, TKVLC_VERSION, TKVLC_DESTROY,
-#ifdef USE_TK_PHOTO
-    TKVLC_EVENT, TKVLC_REPEAT, TKVLC_INFO,
-#endif
-  };
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCThumbSetup --
+ *
+ *      Video format callback of thumbnail players. Picks RGB at the
+ *      largest size fitting into the bounding box and keeping the
+ *      aspect ratio.
+ *
+ * Results:
+ *      Number of picture buffers, 0 on error.
+ *
+ * Side effects:
+ *      The picture buffer is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
 
-  if( objc < 2 ){
-    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
-    return TCL_ERROR;
-  }
+static unsigned libVLCThumbSetup(void **opaque, char *chroma,
+                                 unsigned *width, unsigned *height,
+                                 unsigned *pitches, unsigned *lines)
+{
+  libVLCThumbWorker *w = (libVLCThumbWorker *) *opaque;
+  libVLCThumbs *job = w->job;
+  double scale;
 
-  if( Tcl_GetIndexFromObj(interp, objv[1], VLC_strs, "option", 0, &choice) ){
-    return TCL_ERROR;
+  if (*width == 0 || *height == 0) {
+    return 0;
   }
+  scale = (double) job->max_width / *width;
+  if (scale * *height > job->max_height) {
+    scale = (double) job->max_height / *height;
+  }
+  *width = (unsigned) (scale * *width + 0.5);
+  *height = (unsigned) (scale * *height + 0.5);
+  if (*width < 1) {
+    *width = 1;
+  }
+  if (*height < 1) {
+    *height = 1;
+  }
+  memcpy(chroma, "RV24", 4);
+  pitches[0] = *width * 3;
+  lines[0] = *height;
+  w->width = *width;
+  w->height = *height;
+  w->buffer = (unsigned char *) ckalloc(pitches[0] * lines[0]);
+  return 1;
+}
 
-  switch( (enum VLC_enum)choice ){
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCThumbCleanup --
+ *
+ *      Video cleanup callback of thumbnail players.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The picture buffer is freed.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    case TKVLC_OPEN: {
-        char *filename = NULL;
-        Tcl_DString ds;
-        int status = 0;
-        libvlc_media_t *media;
+static void libVLCThumbCleanup(void *opaque)
+{
+  libVLCThumbWorker *w = (libVLCThumbWorker *) opaque;
 
-        if( objc != 3 ){
-            Tcl_WrongNumArgs(interp, 2, objv, "filename");
-            return TCL_ERROR;
-        }
+  if (w->buffer != NULL) {
+    ckfree((char *) w->buffer);
+    w->buffer = NULL;
+  }
+}
 
-        filename = Tcl_TranslateFileName(interp, Tcl_GetString(objv[2]), &ds);
-        if (filename == NULL) {
-            return TCL_ERROR;
-        }
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCThumbLock --
+ *
+ *      Video lock callback of thumbnail players.
+ *
+ * Results:
+ *      Picture identifier, unused.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        media = libvlc_media_new_path(pVLC->vlc_inst, filename);
-        if(media == NULL) {  // Is it necessary?
-            Tcl_AppendResult(interp, "libvlc_media_new_path failed.", (char*)0);
-            return TCL_ERROR;
-        }
+static void *libVLCThumbLock(void *opaque, void **planes)
+{
+  libVLCThumbWorker *w = (libVLCThumbWorker *) opaque;
 
-        libvlc_media_player_set_media(pVLC->media_player, media);
-#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
-        status = libvlc_media_parse_with_options(media, libvlc_media_parse_local, -1);
-        if (status < 0) {
-            Tcl_DStringFree(&ds);
-            Tcl_AppendResult(interp, "libvlc_media_parse_with_options failed.", (char*)0);
-            return TCL_ERROR;
-        }
-#else
-        libvlc_media_parse(media);
+  planes[0] = w->buffer;
+  return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCThumbDisplay --
+ *
+ *      Video display callback of thumbnail players. The first frame
+ *      is taken as the thumbnail.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The pixels of the item are allocated and the waiting thread
+ *      is woken up.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCThumbDisplay(void *opaque, void *picture)
+{
+  libVLCThumbWorker *w = (libVLCThumbWorker *) opaque;
+  libVLCThumb *item;
+  size_t size = (size_t) w->width * w->height * 3;
+
+  Tcl_MutexLock(&w->lock);
+  item = w->item;
+  if (item != NULL && !w->done) {
+    item->pixels = (unsigned char *) ckalloc(size);
+    memcpy(item->pixels, w->buffer, size);
+    item->width = w->width;
+    item->height = w->height;
+    w->done = 1;
+    Tcl_ConditionNotify(&w->cond);
+  }
+  Tcl_MutexUnlock(&w->lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCThumbDecode --
+ *
+ *      Play a thumbnail item from its offset on the player of the
+ *      thread until its first frame is displayed, the media ends,
+ *      or the time limit is reached.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The item gets its pixels, unless decoding failed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCThumbDecode(libVLCThumbWorker *w,
+                              libvlc_media_player_t *mp, libVLCThumb *item)
+{
+  libvlc_media_t *media;
+  char opt[64];
+  Tcl_Time now, end;
+
+  media = libvlc_media_new_path(w->job->vlc_inst, item->path);
+  if (media == NULL) {
+    return;
+  }
+  /* seek while opening, no audio or subtitles at all */
+  sprintf(opt, ":start-time=%.3f", item->offset);
+  libvlc_media_add_option(media, opt);
+  libvlc_media_add_option(media, ":no-audio");
+  libvlc_media_add_option(media, ":no-spu");
+  libvlc_media_player_set_media(mp, media);
+  libvlc_media_release(media);
+
+  Tcl_MutexLock(&w->lock);
+  w->item = item;
+  w->done = 0;
+  Tcl_MutexUnlock(&w->lock);
+  Tcl_GetTime(&end);
+  end.sec += w->job->timeout / 1000;
+  end.usec += (w->job->timeout % 1000) * 1000;
+  libvlc_media_player_play(mp);
+  Tcl_MutexLock(&w->lock);
+  while (!w->done) {
+    /* the state is polled, events would need another thread hop */
+    Tcl_Time t = { 0, 20000 };
+    libvlc_state_t state = libvlc_media_player_get_state(mp);
+
+    Tcl_GetTime(&now);
+    if (state == libvlc_Ended || state == libvlc_Error ||
+        now.sec * 1000000LL + now.usec >= end.sec * 1000000LL + end.usec) {
+      break;
+    }
+    Tcl_ConditionWait(&w->cond, &w->lock, &t);
+  }
+  w->item = NULL;
+  Tcl_MutexUnlock(&w->lock);
+  libvlc_media_player_stop(mp);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCThumbThread --
+ *
+ *      Thread procedure decoding thumbnail items until none is left.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A media player is created and released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType libVLCThumbThread(ClientData clientData)
+{
+  libVLCThumbs *job = (libVLCThumbs *) clientData;
+  libVLCThumbWorker w;
+  libvlc_media_player_t *mp = NULL;
+
+  memset(&w, 0, sizeof(w));
+  w.job = job;
+  for (;;) {
+    int i;
+
+    Tcl_MutexLock(&job->lock);
+    i = job->next++;
+    Tcl_MutexUnlock(&job->lock);
+    if (i >= job->nitems) {
+      break;
+    }
+    if (mp == NULL) {
+      /* one player per thread, reused for all its items */
+      mp = libvlc_media_player_new(job->vlc_inst);
+      if (mp == NULL) {
+        continue;
+      }
+      libvlc_video_set_callbacks(mp, libVLCThumbLock, NULL,
+                                 libVLCThumbDisplay, &w);
+      libvlc_video_set_format_callbacks(mp, libVLCThumbSetup,
+                                        libVLCThumbCleanup);
+    }
+    libVLCThumbDecode(&w, mp, &job->items[i]);
+  }
+  if (mp != NULL) {
+    libvlc_media_player_release(mp);
+  }
+  Tcl_MutexFinalize(&w.lock);
+  Tcl_ConditionFinalize(&w.cond);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCMinMax --
+ *
+ *      Widen the range lo..hi to take in n float samples.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      lo and hi are updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCMinMax(const float *s, unsigned n, float *lo, float *hi)
+{
+  unsigned i = 0;
+  float l = *lo, h = *hi;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+  float lane[4];
+  int j;
+#endif
+
+#if defined(__SSE2__)
+  if (n >= 4) {
+    __m128 vl = _mm_set1_ps(l), vh = _mm_set1_ps(h);
+
+    for (; i + 4 <= n; i += 4) {
+      __m128 x = _mm_loadu_ps(s + i);
+
+      vl = _mm_min_ps(vl, x);
+      vh = _mm_max_ps(vh, x);
+    }
+    _mm_storeu_ps(lane, vl);
+    for (j = 0; j < 4; j++) {
+      l = (lane[j] < l) ? lane[j] : l;
+    }
+    _mm_storeu_ps(lane, vh);
+    for (j = 0; j < 4; j++) {
+      h = (lane[j] > h) ? lane[j] : h;
+    }
+  }
+#elif defined(__ARM_NEON)
+  if (n >= 4) {
+    float32x4_t vl = vdupq_n_f32(l), vh = vdupq_n_f32(h);
+
+    for (; i + 4 <= n; i += 4) {
+      float32x4_t x = vld1q_f32(s + i);
+
+      vl = vminq_f32(vl, x);
+      vh = vmaxq_f32(vh, x);
+    }
+    vst1q_f32(lane, vl);
+    for (j = 0; j < 4; j++) {
+      l = (lane[j] < l) ? lane[j] : l;
+    }
+    vst1q_f32(lane, vh);
+    for (j = 0; j < 4; j++) {
+      h = (lane[j] > h) ? lane[j] : h;
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    l = (s[i] < l) ? s[i] : l;
+    h = (s[i] > h) ? s[i] : h;
+  }
+  *lo = l;
+  *hi = h;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCWaveBucket --
+ *
+ *      Append the bucket being filled to level 0 of a waveform.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory may be (re)allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static short libVLCWaveClamp(float v)
+{
+  /* samples may overshoot full scale */
+  return (short) ((v < -1.0f) ? -32767 : (v > 1.0f) ? 32767 : v * 32767.0f);
+}
+
+static void libVLCWaveBucket(libVLCWave *w)
+{
+  short *pair;
+
+  if (w->count[0] == w->alloc) {
+    w->alloc = (w->alloc > 0) ? 2 * w->alloc : 4096;
+    w->peaks[0] = (short *) ckrealloc((char *) w->peaks[0],
+                                      (size_t) w->alloc * 2 * sizeof(short));
+  }
+  pair = w->peaks[0] + 2 * w->count[0]++;
+  pair[0] = libVLCWaveClamp(w->lo);
+  pair[1] = libVLCWaveClamp(w->hi);
+  w->filled = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCWavePrerender --
+ *
+ *      Audio prerender callback of smem, providing the buffer for a
+ *      block of samples.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The buffer may be (re)allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCWavePrerender(void *data, uint8_t **buffer, size_t size)
+{
+  libVLCWave *w = (libVLCWave *) data;
+
+  if (size > w->bufsize) {
+    w->buffer = (unsigned char *) ckrealloc((char *) w->buffer, size);
+    w->bufsize = size;
+  }
+  *buffer = w->buffer;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCWavePostrender --
+ *
+ *      Audio postrender callback of smem with a block of interleaved
+ *      float samples, which are folded into the buckets of level 0.
+ *      All channels of a bucket make up one range.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The waveform grows.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCWavePostrender(void *data, uint8_t *buffer,
+                                 unsigned channels, unsigned rate,
+                                 unsigned nb_samples, unsigned bits,
+                                 size_t size, int64_t pts)
+{
+  libVLCWave *w = (libVLCWave *) data;
+  const float *s = (const float *) buffer;
+
+  if (bits != 32 || channels == 0 ||
+      (size_t) nb_samples * channels * sizeof(float) > size) {
+    w->bad_format = 1;
+    return;
+  }
+  if (w->hdr.frames + nb_samples > TKVLC_MAX_WAVE_FRAMES) {
+    w->too_long = 1;
+    return;
+  }
+  if (w->hdr.rate == 0) {
+    w->hdr.rate = rate;
+    w->hdr.channels = channels;
+  }
+  w->hdr.frames += nb_samples;
+  while (nb_samples > 0) {
+    unsigned n = TKVLC_WAVE_BUCKET - w->filled;
+
+    if (n > nb_samples) {
+      n = nb_samples;
+    }
+    if (w->filled == 0) {
+      /* a range need not contain zero */
+      w->lo = w->hi = s[0];
+    }
+    libVLCMinMax(s, n * channels, &w->lo, &w->hi);
+    s += n * channels;
+    nb_samples -= n;
+    w->filled += n;
+    if (w->filled == TKVLC_WAVE_BUCKET) {
+      libVLCWaveBucket(w);
+    }
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCWaveLevels --
+ *
+ *      Compute the bucket counts of a waveform from its number of
+ *      samples, and allocate the levels above level 0 when build is
+ *      true and fill them from the level below.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCWaveLevels(libVLCWave *w, int build)
+{
+  Tcl_WideInt bucket = w->hdr.bucket, j;
+  int l, k;
+
+  for (l = 0; l < w->hdr.nlevels; l++) {
+    w->count[l] = (w->hdr.frames + bucket - 1) / bucket;
+    bucket *= TKVLC_WAVE_FACTOR;
+    if (!build || l == 0) {
+      continue;
+    }
+    w->peaks[l] = (short *) ckalloc((size_t) (w->count[l] + 1) *
+                                    2 * sizeof(short));
+    for (j = 0; j < w->count[l]; j++) {
+      const short *src = w->peaks[l - 1] + 2 * j * TKVLC_WAVE_FACTOR;
+      short lo = src[0], hi = src[1];
+
+      for (k = 1; k < TKVLC_WAVE_FACTOR &&
+           j * TKVLC_WAVE_FACTOR + k < w->count[l - 1]; k++) {
+        lo = (src[2 * k] < lo) ? src[2 * k] : lo;
+        hi = (src[2 * k + 1] > hi) ? src[2 * k + 1] : hi;
+      }
+      w->peaks[l][2 * j] = lo;
+      w->peaks[l][2 * j + 1] = hi;
+    }
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCWaveDecode --
+ *
+ *      Decode the audio of a file into level 0 of a waveform with a
+ *      media player transcoding to float samples for smem, which is
+ *      told not to wait for the clock. Video and subtitles are not
+ *      decoded at all. Decoding is given up after timeout ms, and a
+ *      decode ending in an error fails even after partial audio.
+ *
+ * Results:
+ *      NULL on success, otherwise a static error message.
+ *
+ * Side effects:
+ *      A media player is created and released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *libVLCWaveDecode(libvlc_instance_t *inst,
+                                    const char *path, libVLCWave *w,
+                                    int timeout)
+{
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(4, 0, 0, 0)
+  return "waveforms need the smem stream output of libvlc 2 or 3";
+#else
+  libvlc_media_player_t *mp;
+  libvlc_media_t *media;
+  libvlc_state_t state;
+  Tcl_Time now, end;
+  char opt[512];
+
+  media = libvlc_media_new_path(inst, path);
+  if (media == NULL) {
+    return "libvlc_media_new_path failed";
+  }
+  /* smem takes its callbacks as numbers */
+  sprintf(opt, ":sout=#transcode{acodec=fl32}:smem{no-time-sync,"
+          "audio-prerender-callback=%" TCL_LL_MODIFIER "d,"
+          "audio-postrender-callback=%" TCL_LL_MODIFIER "d,"
+          "audio-data=%" TCL_LL_MODIFIER "d}",
+          (Tcl_WideInt) (intptr_t) libVLCWavePrerender,
+          (Tcl_WideInt) (intptr_t) libVLCWavePostrender,
+          (Tcl_WideInt) (intptr_t) w);
+  libvlc_media_add_option(media, opt);
+  libvlc_media_add_option(media, ":no-sout-video");
+  libvlc_media_add_option(media, ":no-sout-spu");
+  mp = libvlc_media_player_new(inst);
+  if (mp == NULL) {
+    libvlc_media_release(media);
+    return "media player setup failed";
+  }
+  libvlc_media_player_set_media(mp, media);
+  libvlc_media_release(media);
+  Tcl_GetTime(&end);
+  end.sec += timeout / 1000;
+  end.usec += (timeout % 1000) * 1000;
+  libvlc_media_player_play(mp);
+  do {
+    /* the state is polled like for thumbnails */
+    Tcl_Sleep(10);
+    state = libvlc_media_player_get_state(mp);
+    Tcl_GetTime(&now);
+  } while (state != libvlc_Ended && state != libvlc_Error &&
+           state != libvlc_Stopped &&
+           now.sec * 1000000LL + now.usec < end.sec * 1000000LL + end.usec);
+  libvlc_media_player_stop(mp);
+  libvlc_media_player_release(mp);
+  if (w->bad_format) {
+    return "unexpected audio format";
+  }
+  if (w->too_long) {
+    return "audio too long";
+  }
+  if (state == libvlc_Error) {
+    /* what was decoded so far is not the whole file */
+    return "decoding failed";
+  }
+  if (state != libvlc_Ended && state != libvlc_Stopped) {
+    return "timed out";
+  }
+  if (w->filled > 0) {
+    libVLCWaveBucket(w);
+  }
+  if (w->hdr.frames == 0 || w->hdr.rate <= 0) {
+    return "no audio decoded";
+  }
+  return NULL;
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCWaveLoad --
+ *
+ *      Read a waveform cache file into w, when it is for the media
+ *      file of the given size and modification time, has at least
+ *      the levels wanted, a plausible format, and exactly the length
+ *      its header implies.
+ *
+ * Results:
+ *      True when the waveform was read.
+ *
+ * Side effects:
+ *      Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCWaveLoad(Tcl_Obj *fileObj, libVLCWave *w, int nlevels)
+{
+  libVLCWaveHeader hdr;
+  Tcl_Channel chan;
+  Tcl_StatBuf *sb;
+  Tcl_WideInt length, expected;
+  int l, ok;
+
+  sb = Tcl_AllocStatBuf();
+  ok = Tcl_FSStat(fileObj, sb) == 0;
+  length = (Tcl_WideInt) Tcl_GetSizeFromStat(sb);
+  ckfree((char *) sb);
+  if (!ok) {
+    return 0;
+  }
+  chan = Tcl_FSOpenFileChannel(NULL, fileObj, "r", 0);
+  if (chan == NULL) {
+    return 0;
+  }
+  Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+  ok = Tcl_Read(chan, (char *) &hdr, sizeof(hdr)) == sizeof(hdr) &&
+       memcmp(hdr.magic, TKVLC_WAVE_MAGIC, 8) == 0 &&
+       hdr.size == w->hdr.size && hdr.mtime == w->hdr.mtime &&
+       hdr.bucket == TKVLC_WAVE_BUCKET &&
+       hdr.rate > 0 && hdr.rate <= TKVLC_MAX_WAVE_RATE &&
+       hdr.channels > 0 && hdr.channels <= TKVLC_MAX_WAVE_CHANNELS &&
+       hdr.frames > 0 && hdr.frames <= TKVLC_MAX_WAVE_FRAMES &&
+       hdr.nlevels >= nlevels && hdr.nlevels <= TKVLC_MAX_WAVE_LEVELS;
+  if (ok) {
+    libVLCWaveHeader saved = w->hdr;
+
+    w->hdr = hdr;
+    libVLCWaveLevels(w, 0);
+    expected = sizeof(hdr);
+    for (l = 0; l < hdr.nlevels; l++) {
+      expected += w->count[l] * 2 * (Tcl_WideInt) sizeof(short);
+    }
+    /* a file cut short or with a bogus header is not read at all */
+    ok = (length == expected);
+    for (l = 0; ok && l < hdr.nlevels; l++) {
+      size_t bytes = (size_t) w->count[l] * 2 * sizeof(short);
+
+      w->peaks[l] = (short *) ckalloc(bytes + 1);
+      ok = Tcl_Read(chan, (char *) w->peaks[l], bytes) == (Tcl_Size) bytes;
+    }
+    if (!ok) {
+      /* truncated, decode again */
+      for (l = 0; l < hdr.nlevels; l++) {
+        if (w->peaks[l] != NULL) {
+          ckfree((char *) w->peaks[l]);
+          w->peaks[l] = NULL;
+        }
+      }
+      memset(w->count, 0, sizeof(w->count));
+      w->hdr = saved;
+    }
+  }
+  Tcl_Close(NULL, chan);
+  return ok;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCWaveSave --
+ *
+ *      Write a waveform to a cache file.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The cache file is replaced.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCWaveSave(Tcl_Interp *interp, Tcl_Obj *fileObj,
+                          libVLCWave *w)
+{
+  Tcl_Obj *data = Tcl_NewByteArrayObj((unsigned char *) &w->hdr,
+                                      sizeof(w->hdr));
+  int l, rc;
+
+  for (l = 0; l < w->hdr.nlevels; l++) {
+    Tcl_Size len = 0, bytes = (Tcl_Size) (w->count[l] * 2 * sizeof(short));
+    unsigned char *dst;
+
+    Tcl_GetByteArrayFromObj(data, &len);
+    dst = Tcl_SetByteArrayLength(data, len + bytes);
+    memcpy(dst + len, w->peaks[l], bytes);
+  }
+  Tcl_IncrRefCount(data);
+  rc = libVLCSaveFile(interp, fileObj, data, 1);
+  Tcl_DecrRefCount(data);
+  return rc;
+}
+
+#ifdef USE_TK_PHOTO
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCRetainInstance --
+ *
+ *      Take another reference to a libvlc instance obtained from
+ *      libVLCNewInstance, e.g. for use on another thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The reference count of the instance is incremented.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCRetainInstance(libvlc_instance_t *inst)
+{
+  libVLCInstance *e;
+
+  Tcl_MutexLock(&instMutex);
+  for (e = instList; e != NULL; e = e->next) {
+    if (e->vlc_inst == inst) {
+      e->refcount++;
+      break;
+    }
+  }
+  Tcl_MutexUnlock(&instMutex);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * silence --
+ *
+ *      Dummy procedure to silence libvlc log messages.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void silence(void *data, int level, const libvlc_log_t *ctx,
+            const char *fmt, va_list args)
+{
+}
+
+#ifdef linux
+/*
+ *----------------------------------------------------------------------
+ *
+ * Raspi_complain --
+ *
+ *      Half baked check for running on RaspberryPi.
+ *
+ * Results:
+ *      A standard Tcl result; TCL_ERROR when running on RaspberryPi
+ *      with and error message.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int Raspi_complain(Tcl_Interp *interp)
+{
+  FILE *fp;
+
+  fp = fopen("/proc/cpuinfo", "r");
+  if (fp != NULL) {
+    char line[256];
+    int check = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      check = strncmp(line, "Hardware", 8) == 0;
+      if (check) {
+        break;
+      }
+    }
+    fclose(fp);
+    if (!check || strstr(line, "BCM2") == NULL) {
+      return TCL_OK;
+    }
+  }
+  Tcl_SetResult(interp, "unsupported hardware", TCL_STATIC);
+  return TCL_ERROR;
+}
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Tk_check --
+ *
+ *      Lazy load Tk and check for its availability.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      Tk package may be loaded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int Tk_check(libVLCData *p, Tcl_Interp *interp)
+{
+  if (p->tk_checked > 0) {
+    return TCL_OK;
+  } else if (p->tk_checked < 0) {
+    Tcl_SetResult(interp, "can't find package Tk", TCL_STATIC);
+    return TCL_ERROR;
+  }
+#ifdef USE_TK_STUBS
+  if (Tk_InitStubs(interp, TCL_VERSION, 0) == NULL) {
+    p->tk_checked = -1;
+    return TCL_ERROR;
+  }
+#else
+  if (Tcl_PkgRequire(interp, "Tk", TCL_VERSION, 0) == NULL) {
+    p->tk_checked = -1;
+    return TCL_ERROR;
+  }
+#endif
+  p->tk_checked = 1;
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCRingInit --
+ *
+ *      Initialize a frame index queue able to hold at least
+ *      the given number of elements.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCRingInit(libVLCRing *r, int size)
+{
+  unsigned int capacity = 1;
+
+  while (capacity < (unsigned int) size) {
+    capacity <<= 1;
+  }
+  r->head = r->tail = 0;
+  r->mask = capacity - 1;
+  r->slots = (int *) ckalloc(capacity * sizeof(int));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCRingPush --
+ *
+ *      Append a frame buffer index to a queue. Must only be called
+ *      by the producing thread of the queue.
+ *
+ * Results:
+ *      True if the element was queued, false if the queue is full.
+ *
+ * Side effects:
+ *      The element becomes visible to the consuming thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCRingPush(libVLCRing *r, int index)
+{
+  unsigned int head = TKVLC_LOAD(r->head);
+
+  if (head - TKVLC_LOAD(r->tail) > r->mask) {
+    return 0;
+  }
+  r->slots[head & r->mask] = index;
+  TKVLC_STORE(r->head, head + 1);
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCRingPop --
+ *
+ *      Remove the oldest frame buffer index from a queue. Must only
+ *      be called by the consuming thread of the queue.
+ *
+ * Results:
+ *      Frame buffer index or -1 when the queue is empty.
+ *
+ * Side effects:
+ *      The element's slot becomes free for the producing thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCRingPop(libVLCRing *r)
+{
+  unsigned int tail = TKVLC_LOAD(r->tail);
+  int index;
+
+  if (TKVLC_LOAD(r->head) == tail) {
+    return -1;
+  }
+  index = r->slots[tail & r->mask];
+  TKVLC_STORE(r->tail, tail + 1);
+  return index;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCAllocFrames --
+ *
+ *      Allocate the frame buffers for the current width and height
+ *      plus the scratch buffer, and hand all of them to the decoder.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCAllocFrames(libVLCData *p)
+{
+  int i, nslots;
+
+  /*
+   * In mailbox mode the scratch buffer is a regular buffer: the
+   * decoder, the mailbox, and the photo upload each hold at most
+   * one, so there is always a free buffer for the decoder. The
+   * last buffer is the one more taken by the frame held for
+   * snapshots, it follows the scratch buffer.
+   */
+  nslots = p->nbuffers + (p->mailbox ? 1 : 0);
+  p->frames = (libVLCFrame *)
+      ckalloc((p->nbuffers + 2) * sizeof(libVLCFrame));
+  for (i = 0; i <= p->nbuffers + 1; i++) {
+    p->frames[i].p = p;
+    p->frames[i].index = (i < nslots || i > p->nbuffers) ? i : -1;
+    p->frames[i].pixels = (unsigned char *)
+        ckalloc(p->width * p->height * p->pixel_size);
+    p->frames[i].dirty = NULL;
+    p->frames[i].full = 1;
+    p->frames[i].yuv[0] = p->frames[i].yuv[1] = p->frames[i].yuv[2] = NULL;
+    if (FMT_PLANAR(p->format)) {
+      int k;
+
+      for (k = 0; k < ((p->format == FMT_I420) ? 3 : 2); k++) {
+        p->frames[i].yuv[k] = (unsigned char *)
+            ckalloc(p->pitches[k] * p->lines[k]);
+      }
+    }
+  }
+  p->spare = -1;
+  if (p->delta) {
+    p->tiles_x = (p->width + TKVLC_TILE - 1) / TKVLC_TILE;
+    p->tiles_y = (p->height + TKVLC_TILE - 1) / TKVLC_TILE;
+    for (i = 0; i <= p->nbuffers + 1; i++) {
+      p->frames[i].dirty = (unsigned char *) ckalloc(p->tiles_x * p->tiles_y);
+    }
+    p->ref = (unsigned char *)
+        ckalloc(p->width * p->height * p->pixel_size);
+    p->ref_valid = 0;
+  }
+  p->synced = 0;
+  p->latest = -1;
+  p->held = -1;
+  libVLCRingInit(&p->ready, p->nbuffers + 1);
+  libVLCRingInit(&p->free, nslots + 1);
+  for (i = 0; i <= p->nbuffers + 1; i++) {
+    if (p->frames[i].index >= 0) {
+      libVLCRingPush(&p->free, i);
+    }
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCFreeFrames --
+ *
+ *      Release the frame buffers and queues.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCFreeFrames(libVLCData *p)
+{
+  int i;
+
+  if (p->frames == NULL) {
+    return;
+  }
+  for (i = 0; i <= p->nbuffers + 1; i++) {
+    int k;
+
+    ckfree(p->frames[i].pixels);
+    if (p->frames[i].dirty != NULL) {
+      ckfree(p->frames[i].dirty);
+    }
+    for (k = 0; k < 3; k++) {
+      if (p->frames[i].yuv[k] != NULL) {
+        ckfree(p->frames[i].yuv[k]);
+      }
+    }
+  }
+  if (p->ref != NULL) {
+    ckfree(p->ref);
+    p->ref = NULL;
+  }
+  ckfree(p->frames);
+  ckfree(p->ready.slots);
+  ckfree(p->free.slots);
+  p->frames = NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCUnblock --
+ *
+ *      Suspend or resume decoder stalls of -backpressure block.
+ *      Stopping the media player joins the video output thread,
+ *      which must not wait for the Tcl thread to free a buffer.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A stalled decoder is woken up.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCUnblock(libVLCData *p, int flag)
+{
+  if (!p->block) {
+    return;
+  }
+  Tcl_MutexLock(&p->frame_lock);
+  TKVLC_STORE(p->unblock, flag);
+  Tcl_ConditionNotify(&p->free_cond);
+  Tcl_MutexUnlock(&p->frame_lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPlaylistIndex --
+ *
+ *      Return the index of the current playlist item.
+ *
+ * Results:
+ *      The index or -1.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCPlaylistIndex(libVLCData *p)
+{
+  libvlc_media_t *media;
+  int index = -1;
+
+  if (p->mlist == NULL) {
+    return -1;
+  }
+  media = libvlc_media_player_get_media(p->media_player);
+  if (media != NULL) {
+    libvlc_media_list_lock(p->mlist);
+    index = libvlc_media_list_index_of_item(p->mlist, media);
+    libvlc_media_list_unlock(p->mlist);
+    libvlc_media_release(media);
+  }
+  return index;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPrefetch --
+ *
+ *      Start parsing the playlist item after the current one, so the
+ *      media list player can switch to it without waiting for the
+ *      parser. Items are created when added to the playlist.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      libvlc parses the media in the background.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPrefetch(libVLCData *p)
+{
+  libvlc_media_t *media = NULL;
+  int index = libVLCPlaylistIndex(p) + 1, count;
+
+  if (p->playlist == NULL) {
+    return;
+  }
+  libvlc_media_list_lock(p->mlist);
+  count = libvlc_media_list_count(p->mlist);
+  if (index >= count && p->repeat) {
+    index = 0;
+  }
+  if (index < count) {
+    media = libvlc_media_list_item_at_index(p->mlist, index);
+  }
+  libvlc_media_list_unlock(p->mlist);
+  if (media == NULL) {
+    return;
+  }
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
+  if (libvlc_media_get_parsed_status(media) == 0) {
+    char *mrl = libvlc_media_get_mrl(media);
+    int local = (mrl != NULL && strncmp(mrl, "file:", 5) == 0);
+
+    libvlc_media_parse_with_options(media, local ?
+        libvlc_media_parse_local : libvlc_media_parse_network, -1);
+    libvlc_free(mrl);
+  }
+#else
+  if (!libvlc_media_is_parsed(media)) {
+    libvlc_media_parse_async(media);
+  }
+#endif
+  libvlc_media_release(media);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPlaylistChanged --
+ *
+ *      Called in the Tcl thread when the media of a playlist handle
+ *      changed, i.e. the media list player advanced.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The media name of the handle is updated, the next item is
+ *      prefetched.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPlaylistChanged(libVLCData *p)
+{
+  Tcl_Obj *nameObj = NULL;
+  int index;
+
+  if (p->playlist == NULL) {
+    return;
+  }
+  index = libVLCPlaylistIndex(p);
+  if (index >= 0 &&
+      Tcl_ListObjIndex(NULL, p->playlist, index, &nameObj) == TCL_OK &&
+      nameObj != NULL) {
+    if (p->file_name != NULL) {
+      Tcl_DecrRefCount(p->file_name);
+    }
+    p->file_name = nameObj;
+    Tcl_IncrRefCount(p->file_name);
+  }
+  libVLCPrefetch(p);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCDetailName --
+ *
+ *      Return the value reported in batch mode for a libvlc state
+ *      or audio event.
+ *
+ * Results:
+ *      String pointer or NULL.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *libVLCDetailName(int detail)
+{
+  switch (detail) {
+    case libvlc_MediaPlayerNothingSpecial:
+      return "idle";
+    case libvlc_MediaPlayerOpening:
+      return "opening";
+    case libvlc_MediaPlayerBuffering:
+      return "buffering";
+    case libvlc_MediaPlayerPlaying:
+      return "playing";
+    case libvlc_MediaPlayerPaused:
+      return "paused";
+    case libvlc_MediaPlayerStopped:
+      return "stopped";
+    case libvlc_MediaPlayerForward:
+      return "forward";
+    case libvlc_MediaPlayerBackward:
+      return "backward";
+    case libvlc_MediaPlayerEndReached:
+      return "ended";
+    case libvlc_MediaPlayerEncounteredError:
+      return "error";
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
+    case libvlc_MediaPlayerMuted:
+      return "muted";
+    case libvlc_MediaPlayerUnmuted:
+      return "unmuted";
+    case libvlc_MediaPlayerAudioVolume:
+      return "volume";
+    case libvlc_MediaPlayerAudioDevice:
+      return "device";
+#endif
+  }
+  return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCInvoke --
+ *
+ *      Invoke the event callback with additional arguments.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Many since Tcl code is evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCInvoke(libVLCData *p, int objc, Tcl_Obj *const objv[])
+{
+  Tcl_Interp *interp = p->interp;
+  Tcl_InterpState state;
+  int i, ret, nCmdObjs;
+  Tcl_Obj **cmdObjs, *staticObjv[TKVLC_STATIC_OBJV], **evalObjv;
+
+  Tcl_Preserve(p);
+  Tcl_Preserve(interp);
+  state = Tcl_SaveInterpState(interp, TCL_OK);
+  nCmdObjs = p->nCmdObjs;
+  cmdObjs = p->cmdObjs;
+  p->nCmdObjs = 0;
+  p->cmdObjs = NULL;
+  /*
+   * The callback words are evaluated as they are, without building
+   * and reparsing a list. All objects are held by the caller or by
+   * cmdObjs for the duration of the call.
+   */
+  evalObjv = staticObjv;
+  if (nCmdObjs + objc > TKVLC_STATIC_OBJV) {
+    evalObjv = (Tcl_Obj **) ckalloc((nCmdObjs + objc) * sizeof(Tcl_Obj *));
+  }
+  memcpy(evalObjv, cmdObjs, nCmdObjs * sizeof(Tcl_Obj *));
+  memcpy(evalObjv + nCmdObjs, objv, objc * sizeof(Tcl_Obj *));
+  ret = Tcl_EvalObjv(interp, nCmdObjs + objc, evalObjv, TCL_EVAL_GLOBAL);
+  if (evalObjv != staticObjv) {
+    ckfree(evalObjv);
+  }
+  if (ret != TCL_OK) {
+    Tcl_AddErrorInfo(interp, "\n    (tkvlc event callback)");
+    Tcl_BackgroundException(interp, ret);
+  }
+  if (p->cmdObjs != NULL) {
+    /* new callback installed */
+    for (i = 0; i < nCmdObjs; i++) {
+        Tcl_DecrRefCount(cmdObjs[i]);
+    }
+    ckfree(cmdObjs);
+  } else {
+    p->nCmdObjs = nCmdObjs;
+    p->cmdObjs = cmdObjs;
+  }
+  Tcl_RestoreInterpState(interp, state);
+  Tcl_Release(interp);
+  Tcl_Release(p);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCTuple --
+ *
+ *      Make a {type value timestamp} element of a batch. The
+ *      timestamp is in milliseconds like [clock milliseconds].
+ *
+ * Results:
+ *      New list object.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *libVLCTuple(libVLCData *p, int type, Tcl_Obj *valueObj,
+                            Tcl_WideInt stamp)
+{
+  Tcl_Obj *elems[3];
+
+  elems[0] = p->ev_names[type];
+  elems[1] = (valueObj != NULL) ? valueObj : Tcl_NewObj();
+  elems[2] = Tcl_NewWideIntObj(stamp);
+  return Tcl_NewListObj(3, elems);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCNow --
+ *
+ *      Return current time in milliseconds.
+ *
+ * Results:
+ *      Milliseconds since the epoch.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_WideInt libVLCNow(void)
+{
+  Tcl_Time now;
+
+  Tcl_GetTime(&now);
+  return (Tcl_WideInt) now.sec * 1000 + now.usec / 1000;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoEventCallback --
+ *
+ *      Perform callback given event type. The optional value is
+ *      appended to the callback arguments, or freed when unused.
+ *      In batch mode the event is reported as a batch of one.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Many since Tcl code is evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DoEventCallback(libVLCData *p, int type, Tcl_Obj *valueObj)
+{
+  if (valueObj != NULL) {
+    Tcl_IncrRefCount(valueObj);
+  }
+  if (p->nCmdObjs > 0 && p->cmdObjs != NULL) {
+    Tcl_Obj *args[2];
+
+    if (!(p->ev_mask & (1 << type))) {
+      /* not subscribed */
+    } else if (p->batch) {
+      args[0] = libVLCTuple(p, type, valueObj, libVLCNow());
+      args[0] = Tcl_NewListObj(1, args);
+      Tcl_IncrRefCount(args[0]);
+      libVLCInvoke(p, 1, args);
+      Tcl_DecrRefCount(args[0]);
+    } else {
+      args[0] = p->ev_names[type];
+      args[1] = valueObj;
+      libVLCInvoke(p, (valueObj != NULL) ? 2 : 1, args);
+    }
+  }
+  if (valueObj != NULL) {
+    Tcl_DecrRefCount(valueObj);
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCCoalesceOf --
+ *
+ *      Return the coalescing state of an event type.
+ *
+ * Results:
+ *      Pointer into p->coal or NULL if the type is not coalesced.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static libVLCCoalesce *libVLCCoalesceOf(libVLCData *p, int type)
+{
+  switch (type) {
+    case EV_TIME_CHANGED:
+      return &p->coal[0];
+    case EV_POS_CHANGED:
+      return &p->coal[1];
+    case EV_LEVEL:
+      return &p->coal[2];
+  }
+  return NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCCoalesceDue --
+ *
+ *      Check whether the minimum interval since the last report of
+ *      a coalesced time or position event has passed, and if so
+ *      take its latest value. Otherwise arm a timer to report it.
+ *
+ * Results:
+ *      True if the event is to be reported now.
+ *
+ * Side effects:
+ *      A timer may be created.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCcoalesced(ClientData clientData);
+
+static int libVLCCoalesceDue(libVLCCoalesce *c, double *value,
+                             Tcl_WideInt *stamp)
+{
+  libVLCData *p = c->p;
+  Tcl_Time now;
+
+  Tcl_GetTime(&now);
+  if (p->interval > 0 && (c->last.sec != 0 || c->last.usec != 0)) {
+    long ms = (now.sec - c->last.sec) * 1000 +
+              (now.usec - c->last.usec) / 1000;
+
+    if (ms >= 0 && ms < p->interval) {
+      if (c->timer == NULL) {
+        c->timer = Tcl_CreateTimerHandler(p->interval - ms,
+                                          libVLCcoalesced, c);
+      }
+      return 0;
+    }
+  }
+  Tcl_MutexLock(&p->ev_lock);
+  *value = c->value;
+  *stamp = c->stamp;
+  c->pending = 0;
+  Tcl_MutexUnlock(&p->ev_lock);
+  c->last = now;
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCcoalesced --
+ *
+ *      Procedure called in Tcl thread to report the latest value of
+ *      a coalesced time or position event, when the minimum interval
+ *      since the last report has passed. Otherwise it is called again
+ *      from a timer.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A Tcl callback is evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCcoalesced(ClientData clientData)
+{
+  libVLCCoalesce *c = (libVLCCoalesce *) clientData;
+  libVLCData *p = c->p;
+  Tcl_WideInt stamp;
+  double value;
+
+  c->timer = NULL;
+  if (!libVLCCoalesceDue(c, &value, &stamp)) {
+    return;
+  }
+  if (p->batch) {
+    if (p->nCmdObjs > 0 && p->cmdObjs != NULL &&
+        (p->ev_mask & (1 << c->type))) {
+      Tcl_Obj *batch = libVLCTuple(p, c->type, Tcl_NewDoubleObj(value), stamp);
+
+      batch = Tcl_NewListObj(1, &batch);
+      Tcl_IncrRefCount(batch);
+      libVLCInvoke(p, 1, &batch);
+      Tcl_DecrRefCount(batch);
+    }
+  } else {
+    DoEventCallback(p, c->type, p->values ? Tcl_NewDoubleObj(value) : NULL);
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCAddSlab --
+ *
+ *      Add a slab of event records to the free list, with ev_lock
+ *      held or before the media player is started.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCAddSlab(libVLCData *p)
+{
+  libVLCSlab *slab = (libVLCSlab *) ckalloc(sizeof(libVLCSlab));
+  int i;
+
+  slab->next = p->slabs;
+  p->slabs = slab;
+  for (i = 0; i < TKVLC_SLAB; i++) {
+    slab->recs[i].next = p->ev_free;
+    p->ev_free = &slab->recs[i];
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCdrain --
+ *
+ *      Procedure called in Tcl thread to report the pending media
+ *      player events in the order they occurred. In batch mode they
+ *      are reported with a single callback.
+ *
+ * Results:
+ *      Always true (event handled).
+ *
+ * Side effects:
+ *      Tcl callbacks are evaluated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCdrain(Tcl_Event *ev, int flags)
+{
+  libVLCEvent *e = (libVLCEvent *) ev;
+  libVLCData *p = e->p;
+  Tcl_Obj *batch;
+
+  if (p == NULL) {
+    /* media player torn down */
+    return 1;
+  }
+  /* events after this point ring again, callbacks may reenter */
+  Tcl_MutexLock(&p->ev_lock);
+  p->doorbell = NULL;
+  Tcl_MutexUnlock(&p->ev_lock);
+  Tcl_Preserve(p);
+  batch = p->batch ? Tcl_NewObj() : NULL;
+  for (;;) {
+    libVLCRecord *r;
+    int type, detail;
+    Tcl_WideInt stamp;
+
+    Tcl_MutexLock(&p->ev_lock);
+    r = p->pending.next;
+    if (r == &p->pending || p->destroyed) {
+      Tcl_MutexUnlock(&p->ev_lock);
+      break;
+    }
+    r->prev->next = r->next;
+    r->next->prev = r->prev;
+    type = r->type;
+    detail = r->detail;
+    stamp = r->stamp;
+    r->next = p->ev_free;
+    p->ev_free = r;
+    Tcl_MutexUnlock(&p->ev_lock);
+    /* with or without a callback */
+    if (type == EV_MEDIA_CHANGED) {
+      libVLCPlaylistChanged(p);
+    }
+    if (batch != NULL) {
+      Tcl_Obj *valueObj = NULL;
+
+      if (libVLCCoalesceOf(p, type) != NULL) {
+        double value;
+
+        if (!libVLCCoalesceDue(libVLCCoalesceOf(p, type), &value, &stamp)) {
+          continue;
+        }
+        valueObj = Tcl_NewDoubleObj(value);
+      } else if (libVLCDetailName(detail) != NULL) {
+        valueObj = Tcl_NewStringObj(libVLCDetailName(detail), -1);
+      }
+      if (!(p->ev_mask & (1 << type))) {
+        /* unsubscribed after the event occurred */
+        if (valueObj != NULL) {
+          Tcl_DecrRefCount(valueObj);
+        }
+        continue;
+      }
+      Tcl_ListObjAppendElement(NULL, batch,
+                               libVLCTuple(p, type, valueObj, stamp));
+    } else if (libVLCCoalesceOf(p, type) != NULL) {
+      libVLCcoalesced(libVLCCoalesceOf(p, type));
+    } else {
+      /* invoke callback, if any */
+      DoEventCallback(p, type, NULL);
+    }
+  }
+  if (batch != NULL) {
+    Tcl_Size n = 0;
+
+    Tcl_IncrRefCount(batch);
+    Tcl_ListObjLength(NULL, batch, &n);
+    if (n > 0 && !p->destroyed && p->nCmdObjs > 0 && p->cmdObjs != NULL) {
+      /* one callback for all pending events */
+      libVLCInvoke(p, 1, &batch);
+    }
+    Tcl_DecrRefCount(batch);
+  }
+  Tcl_Release(p);
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLChandler --
+ *
+ *      Procedure called in libvlc context to report a media player
+ *      event.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A Tcl event is queued and the thread owning the media player
+ *      is alerted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPost(libVLCData *p, int type, int detail, double value);
+
+static void libVLChandler(const struct libvlc_event_t *ev, void *clientData)
+{
+  libVLCData *p = (libVLCData *) clientData;
+  double value = 0.0;
+  int type;
+
+  if (p->media_player == NULL) {
+    return;
+  }
+  switch (ev->type) {
+    case libvlc_MediaPlayerMediaChanged:
+      type = EV_MEDIA_CHANGED;
+      break;
+    case libvlc_MediaPlayerNothingSpecial:
+    case libvlc_MediaPlayerOpening:
+    case libvlc_MediaPlayerBuffering:
+    case libvlc_MediaPlayerPlaying:
+    case libvlc_MediaPlayerPaused:
+    case libvlc_MediaPlayerStopped:
+    case libvlc_MediaPlayerForward:
+    case libvlc_MediaPlayerBackward:
+    case libvlc_MediaPlayerEndReached:
+    case libvlc_MediaPlayerEncounteredError:
+      type = EV_STATE_CHANGED;
+      if (ev->type == libvlc_MediaPlayerPlaying &&
+          TKVLC_LOAD(p->loop_b) > 0 && !TKVLC_LOAD(p->restarting)) {
+        int a = TKVLC_LOAD(p->loop_a);
+
+        /* A-B loop replayed from the start, see libVLCRepeat */
+        if (libvlc_media_player_get_time(p->media_player) < a) {
+          libvlc_media_player_set_time(p->media_player, a);
+        }
+      }
+      if (TKVLC_LOAD(p->restarting)) {
+        /*
+         * A restart for a new video format ends where it began,
+         * or in the playing state when it resumed paused media.
+         */
+        int resumed = TKVLC_LOAD(p->restarting) > 1;
+
+        if (ev->type == libvlc_MediaPlayerPlaying ||
+            ev->type == libvlc_MediaPlayerEndReached ||
+            ev->type == libvlc_MediaPlayerEncounteredError) {
+          TKVLC_STORE(p->restarting, 0);
+        }
+        if (ev->type != libvlc_MediaPlayerEndReached &&
+            ev->type != libvlc_MediaPlayerEncounteredError &&
+            (ev->type != libvlc_MediaPlayerPlaying || !resumed)) {
+          return;
+        }
+      }
+      break;
+    case libvlc_MediaPlayerTimeChanged: {
+      int b = TKVLC_LOAD(p->loop_b);
+
+      if (b > 0 && ev->u.media_player_time_changed.new_time >= b) {
+        /* A-B loop, seek right away instead of in the Tcl thread */
+        libvlc_media_player_set_time(p->media_player, TKVLC_LOAD(p->loop_a));
+      }
+      if (!(p->ev_mask & (1 << EV_TIME_CHANGED))) {
+        /* attached for the loop only */
+        return;
+      }
+      type = EV_TIME_CHANGED;
+      value = ev->u.media_player_time_changed.new_time / 1000.0;
+      break;
+    }
+    case libvlc_MediaPlayerPositionChanged:
+      type = EV_POS_CHANGED;
+      value = ev->u.media_player_position_changed.new_position;
+      break;
+    case libvlc_MediaPlayerMuted:
+    case libvlc_MediaPlayerUnmuted:
+    case libvlc_MediaPlayerAudioVolume:
+    case libvlc_MediaPlayerAudioDevice:
+      type = EV_AUDIO_CHANGED;
+      break;
+    default:
+      return;
+  }
+  libVLCPost(p, type, ev->type, value);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPost --
+ *
+ *      Queue an event record for the Tcl thread, from any thread. A
+ *      coalesced event still pending is updated with the new value
+ *      instead.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A Tcl event is queued and the thread owning the media player
+ *      is alerted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPost(libVLCData *p, int type, int detail, double value)
+{
+  libVLCCoalesce *c = libVLCCoalesceOf(p, type);
+  libVLCRecord *r;
+  Tcl_WideInt stamp;
+
+  stamp = libVLCNow();
+  Tcl_MutexLock(&p->ev_lock);
+  if (c != NULL) {
+    /* update pending event in place */
+    c->stamp = stamp;
+    c->value = value;
+    if (c->pending) {
+      Tcl_MutexUnlock(&p->ev_lock);
+      return;
+    }
+    c->pending = 1;
+  }
+  if (p->ev_free == NULL) {
+    libVLCAddSlab(p);
+  }
+  r = p->ev_free;
+  p->ev_free = r->next;
+  r->type = type;
+  r->detail = detail;
+  r->stamp = stamp;
+  r->prev = p->pending.prev;
+  r->next = &p->pending;
+  r->prev->next = r;
+  p->pending.prev = r;
+  if (p->doorbell == NULL) {
+    libVLCEvent *e = (libVLCEvent *) ckalloc(sizeof(*e));
+
+    e->header.proc = libVLCdrain;
+    e->header.nextPtr = NULL;
+    e->type = type;
+    e->p = p;
+    p->doorbell = e;
+    Tcl_ThreadQueueEvent(p->tid, &e->header, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(p->tid);
+  }
+  Tcl_MutexUnlock(&p->ev_lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCSubscribe --
+ *
+ *      Attach the libvlc events needed for the subscribed event
+ *      types and detach the others, so that unwanted events do not
+ *      even reach libVLChandler. State and time events stay attached
+ *      while an A-B loop is active, media events while a playlist is
+ *      set.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      libvlc event callbacks are (de)registered.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCSubscribe(libVLCData *p)
+{
+  static const struct {
+    libvlc_event_type_t event;
+    int type;
+  } events[] = {
+    { libvlc_MediaPlayerMediaChanged, EV_MEDIA_CHANGED },
+    { libvlc_MediaPlayerNothingSpecial, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerOpening, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerBuffering, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerPlaying, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerPaused, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerStopped, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerForward, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerBackward, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerEndReached, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerEncounteredError, EV_STATE_CHANGED },
+    { libvlc_MediaPlayerTimeChanged, EV_TIME_CHANGED },
+    { libvlc_MediaPlayerPositionChanged, EV_POS_CHANGED },
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
+    { libvlc_MediaPlayerMuted, EV_AUDIO_CHANGED },
+    { libvlc_MediaPlayerUnmuted, EV_AUDIO_CHANGED },
+    { libvlc_MediaPlayerAudioVolume, EV_AUDIO_CHANGED },
+    { libvlc_MediaPlayerAudioDevice, EV_AUDIO_CHANGED },
+#endif
+  };
+  libvlc_event_manager_t *em;
+  int i, mask = p->ev_mask & ~(1 << EV_NEW_FRAME);
+
+  if (p->media_player == NULL) {
+    return;
+  }
+  if (p->loop_b > 0) {
+    mask |= (1 << EV_STATE_CHANGED) | (1 << EV_TIME_CHANGED);
+  }
+#ifdef USE_TK_PHOTO
+  if (p->playlist != NULL) {
+    mask |= 1 << EV_MEDIA_CHANGED;
+  }
+#endif
+  em = libvlc_media_player_event_manager(p->media_player);
+  for (i = 0; i < (int) (sizeof(events) / sizeof(events[0])); i++) {
+    int bit = 1 << events[i].type;
+
+    if ((mask & bit) && !(p->ev_attached & bit)) {
+      libvlc_event_attach(em, events[i].event, libVLChandler, p);
+    } else if (!(mask & bit) && (p->ev_attached & bit)) {
+      libvlc_event_detach(em, events[i].event, libVLChandler, p);
+    }
+  }
+  p->ev_attached = mask;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPlaylistNew --
+ *
+ *      Create an empty playlist played by a media list player on
+ *      the media player of the handle. The media list player advances
+ *      to the next item in libvlc's thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Media list and media list player are created.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCRepeat(libVLCData *p);
+
+static void libVLCPlaylistNew(libVLCData *p)
+{
+  p->mlist = libvlc_media_list_new(p->vlc_inst);
+  p->mlplayer = libvlc_media_list_player_new(p->vlc_inst);
+  libvlc_media_list_player_set_media_player(p->mlplayer, p->media_player);
+  libvlc_media_list_player_set_media_list(p->mlplayer, p->mlist);
+  p->playlist = Tcl_NewObj();
+  Tcl_IncrRefCount(p->playlist);
+  libVLCRepeat(p);
+  libVLCSubscribe(p);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPlaylistFree --
+ *
+ *      Release the playlist of the handle, if any.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Media list and media list player are released, the media
+ *      player keeps its current media.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPlaylistFree(libVLCData *p)
+{
+  if (p->mlplayer == NULL) {
+    return;
+  }
+  libvlc_media_list_player_release(p->mlplayer);
+  libvlc_media_list_release(p->mlist);
+  if (p->playlist != NULL) {
+    Tcl_DecrRefCount(p->playlist);
+  }
+  p->mlplayer = NULL;
+  p->mlist = NULL;
+  p->playlist = NULL;
+  libVLCSubscribe(p);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCRepeat --
+ *
+ *      Set up replaying for the repeat flag and the A-B loop. Ended
+ *      media are replayed by a media list player in libvlc's thread,
+ *      without a gap waiting for the Tcl event loop. A playlist loops
+ *      or, with an A-B loop, repeats its current item. A single media
+ *      is put into a media list of its own, which is not a playlist
+ *      (p->playlist stays NULL). When the loop ends before B, the item
+ *      starts over and libVLChandler seeks to A.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A media list player may be created or released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCRepeat(libVLCData *p)
+{
+  libvlc_media_t *media;
+  int loop = TKVLC_LOAD(p->loop_b) > 0;
+
+  if (p->playlist != NULL) {
+    libvlc_media_list_player_set_playback_mode(p->mlplayer,
+        loop ? libvlc_playback_mode_repeat : p->repeat ?
+        libvlc_playback_mode_loop : libvlc_playback_mode_default);
+    return;
+  }
+  libVLCPlaylistFree(p);
+  if ((!p->repeat && !loop) || p->media_player == NULL) {
+    return;
+  }
+  media = libvlc_media_player_get_media(p->media_player);
+  if (media == NULL) {
+    return;
+  }
+  p->mlist = libvlc_media_list_new(p->vlc_inst);
+  libvlc_media_list_lock(p->mlist);
+  libvlc_media_list_add_media(p->mlist, media);
+  libvlc_media_list_unlock(p->mlist);
+  libvlc_media_release(media);
+  p->mlplayer = libvlc_media_list_player_new(p->vlc_inst);
+  libvlc_media_list_player_set_media_player(p->mlplayer, p->media_player);
+  libvlc_media_list_player_set_media_list(p->mlplayer, p->mlist);
+  /* the item was not started by the list player, repeat needs that */
+  libvlc_media_list_player_set_playback_mode(p->mlplayer,
+                                             libvlc_playback_mode_loop);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPlaylistAdd --
+ *
+ *      Append files or URLs to the playlist of the handle. Names
+ *      containing "://" are taken as URLs.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      Media are created and added to the playlist, the item after
+ *      the current one is prefetched.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCPlaylistAdd(libVLCData *p, Tcl_Interp *interp,
+                             int objc, Tcl_Obj *const objv[])
+{
+  int i;
+
+  for (i = 0; i < objc; i++) {
+    const char *name = Tcl_GetString(objv[i]);
+    libvlc_media_t *media;
+
+    if (strstr(name, "://") != NULL) {
+      media = libvlc_media_new_location(p->vlc_inst, name);
+    } else {
+      Tcl_DString ds;
+      char *path = Tcl_TranslateFileName(interp, name, &ds);
+
+      if (path == NULL) {
+        return TCL_ERROR;
+      }
+      media = libvlc_media_new_path(p->vlc_inst, path);
+      Tcl_DStringFree(&ds);
+    }
+    if (media == NULL) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("cannot open \"%s\"", name));
+      return TCL_ERROR;
+    }
+    libvlc_media_list_lock(p->mlist);
+    libvlc_media_list_add_media(p->mlist, media);
+    libvlc_media_list_unlock(p->mlist);
+    libvlc_media_release(media);
+    if (Tcl_IsShared(p->playlist)) {
+      Tcl_DecrRefCount(p->playlist);
+      p->playlist = Tcl_DuplicateObj(p->playlist);
+      Tcl_IncrRefCount(p->playlist);
+    }
+    Tcl_ListObjAppendElement(NULL, p->playlist, objv[i]);
+  }
+  libVLCPrefetch(p);
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCRestartVideo --
+ *
+ *      Restart playback at the current time to let libvlc
+ *      negotiate the video format again, e.g. after the
+ *      requested frame size changed. A running video output
+ *      cannot negotiate again, and a restart would start streams
+ *      which cannot seek over and play paused media. So only
+ *      seekable media is restarted, and the state events of the
+ *      restart are not reported. When paused, the restart waits
+ *      for "play" unless resume is true; other media gets the new
+ *      format when it is played next.
+ *
+ * Results:
+ *      1 if playback was restarted, 0 otherwise.
+ *
+ * Side effects:
+ *      Playback is briefly interrupted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCRestartVideo(libVLCData *p, int resume)
+{
+  libvlc_state_t state = libvlc_media_player_get_state(p->media_player);
+  libvlc_time_t tm;
+
+  p->restart_pending = 0;
+  if ((state != libvlc_Playing && state != libvlc_Paused) ||
+      !libvlc_media_player_is_seekable(p->media_player)) {
+    return 0;
+  }
+  if (state == libvlc_Paused && !resume) {
+    p->restart_pending = 1;
+    return 0;
+  }
+  tm = libvlc_media_player_get_time(p->media_player);
+  if (p->ev_attached & (1 << EV_STATE_CHANGED)) {
+    /* cleared by the playing state at the end of the restart */
+    TKVLC_STORE(p->restarting, state == libvlc_Paused ? 2 : 1);
+  }
+  libVLCUnblock(p, 1);
+  libvlc_media_player_stop(p->media_player);
+  libVLCUnblock(p, 0);
+  libvlc_media_player_play(p->media_player);
+  if (tm > 0) {
+    libvlc_media_player_set_time(p->media_player, tm);
+  }
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCresize --
+ *
+ *      Idle procedure to follow a changed photo image size in
+ *      fit mode.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Playback is restarted with the new frame size.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCresize(ClientData clientData)
+{
+  libVLCRestartVideo((libVLCData *) clientData, 0);
+}
+
+static int libVLCready(Tcl_Event *ev, int flags);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCNewFrameEvent --
+ *
+ *      Allocate the next frame event of a media player. Called in
+ *      the Tcl thread, which also frees the event once serviced,
+ *      so the decoder thread never allocates.
+ *
+ * Results:
+ *      The new event.
+ *
+ * Side effects:
+ *      Memory is allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static libVLCEvent *libVLCNewFrameEvent(libVLCData *p)
+{
+  libVLCEvent *e = (libVLCEvent *) ckalloc(sizeof(*e));
+
+  e->header.proc = libVLCready;
+  e->header.nextPtr = NULL;
+  e->type = EV_NEW_FRAME;
+  e->p = p;
+  return e;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCQueueFrameEvent --
+ *
+ *      Queue the preallocated frame event to the Tcl thread unless
+ *      it is already pending. May be called from any thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A Tcl event is queued and the thread owning the media player
+ *      is alerted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCQueueFrameEvent(libVLCData *p)
+{
+  libVLCEvent *e;
+
+  if (TKVLC_XCHG(p->frame_pending, 1) != 0) {
+    /* consumer will pick this frame up */
+    return;
+  }
+  /* replaced by libVLCready before it clears frame_pending */
+  e = p->frame_next;
+  p->frame_next = NULL;
+  /* remembered for teardown */
+  p->frame_ev = e;
+  Tcl_ThreadQueueEvent(p->tid, &e->header, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert(p->tid);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCrearm --
+ *
+ *      Idle procedure to deliver the next queued frame after
+ *      Tk had a chance to redisplay the photo image.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A frame event is queued.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCrearm(ClientData clientData)
+{
+  libVLCQueueFrameEvent((libVLCData *) clientData);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPutFrame --
+ *
+ *      Copy a frame buffer to the photo image. In delta mode only
+ *      the changed tiles are copied, as runs of adjacent tiles.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      Photo image is modified and possibly resized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCPutFrame(libVLCData *p, Tk_PhotoHandle photo,
+                          libVLCFrame *f)
+{
+  Tcl_Interp *interp = p->interp;
+  Tk_PhotoImageBlock blk;
+  int width, height, tx, ty, x0;
+
+  Tk_PhotoGetSize(photo, &width, &height);
+  if (p->fit) {
+    if (width != p->width || height != p->height) {
+      /* frame from before the resize, skip it */
+      return TCL_BREAK;
+    }
+  } else {
+    if (width < p->width || height < p->height) {
+      p->synced = 0;
+    }
+    if (Tk_PhotoExpand(interp, photo, p->width, p->height) != TCL_OK) {
+      return TCL_ERROR;
+    }
+  }
+  blk.pixelSize = p->pixel_size;
+  blk.pitch = p->width * blk.pixelSize;
+  blk.offset[0] = 0;
+  blk.offset[1] = 1;
+  blk.offset[2] = 2;
+  blk.offset[3] = 3;
+  if (!p->delta || f->full || !p->synced) {
+    blk.width = p->width;
+    blk.height = p->height;
+    blk.pixelPtr = f->pixels;
+    if (Tk_PhotoPutBlock(interp, photo, &blk, 0, 0, blk.width, blk.height,
+                         TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    p->synced = 1;
+    return TCL_OK;
+  }
+  for (ty = 0; ty < p->tiles_y; ty++) {
+    unsigned char *dirty = f->dirty + ty * p->tiles_x;
+    int y = ty * TKVLC_TILE;
+
+    blk.height = p->height - y;
+    if (blk.height > TKVLC_TILE) {
+      blk.height = TKVLC_TILE;
+    }
+    tx = 0;
+    while (tx < p->tiles_x) {
+      int x;
+
+      if (!dirty[tx]) {
+        tx++;
+        continue;
+      }
+      x0 = tx;
+      while (tx < p->tiles_x && dirty[tx]) {
+        tx++;
+      }
+      x = x0 * TKVLC_TILE;
+      blk.width = tx * TKVLC_TILE;
+      if (blk.width > p->width) {
+        blk.width = p->width;
+      }
+      blk.width -= x;
+      blk.pixelPtr = f->pixels + y * blk.pitch + x * blk.pixelSize;
+      if (Tk_PhotoPutBlock(interp, photo, &blk, x, y, blk.width, blk.height,
+                           TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
+        return TCL_ERROR;
+      }
+    }
+  }
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCMergeDirty --
+ *
+ *      Add the dirty tiles of a frame which is skipped to the
+ *      frame replacing it, since they never reached the photo
+ *      image. The caller must own both frames.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Dirty map of the replacing frame is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCMergeDirty(libVLCData *p, libVLCFrame *f, libVLCFrame *o)
+{
+  int i;
+
+  if (!p->delta || f->full) {
+    return;
+  }
+  if (o->full) {
+    f->full = 1;
+    return;
+  }
+  for (i = 0; i < p->tiles_x * p->tiles_y; i++) {
+    f->dirty[i] |= o->dirty[i];
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCUpload --
+ *
+ *      Copy the next frame to the photo image. This is the oldest
+ *      frame of the ring, or the latest one in mailbox mode or
+ *      when paced, in which case older frames are skipped. Headless
+ *      handles only take the frame, for the sinks.
+ *
+ * Results:
+ *      1 if a frame was copied, 0 if a frame was taken but not
+ *      copied, -1 if no frame was available.
+ *
+ * Side effects:
+ *      Playback is stopped when the photo image is invalid. A copy
+ *      of the frame is kept for the sinks, if any.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCUpload(libVLCData *p, int newest)
+{
+  Tcl_Interp *interp = p->interp;
+  Tk_PhotoHandle photo = NULL;
+  libVLCFrame *f;
+  Tcl_Time now;
+  int index, shown = 0;
+
+  if (!p->headless) {
+    photo = Tk_FindPhoto(interp, Tcl_GetString(p->photo_name));
+  }
+  if (photo == NULL && !p->headless) {
+    libVLCUnblock(p, 1);
+    libvlc_media_player_stop(p->media_player);
+    libVLCUnblock(p, 0);
+    /* hand all queued buffers back to decoder */
+    Tcl_MutexLock(&p->frame_lock);
+    if (p->frames != NULL) {
+      if ((index = TKVLC_XCHG(p->latest, -1)) >= 0) {
+        libVLCRingPush(&p->free, index);
+      }
+      while ((index = libVLCRingPop(&p->ready)) >= 0) {
+        libVLCRingPush(&p->free, index);
+      }
+    }
+    Tcl_MutexUnlock(&p->frame_lock);
+    return -1;
+  }
+  if (p->fit && !p->headless) {
+    int width, height;
+
+    Tk_PhotoGetSize(photo, &width, &height);
+    if (width > 0 && height > 0 &&
+        (width != p->req_width || height != p->req_height)) {
+      p->req_width = width;
+      p->req_height = height;
+      Tcl_CancelIdleCall(libVLCresize, p);
+      Tcl_DoWhenIdle(libVLCresize, p);
+    }
+  }
+  Tcl_MutexLock(&p->frame_lock);
+  if (p->frames == NULL) {
+    index = -1;
+  } else if (p->mailbox) {
+    index = TKVLC_XCHG(p->latest, -1);
+  } else {
+    index = libVLCRingPop(&p->ready);
+    if (newest) {
+      int next;
+
+      while ((next = libVLCRingPop(&p->ready)) >= 0) {
+        libVLCMergeDirty(p, &p->frames[next], &p->frames[index]);
+        libVLCRingPush(&p->free, index);
+        index = next;
+        TKVLC_INCR(p->ndropped);
+      }
+    }
+  }
+  if (index < 0) {
+    Tcl_MutexUnlock(&p->frame_lock);
+    return -1;
+  }
+  f = &p->frames[index];
+  if (p->headless) {
+    /* the last frames of the media arrive after it ended */
+    shown = libvlc_media_player_get_state(p->media_player) != libvlc_Stopped;
+  } else if ((libvlc_media_player_is_playing(p->media_player) == 1 ||
+              p->switch_start != 0) &&
+             libVLCPutFrame(p, photo, f) == TCL_OK) {
+    shown = 1;
+  } else {
+    /* photo image no longer matches reference frame */
+    p->synced = 0;
+  }
+  Tcl_ResetResult(interp);
+  if (shown && (p->sink_cmd != NULL || p->sink_chan != NULL)) {
+    /* copied under the lock, delivered by libVLCFrameShown() */
+    p->sink_frame = Tcl_NewByteArrayObj(f->pixels,
+                                        p->width * p->height * p->pixel_size);
+    Tcl_IncrRefCount(p->sink_frame);
+  }
+  if (shown) {
+    /* hold the frame shown for snapshots, hand the one before back */
+    if (p->held >= 0) {
+      libVLCRingPush(&p->free, p->held);
+    }
+    p->held = index;
+  } else {
+    /* hand buffer back to decoder */
+    libVLCRingPush(&p->free, index);
+  }
+  if (!newest && !p->mailbox &&
+      TKVLC_LOAD(p->ready.head) != TKVLC_LOAD(p->ready.tail)) {
+    /* more frames queued, deliver after redisplay */
+    Tcl_DoWhenIdle(libVLCrearm, p);
+  }
+  if (p->block) {
+    Tcl_ConditionNotify(&p->free_cond);
+  }
+  Tcl_MutexUnlock(&p->frame_lock);
+  if (shown) {
+    /* frame interval and its mean deviation */
+    Tcl_GetTime(&now);
+    if (p->last_put.sec != 0 || p->last_put.usec != 0) {
+      long iv = (now.sec - p->last_put.sec) * 1000000 +
+                (now.usec - p->last_put.usec);
+      long dev;
+
+      if (p->interval_us == 0) {
+        p->interval_us = iv;
+      }
+      p->interval_us += (iv - p->interval_us) / 8;
+      dev = iv - p->interval_us;
+      p->jitter_us += (((dev < 0) ? -dev : dev) - p->jitter_us) / 8;
+    }
+    p->last_put = now;
+    if (p->switch_start != 0) {
+      p->switch_us = (long) ((Tcl_WideInt) now.sec * 1000000 + now.usec -
+                             p->switch_start);
+      p->switch_start = 0;
+    }
+  }
+  return shown;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCSnapshot --
+ *
+ *      Copy the frame shown last, or the newest rendered frame when
+ *      none was shown yet, into a byte array in the given format:
+ *      0 for RGB, 1 for RGBA, 2 for binary PPM.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCSnapshot(libVLCData *p, Tcl_Interp *interp, int format)
+{
+  Tcl_Obj *obj;
+  unsigned char *src, *dst;
+  char header[64];
+  int i, index, npixels, hlen = 0, size = (format == 1) ? 4 : 3;
+
+  Tcl_MutexLock(&p->frame_lock);
+  index = p->held;
+  if (index < 0 && p->frames != NULL && !p->mailbox) {
+    /* nothing shown yet, e.g. pre-rolled: newest frame in the ring */
+    unsigned int head = TKVLC_LOAD(p->ready.head);
+
+    if (head != p->ready.tail) {
+      index = p->ready.slots[(head - 1) & p->ready.mask];
+    }
+  }
+  if (p->frames == NULL || index < 0) {
+    Tcl_MutexUnlock(&p->frame_lock);
+    Tcl_SetResult(interp, "no frame available", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if (format == 2) {
+    hlen = sprintf(header, "P6\n%d %d\n255\n", p->width, p->height);
+  }
+  npixels = p->width * p->height;
+  obj = Tcl_NewObj();
+  dst = Tcl_SetByteArrayLength(obj, hlen + npixels * size);
+  memcpy(dst, header, hlen);
+  dst += hlen;
+  src = p->frames[index].pixels;
+  if (size == p->pixel_size) {
+    memcpy(dst, src, npixels * size);
+  } else if (size == 3) {
+    for (i = 0; i < npixels; i++, src += 4, dst += 3) {
+      dst[0] = src[0];
+      dst[1] = src[1];
+      dst[2] = src[2];
+    }
+  } else {
+    for (i = 0; i < npixels; i++, src += 3, dst += 4) {
+      dst[0] = src[0];
+      dst[1] = src[1];
+      dst[2] = src[2];
+      dst[3] = 0xFF;
+    }
+  }
+  Tcl_MutexUnlock(&p->frame_lock);
+  Tcl_SetObjResult(interp, obj);
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCSinkFrame --
+ *
+ *      Write a frame to the sink channel and invoke the sink
+ *      command with the frame, its width, and its height.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Output to the channel, the sink command is evaluated. The
+ *      channel is dropped when writing to it fails.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCSinkFrame(libVLCData *p, Tcl_Obj *frameObj)
+{
+  Tcl_Interp *interp = p->interp;
+  Tcl_InterpState state;
+  Tcl_Channel chan;
+  int ret;
+
+  Tcl_Preserve(interp);
+  state = Tcl_SaveInterpState(interp, TCL_OK);
+  if (p->sink_chan != NULL) {
+    chan = Tcl_GetChannel(interp, Tcl_GetString(p->sink_chan), NULL);
+    if (chan == NULL || Tcl_WriteObj(chan, frameObj) < 0) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\": %s",
+          Tcl_GetString(p->sink_chan), (chan == NULL) ?
+          "channel is closed" : Tcl_ErrnoMsg(Tcl_GetErrno())));
+      Tcl_AddErrorInfo(interp, "\n    (tkvlc frame sink)");
+      Tcl_BackgroundException(interp, TCL_ERROR);
+      Tcl_DecrRefCount(p->sink_chan);
+      p->sink_chan = NULL;
+    }
+  }
+  if (p->sink_cmd != NULL) {
+    /* a copy, the command may replace the sink */
+    Tcl_Obj *cmdObj = Tcl_DuplicateObj(p->sink_cmd);
+
+    Tcl_ListObjAppendElement(NULL, cmdObj, frameObj);
+    Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewIntObj(p->width));
+    Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewIntObj(p->height));
+    Tcl_IncrRefCount(cmdObj);
+    ret = Tcl_EvalObjEx(interp, cmdObj, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(cmdObj);
+    if (ret != TCL_OK) {
+      Tcl_AddErrorInfo(interp, "\n    (tkvlc frame sink)");
+      Tcl_BackgroundException(interp, ret);
+    }
+  }
+  Tcl_RestoreInterpState(interp, state);
+  Tcl_Release(interp);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCFrameShown --
+ *
+ *      Hand a frame taken by libVLCUpload() to the sinks, then
+ *      invoke the frame event callback.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Scripts are evaluated, which may destroy the media player.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCFrameShown(libVLCData *p)
+{
+  Tcl_Obj *frameObj = p->sink_frame;
+
+  Tcl_Preserve(p);
+  if (frameObj != NULL) {
+    p->sink_frame = NULL;
+    libVLCSinkFrame(p, frameObj);
+    Tcl_DecrRefCount(frameObj);
+  }
+  if (!p->destroyed) {
+    DoEventCallback(p, EV_NEW_FRAME, NULL);
+  }
+  Tcl_Release(p);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCtick --
+ *
+ *      Timer procedure delivering frames at the rate set with
+ *      -maxfps. Keeps running while frames arrive and stops when
+ *      a tick finds none, until the next frame event restarts it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A frame is copied to the photo image, the sinks and the
+ *      frame event callback are invoked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCtick(ClientData clientData)
+{
+  libVLCData *p = (libVLCData *) clientData;
+  Tcl_Time now;
+  Tcl_WideInt nowus, delay;
+  int shown;
+
+  p->timer = NULL;
+  shown = libVLCUpload(p, 1);
+  if (shown < 0) {
+    /* idle, let the decoder queue a frame event for the next frame */
+    TKVLC_STORE(p->ticking, 0);
+    TKVLC_FENCE();
+    if (p->frames == NULL || (p->mailbox ? TKVLC_LOAD(p->latest) < 0 :
+        TKVLC_LOAD(p->ready.head) == TKVLC_LOAD(p->ready.tail))) {
+      return;
+    }
+    TKVLC_STORE(p->ticking, 1);
+  }
+  /* next tick on the even cadence, without catching up on stalls */
+  Tcl_GetTime(&now);
+  nowus = (Tcl_WideInt) now.sec * 1000000 + now.usec;
+  p->due += 1000000 / p->maxfps;
+  if (p->due < nowus) {
+    p->due = nowus;
+  }
+  delay = (p->due - nowus + 500) / 1000;
+  p->timer = Tcl_CreateTimerHandler((int) delay, libVLCtick, p);
+  if (shown > 0) {
+    /* last, the callbacks may destroy the media player */
+    libVLCFrameShown(p);
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCready --
+ *
+ *      Procedure called by the Tcl event mechanism. The event
+ *      indicates that the frame ring holds filled video buffers,
+ *      the oldest of which is copied to the photo image. In mailbox
+ *      mode the latest frame is copied instead. With -maxfps the
+ *      frame timer is started instead.
+ *
+ * Results:
+ *      Always true (event handled).
+ *
+ * Side effects:
+ *      Playback is stopped when the photo image is invalid.
+ *      The sinks and a frame event callback are invoked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCready(Tcl_Event *ev, int flags)
+{
+  libVLCEvent *e = (libVLCEvent *) ev;
+  libVLCData *p = e->p;
+
+  if (p == NULL) {
+    /* about to tear down media player */
+    return 1;
+  }
+  p->frame_ev = NULL;
+  p->frame_next = libVLCNewFrameEvent(p);
+  TKVLC_STORE(p->frame_pending, 0);
+  if (p->hidden) {
+    /* standby player: hold the first frame in the ring until switch */
+    if (!p->prerolled) {
+      Tcl_Time now;
+
+      Tcl_GetTime(&now);
+      p->preroll_us = (long) ((Tcl_WideInt) now.sec * 1000000 + now.usec -
+                              p->preload_start);
+      p->prerolled = 1;
+      libvlc_media_player_set_pause(p->media_player, 1);
+    }
+    return 1;
+  }
+  if (p->maxfps > 0) {
+    if (p->timer == NULL) {
+      Tcl_Time now;
+
+      TKVLC_STORE(p->ticking, 1);
+      Tcl_GetTime(&now);
+      p->due = (Tcl_WideInt) now.sec * 1000000 + now.usec;
+      libVLCtick(p);
+    }
+    return 1;
+  }
+  if (libVLCUpload(p, 0) > 0) {
+    /* invoke sinks and callback, if any */
+    libVLCFrameShown(p);
+  }
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCWaitFree --
+ *
+ *      Stall the decoder until the Tcl thread hands a frame buffer
+ *      back, for -backpressure block. The wait is bounded, so that
+ *      a Tcl thread busy elsewhere costs a dropped frame at worst.
+ *
+ * Results:
+ *      Index of a free frame buffer, or -1.
+ *
+ * Side effects:
+ *      The decoder thread sleeps.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCWaitFree(libVLCData *p)
+{
+  Tcl_Time slice = { 0, 10000 };
+  int index = -1, waited = 0;
+
+  TKVLC_INCR(p->nblocked);
+  Tcl_MutexLock(&p->frame_lock);
+  while (!TKVLC_LOAD(p->unblock) && waited < TKVLC_BLOCK_MS &&
+         (index = libVLCRingPop(&p->free)) < 0) {
+    Tcl_ConditionWait(&p->free_cond, &p->frame_lock, &slice);
+    waited += 10;
+  }
+  Tcl_MutexUnlock(&p->frame_lock);
+  return index;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLClock --
+ *
+ *      Procedure called in libvlc context when a new video frame is
+ *      to be decoded.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A free frame buffer is taken from the ring, or the scratch
+ *      buffer is used when all are still queued for display. With
+ *      -backpressure block a free buffer is waited for first.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void *libVLClock(void *clientData, void **planes)
+{
+  libVLCData *p = (libVLCData *) clientData;
+  int index = p->spare;
+
+  if (index >= 0) {
+    p->spare = -1;
+  } else {
+    index = libVLCRingPop(&p->free);
+  }
+  if (index < 0 && p->block && !p->mailbox) {
+    index = libVLCWaitFree(p);
+  }
+  if (index < 0) {
+    index = p->nbuffers;
+  }
+  Tcl_GetTime(&p->lock_time);
+  if (FMT_PLANAR(p->format)) {
+    planes[0] = p->frames[index].yuv[0];
+    planes[1] = p->frames[index].yuv[1];
+    planes[2] = p->frames[index].yuv[2];
+  } else {
+    planes[0] = p->frames[index].pixels;
+  }
+  return &p->frames[index];
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCForceOpaque --
+ *
+ *      Set the alpha channel of a RGBA frame to fully opaque,
+ *      since sources with transparency would otherwise shine
+ *      through the photo image.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frame buffer is modified.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCForceOpaque(unsigned char *pixels, int npixels)
+{
+  union {
+    unsigned char b[4];
+    uint32_t w;
+  } alpha = {{ 0, 0, 0, 0xFF }};
+  uint32_t *px = (uint32_t *) pixels;
+  int i;
+
+  for (i = 0; i < npixels; i++) {
+    px[i] |= alpha.w;
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCYuvRowScalar --
+ *
+ *      Convert a row of YUV 4:2:0 pixels (ITU-R BT.601, limited
+ *      range) to RGBA. The fixed point arithmetic is shared with
+ *      the SIMD variants below which produce identical results.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Destination row is written.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCYuvRowScalar(const unsigned char *y,
+    const unsigned char *u, const unsigned char *v, unsigned char *dst,
+    int width)
+{
+  int i;
+
+  for (i = 0; i < width; i++) {
+    int c = 74 * (y[i] - 16);
+    int d = u[i >> 1] - 128;
+    int e = v[i >> 1] - 128;
+    int r = (c + 102 * e + 32) >> 6;
+    int g = (c - 25 * d - 52 * e + 32) >> 6;
+    int b = (c + 129 * d + 32) >> 6;
+
+    dst[0] = (r < 0) ? 0 : ((r > 255) ? 255 : r);
+    dst[1] = (g < 0) ? 0 : ((g > 255) ? 255 : g);
+    dst[2] = (b < 0) ? 0 : ((b > 255) ? 255 : b);
+    dst[3] = 0xFF;
+    dst += 4;
+  }
+}
+
+#ifdef TKVLC_X86_DISPATCH
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCYuvRowSSE41 --
+ *
+ *      SSE4.1 variant of libVLCYuvRowScalar, 16 pixels per step.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Destination row is written.
+ *
+ *----------------------------------------------------------------------
+ */
+
+__attribute__((target("sse4.1")))
+static void libVLCYuvRowSSE41(const unsigned char *y,
+    const unsigned char *u, const unsigned char *v, unsigned char *dst,
+    int width)
+{
+  const __m128i k16 = _mm_set1_epi16(16), k128 = _mm_set1_epi16(128);
+  const __m128i k32 = _mm_set1_epi16(32), ky = _mm_set1_epi16(74);
+  const __m128i krv = _mm_set1_epi16(102), kgu = _mm_set1_epi16(25);
+  const __m128i kgv = _mm_set1_epi16(52), kbu = _mm_set1_epi16(129);
+  const __m128i alpha = _mm_set1_epi8((char) 0xFF);
+  int i, k;
+
+  for (i = 0; i + 16 <= width; i += 16) {
+    __m128i yy = _mm_loadu_si128((const __m128i *) (y + i));
+    __m128i uu = _mm_loadl_epi64((const __m128i *) (u + i / 2));
+    __m128i vv = _mm_loadl_epi64((const __m128i *) (v + i / 2));
+    __m128i r[2], g[2], b[2], rr, gg, bb, rg, ba;
+
+    uu = _mm_unpacklo_epi8(uu, uu);
+    vv = _mm_unpacklo_epi8(vv, vv);
+    for (k = 0; k < 2; k++) {
+      __m128i c = _mm_cvtepu8_epi16(yy);
+      __m128i d = _mm_sub_epi16(_mm_cvtepu8_epi16(uu), k128);
+      __m128i e = _mm_sub_epi16(_mm_cvtepu8_epi16(vv), k128);
+
+      c = _mm_mullo_epi16(_mm_sub_epi16(c, k16), ky);
+      r[k] = _mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(c,
+                 _mm_mullo_epi16(e, krv)), k32), 6);
+      g[k] = _mm_srai_epi16(_mm_adds_epi16(_mm_subs_epi16(_mm_subs_epi16(c,
+                 _mm_mullo_epi16(d, kgu)), _mm_mullo_epi16(e, kgv)), k32), 6);
+      b[k] = _mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(c,
+                 _mm_mullo_epi16(d, kbu)), k32), 6);
+      yy = _mm_srli_si128(yy, 8);
+      uu = _mm_srli_si128(uu, 8);
+      vv = _mm_srli_si128(vv, 8);
+    }
+    rr = _mm_packus_epi16(r[0], r[1]);
+    gg = _mm_packus_epi16(g[0], g[1]);
+    bb = _mm_packus_epi16(b[0], b[1]);
+    rg = _mm_unpacklo_epi8(rr, gg);
+    ba = _mm_unpacklo_epi8(bb, alpha);
+    _mm_storeu_si128((__m128i *) dst, _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i *) (dst + 16), _mm_unpackhi_epi16(rg, ba));
+    rg = _mm_unpackhi_epi8(rr, gg);
+    ba = _mm_unpackhi_epi8(bb, alpha);
+    _mm_storeu_si128((__m128i *) (dst + 32), _mm_unpacklo_epi16(rg, ba));
+    _mm_storeu_si128((__m128i *) (dst + 48), _mm_unpackhi_epi16(rg, ba));
+    dst += 64;
+  }
+  libVLCYuvRowScalar(y + i, u + i / 2, v + i / 2, dst, width - i);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCYuvRowAVX2 --
+ *
+ *      AVX2 variant of libVLCYuvRowScalar, 32 pixels per step.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Destination row is written.
+ *
+ *----------------------------------------------------------------------
+ */
+
+__attribute__((target("avx2")))
+static void libVLCYuvRowAVX2(const unsigned char *y,
+    const unsigned char *u, const unsigned char *v, unsigned char *dst,
+    int width)
+{
+  const __m256i k16 = _mm256_set1_epi16(16), k128 = _mm256_set1_epi16(128);
+  const __m256i k32 = _mm256_set1_epi16(32), ky = _mm256_set1_epi16(74);
+  const __m256i krv = _mm256_set1_epi16(102), kgu = _mm256_set1_epi16(25);
+  const __m256i kgv = _mm256_set1_epi16(52), kbu = _mm256_set1_epi16(129);
+  const __m256i alpha = _mm256_set1_epi8((char) 0xFF);
+  int i, k;
+
+  for (i = 0; i + 32 <= width; i += 32) {
+    __m256i yy = _mm256_loadu_si256((const __m256i *) (y + i));
+    __m128i uu = _mm_loadu_si128((const __m128i *) (u + i / 2));
+    __m128i vv = _mm_loadu_si128((const __m128i *) (v + i / 2));
+    __m128i ud[2], vd[2];
+    __m256i r[2], g[2], b[2], rr, gg, bb, rg0, rg1, ba0, ba1, q0, q1, q2, q3;
+
+    ud[0] = _mm_unpacklo_epi8(uu, uu);
+    ud[1] = _mm_unpackhi_epi8(uu, uu);
+    vd[0] = _mm_unpacklo_epi8(vv, vv);
+    vd[1] = _mm_unpackhi_epi8(vv, vv);
+    for (k = 0; k < 2; k++) {
+      __m256i c = _mm256_cvtepu8_epi16(k ? _mm256_extracti128_si256(yy, 1)
+                                         : _mm256_castsi256_si128(yy));
+      __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(ud[k]), k128);
+      __m256i e = _mm256_sub_epi16(_mm256_cvtepu8_epi16(vd[k]), k128);
+
+      c = _mm256_mullo_epi16(_mm256_sub_epi16(c, k16), ky);
+      r[k] = _mm256_srai_epi16(_mm256_adds_epi16(_mm256_adds_epi16(c,
+                 _mm256_mullo_epi16(e, krv)), k32), 6);
+      g[k] = _mm256_srai_epi16(_mm256_adds_epi16(_mm256_subs_epi16(
+                 _mm256_subs_epi16(c, _mm256_mullo_epi16(d, kgu)),
+                 _mm256_mullo_epi16(e, kgv)), k32), 6);
+      b[k] = _mm256_srai_epi16(_mm256_adds_epi16(_mm256_adds_epi16(c,
+                 _mm256_mullo_epi16(d, kbu)), k32), 6);
+    }
+    /* packing works per 128 bit lane, restore pixel order */
+    rr = _mm256_permute4x64_epi64(_mm256_packus_epi16(r[0], r[1]), 0xD8);
+    gg = _mm256_permute4x64_epi64(_mm256_packus_epi16(g[0], g[1]), 0xD8);
+    bb = _mm256_permute4x64_epi64(_mm256_packus_epi16(b[0], b[1]), 0xD8);
+    rg0 = _mm256_unpacklo_epi8(rr, gg);
+    rg1 = _mm256_unpackhi_epi8(rr, gg);
+    ba0 = _mm256_unpacklo_epi8(bb, alpha);
+    ba1 = _mm256_unpackhi_epi8(bb, alpha);
+    q0 = _mm256_unpacklo_epi16(rg0, ba0);   /* pixels 0-3, 16-19 */
+    q1 = _mm256_unpackhi_epi16(rg0, ba0);   /* pixels 4-7, 20-23 */
+    q2 = _mm256_unpacklo_epi16(rg1, ba1);   /* pixels 8-11, 24-27 */
+    q3 = _mm256_unpackhi_epi16(rg1, ba1);   /* pixels 12-15, 28-31 */
+    _mm256_storeu_si256((__m256i *) dst,
+                        _mm256_permute2x128_si256(q0, q1, 0x20));
+    _mm256_storeu_si256((__m256i *) (dst + 32),
+                        _mm256_permute2x128_si256(q2, q3, 0x20));
+    _mm256_storeu_si256((__m256i *) (dst + 64),
+                        _mm256_permute2x128_si256(q0, q1, 0x31));
+    _mm256_storeu_si256((__m256i *) (dst + 96),
+                        _mm256_permute2x128_si256(q2, q3, 0x31));
+    dst += 128;
+  }
+  libVLCYuvRowScalar(y + i, u + i / 2, v + i / 2, dst, width - i);
+}
+
+#endif /* TKVLC_X86_DISPATCH */
+
+#if defined(__ARM_NEON)
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCYuvRowNEON --
+ *
+ *      NEON variant of libVLCYuvRowScalar, 16 pixels per step.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Destination row is written.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCYuvRowNEON(const unsigned char *y,
+    const unsigned char *u, const unsigned char *v, unsigned char *dst,
+    int width)
+{
+  const int16x8_t k16 = vdupq_n_s16(16), k128 = vdupq_n_s16(128);
+  const int16x8_t k32 = vdupq_n_s16(32);
+  int i, k;
+
+  for (i = 0; i + 16 <= width; i += 16) {
+    uint8x16_t yy = vld1q_u8(y + i);
+    uint8x8_t uu = vld1_u8(u + i / 2);
+    uint8x8_t vv = vld1_u8(v + i / 2);
+    uint8x8x2_t ud = vzip_u8(uu, uu);
+    uint8x8x2_t vd = vzip_u8(vv, vv);
+
+    for (k = 0; k < 2; k++) {
+      uint8x8x4_t px;
+      int16x8_t c, d, e, r, g, b;
+
+      c = vreinterpretq_s16_u16(vmovl_u8(k ? vget_high_u8(yy)
+                                           : vget_low_u8(yy)));
+      d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(ud.val[k])), k128);
+      e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vd.val[k])), k128);
+      c = vmulq_n_s16(vsubq_s16(c, k16), 74);
+      r = vshrq_n_s16(vqaddq_s16(vqaddq_s16(c, vmulq_n_s16(e, 102)), k32), 6);
+      g = vshrq_n_s16(vqaddq_s16(vqsubq_s16(vqsubq_s16(c,
+              vmulq_n_s16(d, 25)), vmulq_n_s16(e, 52)), k32), 6);
+      b = vshrq_n_s16(vqaddq_s16(vqaddq_s16(c, vmulq_n_s16(d, 129)), k32), 6);
+      px.val[0] = vqmovun_s16(r);
+      px.val[1] = vqmovun_s16(g);
+      px.val[2] = vqmovun_s16(b);
+      px.val[3] = vdup_n_u8(0xFF);
+      vst4_u8(dst, px);
+      dst += 32;
+    }
+  }
+  libVLCYuvRowScalar(y + i, u + i / 2, v + i / 2, dst, width - i);
+}
+
+#endif /* __ARM_NEON */
+
+/*
+ * Row converter selected by libVLCInitConverter().
+ */
+
+static libVLCYuvRowProc *libVLCYuvRow = libVLCYuvRowScalar;
+static const char *libVLCYuvRowName = "scalar";
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCInitConverter --
+ *
+ *      Select the fastest YUV to RGBA row converter supported by
+ *      the CPU we are running on.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sets libVLCYuvRow.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCInitConverter(void)
+{
+#if defined(TKVLC_X86_DISPATCH)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    libVLCYuvRow = libVLCYuvRowAVX2;
+    libVLCYuvRowName = "avx2";
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    libVLCYuvRow = libVLCYuvRowSSE41;
+    libVLCYuvRowName = "sse4.1";
+  }
+#elif defined(__ARM_NEON)
+  libVLCYuvRow = libVLCYuvRowNEON;
+  libVLCYuvRowName = "neon";
+#endif
+}
+
+/*
+ * Worker pool to split CPU bound work on frames into row bands.
+ * Jobs live on the stack of the submitting thread, which also
+ * works on its own job until all bands are done.
+ */
+
+typedef struct libVLCJob {
+  void (*proc)(void *arg, int band, int nbands);
+  void *arg;                    /* Argument for proc. */
+  int nbands;                   /* Number of bands. */
+  int next;                     /* Next unclaimed band. */
+  int done;                     /* Number of finished bands. */
+  struct libVLCJob *nextPtr;    /* Queue of jobs with unclaimed bands. */
+} libVLCJob;
+
+TCL_DECLARE_MUTEX(poolMutex)
+static Tcl_Condition poolWork;          /* Signalled when jobs queued. */
+static Tcl_Condition poolDone;          /* Signalled when job finished. */
+static libVLCJob *poolJobs = NULL;      /* Queue of jobs. */
+static int poolSize = -1;               /* Number of workers, -1 unstarted. */
+static int poolExit = 0;                /* True when workers shall exit. */
+static Tcl_ThreadId *poolThreads = NULL;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCClaimBand --
+ *
+ *      Claim the next band of a job, with poolMutex held.
+ *
+ * Results:
+ *      Band number.
+ *
+ * Side effects:
+ *      Job is removed from the queue after its last band is claimed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCClaimBand(libVLCJob *job)
+{
+  int band = job->next++;
+
+  if (job->next >= job->nbands) {
+    libVLCJob **jp = &poolJobs;
+
+    while (*jp != NULL && *jp != job) {
+      jp = &(*jp)->nextPtr;
+    }
+    if (*jp != NULL) {
+      *jp = job->nextPtr;
+    }
+  }
+  return band;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCWorker --
+ *
+ *      Thread procedure of pool workers.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Bands of queued jobs are processed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType libVLCWorker(ClientData clientData)
+{
+  Tcl_MutexLock(&poolMutex);
+  while (!poolExit) {
+    libVLCJob *job = poolJobs;
+    int band;
+
+    if (job == NULL) {
+      Tcl_ConditionWait(&poolWork, &poolMutex, NULL);
+      continue;
+    }
+    band = libVLCClaimBand(job);
+    Tcl_MutexUnlock(&poolMutex);
+    job->proc(job->arg, band, job->nbands);
+    Tcl_MutexLock(&poolMutex);
+    if (++job->done >= job->nbands) {
+      Tcl_ConditionNotify(&poolDone);
+    }
+  }
+  Tcl_MutexUnlock(&poolMutex);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPoolExit --
+ *
+ *      Exit handler to stop the worker pool.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Worker threads are terminated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPoolExit(ClientData clientData)
+{
+  int i, n;
+
+  Tcl_MutexLock(&poolMutex);
+  poolExit = 1;
+  n = poolSize;
+  Tcl_ConditionNotify(&poolWork);
+  Tcl_MutexUnlock(&poolMutex);
+  for (i = 0; i < n; i++) {
+    Tcl_JoinThread(poolThreads[i], NULL);
+  }
+  if (poolThreads != NULL) {
+    ckfree(poolThreads);
+    poolThreads = NULL;
+  }
+  poolSize = -1;
+  poolExit = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPoolStart --
+ *
+ *      Start the worker pool with one thread less than there are
+ *      processors, since the submitting thread works, too. Must be
+ *      called with poolMutex held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Threads are created.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPoolStart(void)
+{
+  int i, ncpus = libVLCNumCpus();
+
+  if (ncpus > TKVLC_MAX_WORKERS + 1) {
+    ncpus = TKVLC_MAX_WORKERS + 1;
+  }
+  poolSize = 0;
+  if (ncpus > 1) {
+    poolThreads = (Tcl_ThreadId *)
+        ckalloc((ncpus - 1) * sizeof(Tcl_ThreadId));
+  }
+  for (i = 0; i < ncpus - 1; i++) {
+    if (Tcl_CreateThread(&poolThreads[poolSize], libVLCWorker, NULL,
+                         TCL_THREAD_STACK_DEFAULT,
+                         TCL_THREAD_JOINABLE) == TCL_OK) {
+      poolSize++;
+    }
+  }
+  Tcl_CreateExitHandler(libVLCPoolExit, NULL);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCParallel --
+ *
+ *      Run a procedure on all bands of a job using the worker pool
+ *      and the calling thread. May be called from any thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The worker pool is started on first use.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCParallel(void (*proc)(void *, int, int), void *arg)
+{
+  libVLCJob job;
+
+  Tcl_MutexLock(&poolMutex);
+  if (poolSize < 0) {
+    libVLCPoolStart();
+  }
+  if (poolSize == 0) {
+    Tcl_MutexUnlock(&poolMutex);
+    proc(arg, 0, 1);
+    return;
+  }
+  job.proc = proc;
+  job.arg = arg;
+  job.nbands = poolSize + 1;
+  job.next = job.done = 0;
+  job.nextPtr = poolJobs;
+  poolJobs = &job;
+  Tcl_ConditionNotify(&poolWork);
+  while (job.next < job.nbands) {
+    int band = libVLCClaimBand(&job);
+
+    Tcl_MutexUnlock(&poolMutex);
+    proc(arg, band, job.nbands);
+    Tcl_MutexLock(&poolMutex);
+    job.done++;
+  }
+  while (job.done < job.nbands) {
+    Tcl_ConditionWait(&poolDone, &poolMutex, NULL);
+  }
+  Tcl_MutexUnlock(&poolMutex);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCConvertBand --
+ *
+ *      Convert a band of rows of a planar frame to RGBA. Bands
+ *      start on even rows to not split chroma rows.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frame buffer is written.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCConvertBand(void *arg, int band, int nbands)
+{
+  libVLCFrame *f = (libVLCFrame *) arg;
+  libVLCData *p = f->p;
+  int crows = (p->height + 1) / 2;
+  int y = 2 * (crows * band / nbands);
+  int yend = 2 * (crows * (band + 1) / nbands);
+  unsigned char ubuf[TKVLC_MAX_SIZE / 2], vbuf[TKVLC_MAX_SIZE / 2];
+
+  if (yend > p->height) {
+    yend = p->height;
+  }
+  for (; y < yend; y++) {
+    const unsigned char *u, *v;
+
+    if (p->format == FMT_NV12) {
+      const unsigned char *uv = f->yuv[1] + (y / 2) * p->pitches[1];
+      int i, cwidth = (p->width + 1) / 2;
+
+      for (i = 0; i < cwidth; i++) {
+        ubuf[i] = uv[2 * i];
+        vbuf[i] = uv[2 * i + 1];
+      }
+      u = ubuf;
+      v = vbuf;
+    } else {
+      u = f->yuv[1] + (y / 2) * p->pitches[1];
+      v = f->yuv[2] + (y / 2) * p->pitches[2];
+    }
+    libVLCYuvRow(f->yuv[0] + y * p->pitches[0], u, v,
+                 f->pixels + y * p->width * 4, p->width);
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCTileDiffers --
+ *
+ *      Compare a rectangular tile of two frame buffers using
+ *      SIMD instructions where available.
+ *
+ * Results:
+ *      True if any byte of the tiles differs.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCTileDiffers(const unsigned char *a, const unsigned char *b,
+                             int pitch, int len, int rows)
+{
+  int r, i;
+
+  for (r = 0; r < rows; r++, a += pitch, b += pitch) {
+    i = 0;
+#if defined(__SSE2__)
+    {
+      __m128i acc = _mm_setzero_si128();
+
+      for (; i + 16 <= len; i += 16) {
+        acc = _mm_or_si128(acc,
+            _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + i)),
+                          _mm_loadu_si128((const __m128i *) (b + i))));
+      }
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128()))
+          != 0xFFFF) {
+        return 1;
+      }
+    }
+#elif defined(__ARM_NEON)
+    {
+      uint8x16_t acc = vdupq_n_u8(0);
+      uint8x8_t acc8;
+
+      for (; i + 16 <= len; i += 16) {
+        acc = vorrq_u8(acc, veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+      }
+      acc8 = vorr_u8(vget_low_u8(acc), vget_high_u8(acc));
+      if (vget_lane_u64(vreinterpret_u64_u8(acc8), 0) != 0) {
+        return 1;
+      }
+    }
+#endif
+    if (i < len && memcmp(a + i, b + i, len - i) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCDiffFrame --
+ *
+ *      Compare a rendered frame tile by tile with the previously
+ *      queued frame and record the changed tiles in the frame.
+ *
+ * Results:
+ *      Number of changed tiles, zero when the frame is unchanged.
+ *
+ * Side effects:
+ *      Changed tiles are copied to the reference frame.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCDiffFrame(libVLCData *p, libVLCFrame *f)
+{
+  int pitch = p->width * p->pixel_size;
+  int tx, ty, x, y, r, rows, len, ndirty = 0;
+  unsigned char *dirty = f->dirty;
+
+  if (!p->ref_valid) {
+    memcpy(p->ref, f->pixels, pitch * p->height);
+    p->ref_valid = 1;
+    f->full = 1;
+    return 1;
+  }
+  f->full = 0;
+  for (ty = 0; ty < p->tiles_y; ty++) {
+    y = ty * TKVLC_TILE;
+    rows = p->height - y;
+    if (rows > TKVLC_TILE) {
+      rows = TKVLC_TILE;
+    }
+    for (tx = 0; tx < p->tiles_x; tx++) {
+      int offset;
+
+      x = tx * TKVLC_TILE;
+      len = p->width - x;
+      if (len > TKVLC_TILE) {
+        len = TKVLC_TILE;
+      }
+      len *= p->pixel_size;
+      offset = y * pitch + x * p->pixel_size;
+      *dirty = libVLCTileDiffers(f->pixels + offset, p->ref + offset,
+                                 pitch, len, rows);
+      if (*dirty) {
+        for (r = 0; r < rows; r++, offset += pitch) {
+          memcpy(p->ref + offset, f->pixels + offset, len);
+        }
+        ndirty++;
+      }
+      dirty++;
+    }
+  }
+  return ndirty;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPostLatest --
+ *
+ *      Put a frame into the mailbox, replacing a frame which was
+ *      not yet picked up by the Tcl thread. In delta mode the dirty
+ *      tiles of the replaced frame are carried over, since they
+ *      never reached the photo image.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A replaced frame buffer is reused by the decoder.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPostLatest(libVLCData *p, libVLCFrame *f)
+{
+  int old = TKVLC_XCHG(p->latest, -1);
+
+  if (old >= 0) {
+    libVLCMergeDirty(p, f, &p->frames[old]);
+    p->spare = old;
+    TKVLC_INCR(p->ndropped);
+  }
+  TKVLC_STORE(p->latest, f->index);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCAverage --
+ *
+ *      Fold the time elapsed since a start time into a moving
+ *      average in microseconds.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Average is updated atomically.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCAverage(unsigned int *avg, const Tcl_Time *start)
+{
+  Tcl_Time now;
+  long us;
+  unsigned int old = TKVLC_LOAD(*avg);
+
+  Tcl_GetTime(&now);
+  us = (now.sec - start->sec) * 1000000 + (now.usec - start->usec);
+  if (us < 0) {
+    us = 0;
+  }
+  if (old != 0) {
+    us = (long) old + (us - (long) old) / 8;
+  }
+  TKVLC_STORE(*avg, (unsigned int) us);
+}
+
+#ifdef TKVLC_HAVE_SHM
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCShmLayout --
+ *
+ *      Size the slots of a shared memory export for frames of the
+ *      given number of bytes. The object only grows, the frames
+ *      in the slots are discarded when it does.
+ *
+ * Results:
+ *      0 on success, an errno value otherwise.
+ *
+ * Side effects:
+ *      The object is resized and mapped again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCShmLayout(libVLCShm *s, size_t bytes)
+{
+  TkvlcShmHeader *hdr = (TkvlcShmHeader *) s->hdr;
+  size_t slot_size, size;
+  uint32_t gen = 0;
+  void *map;
+  int i, err;
+
+  slot_size = TKVLC_SHM_ALIGN +
+      ((bytes + TKVLC_SHM_ALIGN - 1) & ~((size_t) TKVLC_SHM_ALIGN - 1));
+  if (hdr != NULL && slot_size <= hdr->slot_size) {
+    return 0;
+  }
+  if (slot_size > UINT32_MAX) {
+    return EFBIG;
+  }
+  size = TKVLC_SHM_ALIGN + s->nslots * slot_size;
+  if (hdr != NULL) {
+    /* readers hold off while the layout changes */
+    gen = hdr->generation;
+    TKVLC_STORE(hdr->generation, gen + 1);
+    TKVLC_FENCE();
+  }
+  if (ftruncate(s->fd, (off_t) size) != 0 ||
+      (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0)) == MAP_FAILED) {
+    err = errno;
+    if (hdr != NULL) {
+      TKVLC_STORE(hdr->generation, gen + 2);
+    }
+    return err;
+  }
+  if (hdr != NULL) {
+    munmap(s->hdr, s->size);
+  }
+  s->hdr = map;
+  s->size = size;
+  hdr = (TkvlcShmHeader *) map;
+  hdr->nslots = s->nslots;
+  hdr->slot_size = (uint32_t) slot_size;
+  hdr->size = size;
+  for (i = 0; i < s->nslots; i++) {
+    TkvlcShmSlot *slot = (TkvlcShmSlot *)
+        ((unsigned char *) map + TKVLC_SHM_ALIGN + i * slot_size);
+
+    slot->lock = 0;
+    slot->seq = 0;
+  }
+  TKVLC_STORE(hdr->generation, gen + 2);
+  return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCShmOpen --
+ *
+ *      Create the shared memory object of an export. An object of
+ *      the same name is unlinked first: a stale one is replaced, and
+ *      the writer of a live one keeps writing to it undisturbed.
+ *
+ * Results:
+ *      The export or NULL with an error message in the interpreter.
+ *
+ * Side effects:
+ *      A shared memory object is created and mapped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static libVLCShm *libVLCShmOpen(Tcl_Interp *interp, Tcl_Obj *nameObj,
+                                int nslots)
+{
+  const char *name = Tcl_GetString(nameObj);
+  TkvlcShmHeader *hdr;
+  libVLCShm *s;
+  int err;
+
+  if (*name == '/') {
+    name++;
+  }
+  if (*name == '\0' || strchr(name, '/') != NULL) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+        "bad shared memory name \"%s\"", Tcl_GetString(nameObj)));
+    return NULL;
+  }
+  s = (libVLCShm *) ckalloc(sizeof(*s));
+  s->path = (char *) ckalloc(strlen(name) + 2);
+  sprintf(s->path, "/%s", name);
+  s->nslots = nslots;
+  s->hdr = NULL;
+  s->size = 0;
+  s->error = 0;
+  shm_unlink(s->path);
+  s->fd = shm_open(s->path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (s->fd < 0) {
+    err = errno;
+  } else if ((err = libVLCShmLayout(s, 0)) != 0) {
+    close(s->fd);
+    shm_unlink(s->path);
+  }
+  if (s->fd < 0 || err != 0) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+        "couldn't create shared memory \"%s\": %s",
+        Tcl_GetString(nameObj), Tcl_ErrnoMsg(err)));
+    ckfree(s->path);
+    ckfree(s);
+    return NULL;
+  }
+  hdr = (TkvlcShmHeader *) s->hdr;
+  hdr->version = TKVLC_SHM_VERSION;
+  TKVLC_FENCE();
+  memcpy(hdr->magic, TKVLC_SHM_MAGIC, sizeof(hdr->magic));
+  s->name = nameObj;
+  Tcl_IncrRefCount(s->name);
+  return s;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCShmClose --
+ *
+ *      Release a shared memory export. Its name is unlinked unless
+ *      it refers to another object by now.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The object goes away when no reader has it mapped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCShmClose(libVLCShm *s)
+{
+  struct stat st1, st2;
+  int fd = shm_open(s->path, O_RDONLY, 0);
+
+  if (fd >= 0) {
+    if (fstat(fd, &st1) == 0 && fstat(s->fd, &st2) == 0 &&
+        st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino) {
+      shm_unlink(s->path);
+    }
+    close(fd);
+  }
+  munmap(s->hdr, s->size);
+  close(s->fd);
+  Tcl_DecrRefCount(s->name);
+  ckfree(s->path);
+  ckfree(s);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCShmPublish --
+ *
+ *      Copy a finished frame into the next slot of the shared
+ *      memory export, if any. Called by the decoder thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The frame is visible to readers in other processes. The
+ *      export stops when its object cannot be resized.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCShmPublish(libVLCData *p, libVLCFrame *f)
+{
+  size_t bytes = (size_t) p->width * p->height * p->pixel_size;
+  TkvlcShmHeader *hdr;
+  TkvlcShmSlot *slot;
+  libVLCShm *s;
+  Tcl_Time now;
+  uint64_t n;
+  uint32_t lock;
+
+  Tcl_MutexLock(&p->shm_lock);
+  s = p->shm;
+  if (s == NULL || s->error != 0 ||
+      (s->error = libVLCShmLayout(s, bytes)) != 0) {
+    Tcl_MutexUnlock(&p->shm_lock);
+    return;
+  }
+  Tcl_GetTime(&now);
+  hdr = (TkvlcShmHeader *) s->hdr;
+  n = hdr->seq + 1;
+  slot = TKVLC_SHM_SLOT(hdr, n);
+  lock = slot->lock;
+  TKVLC_STORE(slot->lock, lock + 1);
+  TKVLC_FENCE();
+  slot->width = p->width;
+  slot->height = p->height;
+  slot->pixel_size = p->pixel_size;
+  slot->seq = n;
+  slot->time_us = (int64_t) now.sec * 1000000 + now.usec;
+  memcpy(TKVLC_SHM_DATA(slot), f->pixels, bytes);
+  TKVLC_STORE(slot->lock, lock + 2);
+  TKVLC_STORE(hdr->seq, n);
+  Tcl_MutexUnlock(&p->shm_lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCShmExport --
+ *
+ *      Finish and publish a frame which is dropped or skipped for
+ *      the photo image, other processes get it nevertheless.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The frame is converted and copied to the export, if any.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCShmExport(libVLCData *p, libVLCFrame *f)
+{
+  if (TKVLC_LOAD(p->shm) == NULL) {
+    return;
+  }
+  if (FMT_PLANAR(p->format)) {
+    libVLCParallel(libVLCConvertBand, f);
+  } else if (p->format == FMT_RGBA) {
+    libVLCForceOpaque(f->pixels, p->width * p->height);
+  }
+  libVLCShmPublish(p, f);
+}
+
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCdisplay --
+ *
+ *      Procedure called by libvlc when a new video frame is
+ *      to be displayed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The frame is queued to the Tcl thread and the thread owning
+ *      the media player is alerted. It is copied to the shared
+ *      memory export, if any, even when dropped or skipped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCdisplay(void *clientData, void *picture)
+{
+  libVLCData *p = (libVLCData *) clientData;
+  libVLCFrame *f = (libVLCFrame *) picture;
+  Tcl_Time now;
+
+  if (f->index < 0) {
+    /* all frame buffers still in use, drop frame */
+    TKVLC_INCR(p->ndropped);
+#ifdef TKVLC_HAVE_SHM
+    libVLCShmExport(p, f);
+#endif
+    return;
+  }
+  if (p->maxfps > 0) {
+    Tcl_WideInt period = 1000000 / p->maxfps, nowus;
+
+    Tcl_GetTime(&now);
+    nowus = (Tcl_WideInt) now.sec * 1000000 + now.usec;
+    if (nowus < p->next_frame - period / 2) {
+      /* too early for the photo refresh rate, skip before any work */
+      p->spare = f->index;
+      TKVLC_INCR(p->nskipped);
+#ifdef TKVLC_HAVE_SHM
+      libVLCShmExport(p, f);
+#endif
+      return;
+    }
+    p->next_frame += period;
+    if (p->next_frame < nowus) {
+      p->next_frame = nowus;
+    }
+  }
+  if (FMT_PLANAR(p->format)) {
+    Tcl_GetTime(&now);
+    libVLCParallel(libVLCConvertBand, f);
+    libVLCAverage(&p->convert_us, &now);
+  } else if (p->format == FMT_RGBA) {
+    libVLCForceOpaque(f->pixels, p->width * p->height);
+  }
+  libVLCAverage(&p->render_us, &p->lock_time);
+#ifdef TKVLC_HAVE_SHM
+  if (TKVLC_LOAD(p->shm) != NULL) {
+    libVLCShmPublish(p, f);
+  }
+#endif
+  if (p->delta && !libVLCDiffFrame(p, f)) {
+    /* same picture as before, keep buffer for next frame */
+    p->spare = f->index;
+    TKVLC_INCR(p->nunchanged);
+    return;
+  }
+  if (p->mailbox) {
+    libVLCPostLatest(p, f);
+  } else {
+    /* cannot fail, ring holds all frame buffers */
+    libVLCRingPush(&p->ready, f->index);
+  }
+  TKVLC_INCR(p->nframes);
+  if (p->maxfps > 0) {
+    /* the frame timer picks the frame up unless it went idle */
+    TKVLC_FENCE();
+    if (TKVLC_LOAD(p->ticking)) {
+      return;
+    }
+  }
+  libVLCQueueFrameEvent(p);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCsetup --
+ *
+ *      Procedure called by libvlc when the video format of the
+ *      source is known. The frame size is the requested size or
+ *      the native size of the source, so that libvlc does not
+ *      need to rescale.
+ *
+ * Results:
+ *      Number of picture buffers for libvlc's picture pool.
+ *
+ * Side effects:
+ *      Frame buffers are (re)allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned libVLCsetup(void **opaque, char *chroma, unsigned *width,
+                            unsigned *height, unsigned *pitches,
+                            unsigned *lines)
+{
+  libVLCData *p = (libVLCData *) *opaque;
+
+  if (p->req_width > 0 && p->req_height > 0) {
+    *width = p->req_width;
+    *height = p->req_height;
+  }
+  if (*width > TKVLC_MAX_SIZE || *height > TKVLC_MAX_SIZE) {
+    return 0;
+  }
+  if (FMT_PLANAR(p->format)) {
+    /* libvlc wants planes padded to its macroblock alignment */
+    p->pitches[0] = (*width + 31) & ~31;
+    p->lines[0] = (*height + 15) & ~15;
+    if (p->format == FMT_I420) {
+      memcpy(chroma, "I420", 4);
+      p->pitches[1] = p->pitches[2] = p->pitches[0] / 2;
+      p->lines[1] = p->lines[2] = p->lines[0] / 2;
+    } else {
+      memcpy(chroma, "NV12", 4);
+      p->pitches[1] = p->pitches[0];
+      p->lines[1] = p->lines[0] / 2;
+      p->pitches[2] = p->lines[2] = 0;
+    }
+    memcpy(pitches, p->pitches, sizeof(p->pitches));
+    memcpy(lines, p->lines, sizeof(p->lines));
+  } else {
+    memcpy(chroma, (p->format == FMT_RGBA) ? "RGBA" : "RV24", 4);
+    pitches[0] = *width * p->pixel_size;
+    lines[0] = *height;
+  }
+  Tcl_MutexLock(&p->frame_lock);
+  libVLCFreeFrames(p);
+  p->width = *width;
+  p->height = *height;
+  libVLCAllocFrames(p);
+  Tcl_MutexUnlock(&p->frame_lock);
+  /*
+   * A single picture keeps lock and display strictly sequential
+   * on the video output thread, and rules out direct rendering
+   * of the decoder into our frame buffers.
+   */
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCLevelScalar --
+ *
+ *      Scalar part of libVLCLevel, folding samples i to n - 1 of a
+ *      block into sumsq and peak. Sample i must start a frame.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      sumsq and peak are updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCLevelScalar(const float *s, unsigned i, unsigned n,
+                              int nch, float *sumsq, float *peak)
+{
+  int c = 0;
+
+  for (; i < n; i++) {
+    float x = s[i];
+
+    sumsq[c] += x * x;
+    if (fabsf(x) > peak[c]) {
+      peak[c] = fabsf(x);
+    }
+    if (++c == nch) {
+      c = 0;
+    }
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCLevel --
+ *
+ *      Sum of squares and peak magnitude per channel of a block of
+ *      interleaved float samples. The vector loop covers lcm(nch, 4)
+ *      samples per step with k vectors, so that lane j of vector v
+ *      always holds channel (4 * v + j) % nch and is folded into its
+ *      channel once at the end.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      sumsq and peak receive nch values each.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCLevel(const float *s, unsigned count, int nch,
+                        float *sumsq, float *peak)
+{
+  unsigned i = 0, n = count * nch;
+  int c;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+  int k = (nch % 4 == 0) ? nch / 4 : (nch % 2 == 0) ? nch / 2 : nch;
+  float lane[4];
+  int v, j;
+#endif
+
+  for (c = 0; c < nch; c++) {
+    sumsq[c] = peak[c] = 0.0f;
+  }
+#if defined(__SSE2__)
+  {
+    const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 acc[TKVLC_MAX_CHANNELS], top[TKVLC_MAX_CHANNELS];
+
+    for (v = 0; v < k; v++) {
+      acc[v] = top[v] = _mm_setzero_ps();
+    }
+    for (; i + 4 * k <= n; i += 4 * k) {
+      for (v = 0; v < k; v++) {
+        __m128 x = _mm_loadu_ps(s + i + 4 * v);
+
+        acc[v] = _mm_add_ps(acc[v], _mm_mul_ps(x, x));
+        top[v] = _mm_max_ps(top[v], _mm_and_ps(x, mask));
+      }
+    }
+    for (v = 0; v < k; v++) {
+      _mm_storeu_ps(lane, acc[v]);
+      for (j = 0; j < 4; j++) {
+        sumsq[(4 * v + j) % nch] += lane[j];
+      }
+      _mm_storeu_ps(lane, top[v]);
+      for (j = 0; j < 4; j++) {
+        if (lane[j] > peak[(4 * v + j) % nch]) {
+          peak[(4 * v + j) % nch] = lane[j];
+        }
+      }
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    float32x4_t acc[TKVLC_MAX_CHANNELS], top[TKVLC_MAX_CHANNELS];
+
+    for (v = 0; v < k; v++) {
+      acc[v] = top[v] = vdupq_n_f32(0.0f);
+    }
+    for (; i + 4 * k <= n; i += 4 * k) {
+      for (v = 0; v < k; v++) {
+        float32x4_t x = vld1q_f32(s + i + 4 * v);
+
+        acc[v] = vmlaq_f32(acc[v], x, x);
+        top[v] = vmaxq_f32(top[v], vabsq_f32(x));
+      }
+    }
+    for (v = 0; v < k; v++) {
+      vst1q_f32(lane, acc[v]);
+      for (j = 0; j < 4; j++) {
+        sumsq[(4 * v + j) % nch] += lane[j];
+      }
+      vst1q_f32(lane, top[v]);
+      for (j = 0; j < 4; j++) {
+        if (lane[j] > peak[(4 * v + j) % nch]) {
+          peak[(4 * v + j) % nch] = lane[j];
+        }
+      }
+    }
+  }
+#endif
+  /* the vector loop stops on a frame boundary */
+  libVLCLevelScalar(s, i, n, nch, sumsq, peak);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCDecibel --
+ *
+ *      Convert a linear sample magnitude to dBFS.
+ *
+ * Results:
+ *      Level in dBFS, TKVLC_MIN_DB or more.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static double libVLCDecibel(double x)
+{
+  return (x > 1e-5) ? 20.0 * log10(x) : TKVLC_MIN_DB;
+}
+
+static void libVLCPcmChannel(libVLCData *p, Tcl_Obj *chanObj);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCpcm --
+ *
+ *      Procedure called in Tcl thread to write the PCM samples
+ *      buffered by the audio thread to the PCM channel.
+ *
+ * Results:
+ *      Always true (event handled).
+ *
+ * Side effects:
+ *      Output to the channel. The channel is dropped when writing
+ *      to it fails.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCpcm(Tcl_Event *ev, int flags)
+{
+  libVLCEvent *e = (libVLCEvent *) ev;
+  libVLCData *p = e->p;
+  Tcl_Channel chan = NULL;
+  const char *error = NULL;
+  unsigned int head, tail, off, n;
+
+  if (p == NULL) {
+    /* media player torn down */
+    return 1;
+  }
+  p->pcm_ev = NULL;
+  /* samples after this point queue another event */
+  TKVLC_STORE(p->pcm_pending, 0);
+  if (p->pcm_chan != NULL) {
+    chan = Tcl_GetChannel(p->interp, Tcl_GetString(p->pcm_chan), NULL);
+    if (chan == NULL) {
+      error = "channel is closed";
+    }
+  }
+  head = TKVLC_LOAD(p->pcm_head);
+  tail = p->pcm_tail;
+  while (chan != NULL && tail != head) {
+    off = tail & (TKVLC_PCM_RING - 1);
+    n = head - tail;
+    if (n > TKVLC_PCM_RING - off) {
+      n = TKVLC_PCM_RING - off;
+    }
+    if (Tcl_Write(chan, (const char *) p->pcm + off, n) < 0) {
+      error = Tcl_ErrnoMsg(Tcl_GetErrno());
+      break;
+    }
+    tail += n;
+  }
+  if (error != NULL) {
+    Tcl_Interp *interp = p->interp;
+    Tcl_InterpState state;
+
+    Tcl_Preserve(interp);
+    state = Tcl_SaveInterpState(interp, TCL_OK);
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\": %s",
+        Tcl_GetString(p->pcm_chan), error));
+    Tcl_AddErrorInfo(interp, "\n    (tkvlc PCM channel)");
+    Tcl_BackgroundException(interp, TCL_ERROR);
+    Tcl_RestoreInterpState(interp, state);
+    Tcl_Release(interp);
+    libVLCPcmChannel(p, NULL);
+  }
+  /* whatever could not be written is gone */
+  TKVLC_STORE(p->pcm_tail, head);
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPcmPush --
+ *
+ *      Append a block of samples to the PCM ring in the audio thread
+ *      and wake up the Tcl thread to write it out. A block which does
+ *      not fit is dropped as a whole.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A Tcl event may be queued.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPcmPush(libVLCData *p, const void *samples,
+                          unsigned int bytes)
+{
+  unsigned int head = p->pcm_head, off, n;
+  libVLCEvent *e;
+
+  if (bytes > TKVLC_PCM_RING - (head - TKVLC_LOAD(p->pcm_tail))) {
+    TKVLC_INCR(p->npcmdropped);
+    return;
+  }
+  off = head & (TKVLC_PCM_RING - 1);
+  n = (bytes < TKVLC_PCM_RING - off) ? bytes : TKVLC_PCM_RING - off;
+  memcpy(p->pcm + off, samples, n);
+  memcpy(p->pcm, (const unsigned char *) samples + n, bytes - n);
+  TKVLC_STORE(p->pcm_head, head + bytes);
+  if (TKVLC_XCHG(p->pcm_pending, 1) != 0) {
+    /* consumer will pick these samples up */
+    return;
+  }
+  e = (libVLCEvent *) ckalloc(sizeof(*e));
+  e->header.proc = libVLCpcm;
+  e->header.nextPtr = NULL;
+  e->type = EV_LEVEL;
+  e->p = p;
+  /* remembered for teardown */
+  p->pcm_ev = e;
+  Tcl_ThreadQueueEvent(p->tid, &e->header, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert(p->tid);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCaplay --
+ *
+ *      Procedure called by libvlc in the audio thread with a block of
+ *      decoded samples when audio is captured. The levels of the
+ *      block are metered and the samples go to the PCM ring.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A level event may be posted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCaplay(void *data, const void *samples, unsigned count,
+                        int64_t pts)
+{
+  libVLCData *p = (libVLCData *) data;
+  float sumsq[TKVLC_MAX_CHANNELS], peak[TKVLC_MAX_CHANNELS];
+  unsigned int seq = p->level_seq;
+  int c, nch = TKVLC_LOAD(p->achannels);
+  double loudest = 0.0;
+
+  if (nch <= 0 || count == 0) {
+    return;
+  }
+  libVLCLevel((const float *) samples, count, nch, sumsq, peak);
+  /* readers retry while the sequence lock is odd or has moved */
+  TKVLC_STORE(p->level_seq, seq + 1);
+  TKVLC_FENCE();
+  for (c = 0; c < nch; c++) {
+    p->rms[c] = sqrtf(sumsq[c] / count);
+    p->peak[c] = peak[c];
+    if (p->rms[c] > loudest) {
+      loudest = p->rms[c];
+    }
+  }
+  TKVLC_STORE(p->level_seq, seq + 2);
+  TKVLC_INCR(p->nablocks);
+  if (p->ev_mask & (1 << EV_LEVEL)) {
+    libVLCPost(p, EV_LEVEL, 0, libVLCDecibel(loudest));
+  }
+  if (TKVLC_LOAD(p->pcm_on)) {
+    libVLCPcmPush(p, samples, count * nch * sizeof(float));
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCasetup --
+ *
+ *      Procedure called by libvlc when the audio format of the
+ *      source is known. Samples are requested as 32 bit floats at
+ *      the rate of the source, with TKVLC_MAX_CHANNELS at most.
+ *
+ * Results:
+ *      Zero for success.
+ *
+ * Side effects:
+ *      The levels are reset.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCasetup(void **opaque, char *format, unsigned *rate,
+                        unsigned *channels)
+{
+  libVLCData *p = (libVLCData *) *opaque;
+  unsigned int seq = p->level_seq;
+
+  memcpy(format, "FL32", 4);
+  if (*channels > TKVLC_MAX_CHANNELS) {
+    *channels = TKVLC_MAX_CHANNELS;
+  }
+  p->arate = *rate;
+  TKVLC_STORE(p->level_seq, seq + 1);
+  TKVLC_FENCE();
+  memset(p->rms, 0, sizeof(p->rms));
+  memset(p->peak, 0, sizeof(p->peak));
+  TKVLC_STORE(p->achannels, (int) *channels);
+  TKVLC_STORE(p->level_seq, seq + 2);
+  return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCacleanup --
+ *
+ *      Procedure called by libvlc when the audio output is closed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The levels report no channels.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCacleanup(void *opaque)
+{
+  libVLCData *p = (libVLCData *) opaque;
+  unsigned int seq = p->level_seq;
+
+  TKVLC_STORE(p->level_seq, seq + 1);
+  TKVLC_STORE(p->achannels, 0);
+  TKVLC_STORE(p->level_seq, seq + 2);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPcmChannel --
+ *
+ *      Set or clear (NULL) the channel receiving the captured PCM
+ *      samples. The ring is allocated when first needed and kept
+ *      until the handle is deleted, as the audio thread may use it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Memory may be allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCPcmChannel(libVLCData *p, Tcl_Obj *chanObj)
+{
+  TKVLC_STORE(p->pcm_on, 0);
+  if (p->pcm_chan != NULL) {
+    Tcl_DecrRefCount(p->pcm_chan);
+    p->pcm_chan = NULL;
+  }
+  if (chanObj == NULL) {
+    return;
+  }
+  if (p->pcm == NULL) {
+    p->pcm = (unsigned char *) ckalloc(TKVLC_PCM_RING);
+  }
+  p->pcm_chan = chanObj;
+  Tcl_IncrRefCount(p->pcm_chan);
+  TKVLC_STORE(p->pcm_on, 1);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCstatestr --
+ *
+ *      Return current state as string.
+ *
+ * Results:
+ *      String pointer.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *libVLCstatestr(libVLCData *p)
+{
+  const char *string;
+  libvlc_state_t state;
+
+  /* get the current state of the media player (playing, paused, ...) */
+  state = libvlc_media_player_get_state(p->media_player);
+  if (state == libvlc_NothingSpecial) {
+    string = "idle";
+  } else if (state == libvlc_Opening) {
+    string = "opening";
+  } else if (state == libvlc_Buffering) {
+    string = "buffering";
+  } else if (state == libvlc_Playing) {
+    string = "playing";
+  } else if (state == libvlc_Paused) {
+    string = "paused";
+  } else if (state == libvlc_Stopped) {
+    string = "stopped";
+  } else if (state == libvlc_Ended) {
+    string = "ended";
+  } else if (state == libvlc_Error) {
+    string = "error";
+  } else {
+    string = "unknown";
+  }
+  return string;
+}
+
+#endif
+
+#ifdef USE_TK_PHOTO
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCParsed --
+ *
+ *      libvlc event handler for the end of parsing a media.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Wakes up the thread opening the media.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCParsed(const struct libvlc_event_t *ev, void *clientData)
+{
+  libVLCOpen *o = (libVLCOpen *) clientData;
+
+  Tcl_MutexLock(&o->lock);
+  o->parsed = 1;
+  Tcl_ConditionNotify(&o->cond);
+  Tcl_MutexUnlock(&o->lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCOpenThread --
+ *
+ *      Thread procedure creating and parsing the media of an
+ *      asynchronous open.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A libVLCOpenEvent is queued to the thread of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCopened(Tcl_Event *ev, int flags);
+
+static Tcl_ThreadCreateType libVLCOpenThread(ClientData clientData)
+{
+  libVLCOpen *o = (libVLCOpen *) clientData;
+  libVLCOpenEvent *e;
+  libvlc_media_t *media;
+
+  if (o->is_location) {
+    media = libvlc_media_new_location(o->vlc_inst, o->name);
+  } else {
+    media = libvlc_media_new_path(o->vlc_inst, o->name);
+  }
+  o->media = media;
+  if (media == NULL) {
+    o->error = "libvlc_media_new_path failed.";
+  } else {
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
+    libvlc_event_manager_t *em = libvlc_media_event_manager(media);
+
+    libvlc_event_attach(em, libvlc_MediaParsedChanged, libVLCParsed, o);
+    if (libvlc_media_parse_with_options(media, o->is_location ?
+            libvlc_media_parse_network : libvlc_media_parse_local, -1) < 0) {
+      o->error = "libvlc_media_parse_with_options failed.";
+    } else {
+      Tcl_MutexLock(&o->lock);
+      while (!o->parsed && !o->cancelled &&
+             libvlc_media_get_parsed_status(media) == 0) {
+        /* the parsed status is polled, too, in case the event is lost */
+        Tcl_Time t = { 0, 50000 };
+
+        Tcl_ConditionWait(&o->cond, &o->lock, &t);
+      }
+      Tcl_MutexUnlock(&o->lock);
+      if (o->cancelled) {
+        libvlc_media_parse_stop(media);
+      } else if (libvlc_media_get_parsed_status(media) !=
+                 libvlc_media_parsed_status_done) {
+        o->error = "parsing media failed";
+      }
+    }
+    libvlc_event_detach(em, libvlc_MediaParsedChanged, libVLCParsed, o);
+#else
+    libvlc_media_parse(media);
+#endif
+    if (o->error == NULL) {
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(2, 1, 0, 0)
+      libvlc_media_track_t **tracks;
+      unsigned i, n = libvlc_media_tracks_get(media, &tracks);
+
+      for (i = 0; i < n; i++) {
+        switch (tracks[i]->i_type) {
+          case libvlc_track_audio:
+            o->ntracks[0]++;
+            break;
+          case libvlc_track_video:
+            if (o->ntracks[1]++ == 0) {
+              o->width = tracks[i]->video->i_width;
+              o->height = tracks[i]->video->i_height;
+            }
+            break;
+          case libvlc_track_text:
+            o->ntracks[2]++;
+            break;
+          default:
+            break;
+        }
+      }
+      if (n > 0) {
+        libvlc_media_tracks_release(tracks, n);
+      }
+#endif
+      o->duration = libvlc_media_get_duration(media);
+    }
+  }
+  e = (libVLCOpenEvent *) ckalloc(sizeof(*e));
+  e->header.proc = libVLCopened;
+  e->header.nextPtr = NULL;
+  e->o = o;
+  Tcl_ThreadQueueEvent(o->tid, &e->header, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert(o->tid);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCCancelOpen --
+ *
+ *      Cancel the asynchronous open in flight, if any. With orphan
+ *      true, the handle is about to be destroyed: every open whose
+ *      completion event is still pending, including ones cancelled
+ *      earlier, is detached from the handle and its completion
+ *      callback is not invoked.
+ *
+ * Results:
+ *      1 if an open was cancelled, 0 otherwise.
+ *
+ * Side effects:
+ *      The open thread is asked to stop parsing.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCCancelOpen(libVLCData *p, int orphan)
+{
+  libVLCOpen *o = p->opening;
+
+  if (orphan) {
+    libVLCOpen *q;
+
+    for (q = p->opens; q != NULL; q = q->next) {
+      q->p = NULL;
+    }
+    p->opens = NULL;
+  }
+  if (o == NULL) {
+    return 0;
+  }
+  p->opening = NULL;
+  Tcl_MutexLock(&o->lock);
+  o->cancelled = 1;
+  Tcl_ConditionNotify(&o->cond);
+  Tcl_MutexUnlock(&o->lock);
+  return 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCStartOpen --
+ *
+ *      Start an asynchronous open, cancelling one in flight.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      A thread is created to open the media.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCStartOpen(libVLCData *p, Tcl_Interp *interp, Tcl_Obj *cmd,
+                           const char *name, int is_location)
+{
+  libVLCOpen *o;
+  Tcl_ThreadId tid;
+
+  libVLCCancelOpen(p, 0);
+  o = (libVLCOpen *) ckalloc(sizeof(*o));
+  memset(o, 0, sizeof(*o));
+  o->p = p;
+  o->cmd = cmd;
+  Tcl_IncrRefCount(o->cmd);
+  o->name = ckalloc(strlen(name) + 1);
+  strcpy(o->name, name);
+  o->is_location = is_location;
+  o->vlc_inst = p->vlc_inst;
+  libVLCRetainInstance(o->vlc_inst);
+  o->tid = p->tid;
+  o->duration = -1;
+  if (Tcl_CreateThread(&tid, libVLCOpenThread, o, TCL_THREAD_STACK_DEFAULT,
+                       TCL_THREAD_NOFLAGS) != TCL_OK) {
+    Tcl_SetResult(interp, "can't create thread", TCL_STATIC);
+    libVLCReleaseInstance(o->vlc_inst);
+    Tcl_DecrRefCount(o->cmd);
+    ckfree(o->name);
+    ckfree(o);
+    return TCL_ERROR;
+  }
+  p->opening = o;
+  o->next = p->opens;
+  p->opens = o;
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCopened --
+ *
+ *      Tcl event handler for a finished asynchronous open. Unless
+ *      cancelled, playback of the media is started, then the
+ *      completion callback is invoked with the status "ok", "error",
+ *      or "cancelled" and a dictionary of media information or the
+ *      error message.
+ *
+ * Results:
+ *      1 to indicate the event was handled.
+ *
+ * Side effects:
+ *      Playback starts, the callback is invoked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCopened(Tcl_Event *ev, int flags)
+{
+  libVLCOpen *o = ((libVLCOpenEvent *) ev)->o;
+  libVLCData *p = o->p;
+  Tcl_Obj *status, *info;
+
+  if (p != NULL) {
+    libVLCOpen **qp;
+
+    for (qp = &p->opens; *qp != NULL; qp = &(*qp)->next) {
+      if (*qp == o) {
+        *qp = o->next;
+        break;
+      }
+    }
+    if (p->opening == o) {
+      p->opening = NULL;
+    }
+  }
+  if (o->cancelled) {
+    status = Tcl_NewStringObj("cancelled", -1);
+    info = Tcl_NewObj();
+  } else if (o->error != NULL) {
+    status = Tcl_NewStringObj("error", -1);
+    info = Tcl_NewStringObj(o->error, -1);
+  } else {
+    status = Tcl_NewStringObj("ok", -1);
+    info = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("duration", -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewDoubleObj((o->duration < 0) ?
+                             -1.0 : (double) o->duration / 1000.0));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("width", -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(o->width));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("height", -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(o->height));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("audio", -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(o->ntracks[0]));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("video", -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(o->ntracks[1]));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewStringObj("subtitles", -1));
+    Tcl_ListObjAppendElement(NULL, info, Tcl_NewIntObj(o->ntracks[2]));
+    if (p != NULL) {
+      libVLCUnblock(p, 1);
+      TKVLC_STORE(p->restarting, 0);
+      libVLCPlaylistFree(p);
+      libvlc_media_player_set_media(p->media_player, o->media);
+      libVLCRepeat(p);
+      libVLCUnblock(p, 0);
+      if (p->file_name != NULL) {
+        Tcl_DecrRefCount(p->file_name);
+      }
+      p->file_name = Tcl_NewStringObj(o->name, -1);
+      Tcl_IncrRefCount(p->file_name);
+      p->is_location = o->is_location;
+      libvlc_media_player_play(p->media_player);
+    }
+  }
+  Tcl_IncrRefCount(status);
+  Tcl_IncrRefCount(info);
+  if (p != NULL) {
+    Tcl_Interp *interp = p->interp;
+    Tcl_InterpState state;
+    Tcl_Obj **cmdObjs, *staticObjv[TKVLC_STATIC_OBJV], **evalObjv;
+    Tcl_Size nCmdObjs;
+    int ret;
+
+    Tcl_Preserve(interp);
+    state = Tcl_SaveInterpState(interp, TCL_OK);
+    Tcl_ListObjGetElements(NULL, o->cmd, &nCmdObjs, &cmdObjs);
+    evalObjv = staticObjv;
+    if (nCmdObjs + 2 > TKVLC_STATIC_OBJV) {
+      evalObjv = (Tcl_Obj **) ckalloc((nCmdObjs + 2) * sizeof(Tcl_Obj *));
+    }
+    memcpy(evalObjv, cmdObjs, nCmdObjs * sizeof(Tcl_Obj *));
+    evalObjv[nCmdObjs] = status;
+    evalObjv[nCmdObjs + 1] = info;
+    ret = Tcl_EvalObjv(interp, nCmdObjs + 2, evalObjv, TCL_EVAL_GLOBAL);
+    if (evalObjv != staticObjv) {
+      ckfree(evalObjv);
+    }
+    if (ret != TCL_OK) {
+      Tcl_AddErrorInfo(interp, "\n    (tkvlc open callback)");
+      Tcl_BackgroundException(interp, ret);
+    }
+    Tcl_RestoreInterpState(interp, state);
+    Tcl_Release(interp);
+  }
+  Tcl_DecrRefCount(status);
+  Tcl_DecrRefCount(info);
+  if (o->media != NULL) {
+    libvlc_media_release(o->media);
+  }
+  libVLCReleaseInstance(o->vlc_inst);
+  Tcl_DecrRefCount(o->cmd);
+  ckfree(o->name);
+  Tcl_MutexFinalize(&o->lock);
+  Tcl_ConditionFinalize(&o->cond);
+  ckfree(o);
+  return 1;
+}
+
+#endif
+
+
+static int libVLCCreatePlayer(libVLCData *p, Tcl_Interp *interp);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCInitData --
+ *
+ *      Initialize the state of a new handle. Its configuration from
+ *      the ::tkvlc::init options must be set already.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCInitData(libVLCData *p, Tcl_Interp *interp)
+{
+#ifdef USE_TK_PHOTO
+  int i;
+#endif
+
+  p->interp = interp;
+  p->vlc_inst = NULL;
+  p->vlc_args = NULL;
+  p->target = NULL;
+  p->media_player = NULL;
+  p->file_name = NULL;
+  p->is_location = 0;
+
+#ifdef USE_TK_PHOTO
+  p->opening = NULL;
+  p->opens = NULL;
+  p->mlist = NULL;
+  p->mlplayer = NULL;
+  p->playlist = NULL;
+  p->repeat = 0;
+  p->restarting = 0;
+  p->restart_pending = 0;
+  p->loop_a = p->loop_b = 0;
+  p->tk_checked = 0;
+  p->window_id = 0;
+  p->photo_name = NULL;
+  p->width = p->height = 0;
+  p->req_width = p->req_height = 0;
+  p->frame_lock = NULL;
+  p->tid = Tcl_GetCurrentThread();
+  p->ev_lock = NULL;
+  p->destroyed = 0;
+  p->pending.prev = p->pending.next = &p->pending;
+  p->ev_free = NULL;
+  p->slabs = NULL;
+  p->doorbell = NULL;
+  p->nCmdObjs = p->nSavedCmdObjs = 0;
+  p->cmdObjs = p->savedCmdObjs = NULL;
+  for (i = 0; i < 3; i++) {
+    p->coal[i].p = p;
+    p->coal[i].type = (i < 2) ? EV_TIME_CHANGED + i : EV_LEVEL;
+    p->coal[i].pending = 0;
+    p->coal[i].value = 0.0;
+    p->coal[i].stamp = 0;
+    p->coal[i].last.sec = p->coal[i].last.usec = 0;
+    p->coal[i].timer = NULL;
+  }
+  p->interval = 0;
+  p->values = 0;
+  p->batch = 0;
+  p->ev_mask = EV_ALL;
+  p->ev_attached = 0;
+  p->pixel_size = (p->format == FMT_RGB) ? 3 : 4;
+  p->frames = NULL;
+  p->held = -1;
+  p->spare = -1;
+  p->latest = -1;
+  p->tiles_x = p->tiles_y = 0;
+  p->ref = NULL;
+  p->ref_valid = p->synced = 0;
+  p->frame_pending = 0;
+  p->frame_ev = NULL;
+  p->frame_next = libVLCNewFrameEvent(p);
+  p->nframes = p->ndropped = p->nunchanged = 0;
+  p->render_us = p->convert_us = 0;
+  p->next_frame = 0;
+  p->nskipped = 0;
+  p->ticking = 0;
+  p->timer = NULL;
+  p->due = 0;
+  p->last_put.sec = p->last_put.usec = 0;
+  p->interval_us = p->jitter_us = 0;
+  p->standby = NULL;
+  p->hidden = p->prerolled = 0;
+  p->preload_start = p->switch_start = 0;
+  p->preroll_us = p->switch_us = 0;
+  p->unblock = 0;
+  p->free_cond = NULL;
+  p->nblocked = 0;
+  p->sink_cmd = p->sink_chan = p->sink_frame = NULL;
+  p->shm_lock = NULL;
+  p->shm = NULL;
+  p->achannels = 0;
+  p->arate = 0;
+  p->level_seq = 0;
+  p->nablocks = 0;
+  p->pcm_chan = NULL;
+  p->pcm_on = 0;
+  p->pcm = NULL;
+  p->pcm_head = p->pcm_tail = 0;
+  p->pcm_pending = 0;
+  p->pcm_ev = NULL;
+  p->npcmdropped = 0;
+#endif
+}
+
+#ifdef USE_TK_PHOTO
+
+static void libVLCObjCmdDeleted(ClientData clientData);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCDropStandby --
+ *
+ *      Discard the standby player of a handle, if any.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The standby player is released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void libVLCDropStandby(libVLCData *p)
+{
+  libVLCData *s = p->standby;
+
+  if (s != NULL) {
+    p->standby = NULL;
+    libVLCObjCmdDeleted(s);
+  }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCPreload --
+ *
+ *      Open a media on a hidden standby player, which renders to the
+ *      same photo image or frame sinks as the handle once switched to.
+ *      The standby player is muted and paused on its first frame, see
+ *      libVLCready.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      A media player is created and started, a previous standby
+ *      player is discarded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCPreload(libVLCData *p, Tcl_Interp *interp, Tcl_Obj *fileObj)
+{
+  libVLCData *s;
+  libvlc_media_t *media;
+  Tcl_DString ds;
+  Tcl_Time now;
+  char *filename;
+  int i;
+
+  if (p->photo_name == NULL && !p->headless) {
+    Tcl_SetResult(interp, "not rendering to a photo image", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  filename = Tcl_TranslateFileName(interp, Tcl_GetString(fileObj), &ds);
+  if (filename == NULL) {
+    return TCL_ERROR;
+  }
+  libVLCDropStandby(p);
+
+  s = (libVLCData *) ckalloc(sizeof(*s));
+  memset(s, 0, sizeof(*s));
+  s->shared = p->shared;
+  s->fit = p->fit;
+  s->format = p->format;
+  s->nbuffers = p->nbuffers;
+  s->delta = p->delta;
+  s->mailbox = p->mailbox;
+  s->maxfps = p->maxfps;
+  s->block = p->block;
+  s->audiolevel = p->audiolevel;
+  s->headless = p->headless;
+  libVLCInitData(s, interp);
+  s->req_width = p->req_width;
+  s->req_height = p->req_height;
+  /* no events until switched to */
+  s->ev_mask = 0;
+  s->hidden = 1;
+  if (p->vlc_args != NULL) {
+    s->vlc_args = p->vlc_args;
+    Tcl_IncrRefCount(s->vlc_args);
+  }
+  if (p->target != NULL) {
+    s->target = p->target;
+    Tcl_IncrRefCount(s->target);
+  }
+  for (i = EV_MEDIA_CHANGED; i <= EV_LEVEL; i++) {
+    s->ev_names[i] = Tcl_NewStringObj(EV_strs[i], -1);
+    Tcl_IncrRefCount(s->ev_names[i]);
+  }
+  if (libVLCCreatePlayer(s, interp) != TCL_OK) {
+    Tcl_DStringFree(&ds);
+    libVLCObjCmdDeleted(s);
+    return TCL_ERROR;
+  }
+  media = libvlc_media_new_path(s->vlc_inst, filename);
+  if (media == NULL) {
+    Tcl_DStringFree(&ds);
+    libVLCObjCmdDeleted(s);
+    Tcl_SetResult(interp, "libvlc_media_new_path failed.", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  libvlc_media_player_set_media(s->media_player, media);
+  libvlc_media_release(media);
+  s->file_name = Tcl_NewStringObj(filename, -1);
+  Tcl_IncrRefCount(s->file_name);
+  Tcl_DStringFree(&ds);
+  libvlc_audio_set_mute(s->media_player, 1);
+  Tcl_GetTime(&now);
+  s->preload_start = (Tcl_WideInt) now.sec * 1000000 + now.usec;
+  libvlc_media_player_play(s->media_player);
+  p->standby = s;
+  return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCSwitch --
+ *
+ *      Make the standby player the player of the handle. This runs in
+ *      the Tcl thread between two photo image updates, so the photo
+ *      image goes from the last frame of the old media straight to
+ *      the pre-rolled first frame of the new one.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The Tcl command refers to the standby player, the old player
+ *      is released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCSwitch(libVLCData *p, Tcl_Interp *interp)
+{
+  libVLCData *s = p->standby;
+  Tcl_CmdInfo info;
+  Tcl_Time now;
+  int i;
+#ifdef TKVLC_HAVE_SHM
+  libVLCShm *shm;
+#endif
+
+  if (s == NULL) {
+    Tcl_SetResult(interp, "no media preloaded", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  p->standby = NULL;
+  Tcl_GetTime(&now);
+  s->switch_start = (Tcl_WideInt) now.sec * 1000000 + now.usec;
+
+  /* the Tcl command refers to the new player from now on */
+  Tcl_GetCommandInfoFromToken(p->cmd, &info);
+  info.objClientData = s;
+  info.deleteData = s;
+  Tcl_SetCommandInfoFromToken(p->cmd, &info);
+  s->cmd = p->cmd;
+
+  /* take over the event callback, it may be running right now */
+  if (p->savedCmdObjs != NULL) {
+    s->nCmdObjs = p->nSavedCmdObjs;
+    s->cmdObjs = (Tcl_Obj **) ckalloc(s->nCmdObjs * sizeof(Tcl_Obj *));
+    for (i = 0; i < s->nCmdObjs; i++) {
+      s->cmdObjs[i] = p->savedCmdObjs[i];
+      Tcl_IncrRefCount(s->cmdObjs[i]);
+    }
+    s->nSavedCmdObjs = s->nCmdObjs;
+    s->savedCmdObjs = s->cmdObjs;
+  }
+  s->interval = p->interval;
+  s->values = p->values;
+  s->batch = p->batch;
+  s->ev_mask = p->ev_mask;
+  s->repeat = p->repeat;
+  TKVLC_STORE(s->loop_a, p->loop_a);
+  TKVLC_STORE(s->loop_b, p->loop_b);
+  libVLCRepeat(s);
+  libvlc_audio_set_volume(s->media_player,
+                          libvlc_audio_get_volume(p->media_player));
+  libvlc_audio_set_mute(s->media_player,
+                        libvlc_audio_get_mute(p->media_player) > 0);
+  s->hidden = 0;
+  libVLCSubscribe(s);
+  if (s->prerolled) {
+    libVLCUpload(s, 0);
+    libvlc_media_player_set_pause(s->media_player, 0);
+  }
+  /* sinks, export and PCM channel continue after the pre-rolled frame */
+  s->sink_cmd = p->sink_cmd;
+  s->sink_chan = p->sink_chan;
+  p->sink_cmd = p->sink_chan = NULL;
+  if (p->pcm_chan != NULL) {
+    libVLCPcmChannel(s, p->pcm_chan);
+    libVLCPcmChannel(p, NULL);
+  }
+#ifdef TKVLC_HAVE_SHM
+  Tcl_MutexLock(&p->shm_lock);
+  shm = p->shm;
+  p->shm = NULL;
+  Tcl_MutexUnlock(&p->shm_lock);
+  Tcl_MutexLock(&s->shm_lock);
+  s->shm = shm;
+  Tcl_MutexUnlock(&s->shm_lock);
+#endif
+
+  /* old player goes away like a deleted command */
+  libVLCObjCmdDeleted(p);
+  return TCL_OK;
+}
+
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCObjCmd --
+ *
+ *      Tcl command to deal with the libvlc media player.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      Many depending on command arguments.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int libVLCObjCmd(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv)
+{
+  libVLCData *pVLC = (libVLCData *) cd;
+  int choice;
+  int rc = TCL_OK;
+
+  static const char *VLC_strs[] = {
+    "open", "openurl", "play", "pause", "stop", "isplaying",
+    "mute", "volume", "duration", "time", "position",
+    "rate", "isseekable", "state", "version", "destroy",
+#ifdef USE_TK_PHOTO
+    "event", "repeat", "info", "size", "cancel", "preload", "switch",
+    "loop", "playlist", "snapshot", "sink", "export", "audiolevel",
+#endif
+    NULL
+  };
+  enum VLC_enum {
+    TKVLC_OPEN, TKVLC_OPENURL, TKVLC_PLAY, TKVLC_PAUSE, TKVLC_STOP, TKVLC_ISPLAYING,
+    TKVLC_MUTE, TKVLC_VOLUME, TKVLC_DURATION, TKVLC_TIME, TKVLC_POSITION,
+    TKVLC_RATE, TKVLC_ISSEEKABLE, TKVLC_STATE, TKVLC_VERSION, TKVLC_DESTROY,
+#ifdef USE_TK_PHOTO
+    TKVLC_EVENT, TKVLC_REPEAT, TKVLC_INFO, TKVLC_SIZE, TKVLC_CANCEL,
+    TKVLC_PRELOAD, TKVLC_SWITCH, TKVLC_LOOP, TKVLC_PLAYLIST,
+    TKVLC_SNAPSHOT, TKVLC_SINK, TKVLC_EXPORT, TKVLC_AUDIOLEVEL,
+#endif
+  };
+#ifdef USE_TK_PHOTO
+  static const char *OPEN_strs[] = {
+    "-async", NULL
+  };
+#define OPEN_ARGS "?-async cmd? "
+#else
+#define OPEN_ARGS ""
+#endif
+
+  if( objc < 2 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
+    return TCL_ERROR;
+  }
+
+  if( Tcl_GetIndexFromObj(interp, objv[1], VLC_strs, "option", 0, &choice) ){
+    return TCL_ERROR;
+  }
+
+  /* lazy handles create their media player when first needed */
+  if (pVLC->media_player == NULL && choice != TKVLC_VERSION &&
+#ifdef USE_TK_PHOTO
+      choice != TKVLC_EVENT && choice != TKVLC_REPEAT &&
+      choice != TKVLC_CANCEL && choice != TKVLC_SINK &&
+      choice != TKVLC_EXPORT && choice != TKVLC_AUDIOLEVEL &&
+#endif
+      choice != TKVLC_DESTROY &&
+      libVLCCreatePlayer(pVLC, interp) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  switch( (enum VLC_enum)choice ){
+
+    case TKVLC_OPEN: {
+        char *filename = NULL;
+        Tcl_DString ds;
+        int status = 0;
+        libvlc_media_t *media;
+
+#ifdef USE_TK_PHOTO
+        if (objc == 5) {
+            if (Tcl_GetIndexFromObj(interp, objv[2], OPEN_strs, "option", 0,
+                                    &status) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else
+#endif
+        if( objc != 3 ){
+            Tcl_WrongNumArgs(interp, 2, objv, OPEN_ARGS "filename");
+            return TCL_ERROR;
+        }
+
+        filename = Tcl_TranslateFileName(interp, Tcl_GetString(objv[objc - 1]),
+                                         &ds);
+        if (filename == NULL) {
+            return TCL_ERROR;
+        }
+#ifdef USE_TK_PHOTO
+        if (objc == 5) {
+            rc = libVLCStartOpen(pVLC, interp, objv[3], filename, 0);
+            Tcl_DStringFree(&ds);
+            break;
+        }
+        libVLCCancelOpen(pVLC, 0);
+        libVLCPlaylistFree(pVLC);
+#endif
+
+        media = libvlc_media_new_path(pVLC->vlc_inst, filename);
+        if(media == NULL) {  // Is it necessary?
+            Tcl_AppendResult(interp, "libvlc_media_new_path failed.", (char*)0);
+            return TCL_ERROR;
+        }
+
+#ifdef USE_TK_PHOTO
+        libVLCUnblock(pVLC, 1);
+        TKVLC_STORE(pVLC->restarting, 0);
+#endif
+        libvlc_media_player_set_media(pVLC->media_player, media);
+#ifdef USE_TK_PHOTO
+        libVLCRepeat(pVLC);
+        libVLCUnblock(pVLC, 0);
+#endif
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
+        status = libvlc_media_parse_with_options(media, libvlc_media_parse_local, -1);
+        if (status < 0) {
+            Tcl_DStringFree(&ds);
+            Tcl_AppendResult(interp, "libvlc_media_parse_with_options failed.", (char*)0);
+            return TCL_ERROR;
+        }
+#else
+        libvlc_media_parse(media);
+#endif
+
+        if (pVLC->file_name != NULL) {
+            Tcl_DecrRefCount(pVLC->file_name);
+        }
+        pVLC->file_name = Tcl_NewStringObj(filename, -1);
+        Tcl_IncrRefCount(pVLC->file_name);
+        Tcl_DStringFree(&ds);
+        pVLC->is_location = 0;
+        libvlc_media_player_play(pVLC->media_player); // Play media
+        libvlc_media_release(media);
+
+        break;
+    }
+
+    case TKVLC_OPENURL: {
+        char *filename = NULL;
+        int status = 0;
+        libvlc_media_t *media;
+
+#ifdef USE_TK_PHOTO
+        if (objc == 5) {
+            if (Tcl_GetIndexFromObj(interp, objv[2], OPEN_strs, "option", 0,
+                                    &status) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else
+#endif
+        if (objc != 3){
+            Tcl_WrongNumArgs(interp, 2, objv, OPEN_ARGS "url");
+            return TCL_ERROR;
+        }
+
+        filename = Tcl_GetString(objv[objc - 1]);
+        if (filename == NULL) {
+            return TCL_ERROR;
+        }
+#ifdef USE_TK_PHOTO
+        if (objc == 5) {
+            rc = libVLCStartOpen(pVLC, interp, objv[3], filename, 1);
+            break;
+        }
+        libVLCCancelOpen(pVLC, 0);
+        libVLCPlaylistFree(pVLC);
+#endif
+
+        media = libvlc_media_new_location(pVLC->vlc_inst, filename);
+        if(media == NULL) {  // Is it necessary?
+            Tcl_AppendResult(interp, "libvlc_media_new_path failed.", (char*)0);
+            return TCL_ERROR;
+        }
+
+#ifdef USE_TK_PHOTO
+        libVLCUnblock(pVLC, 1);
+        TKVLC_STORE(pVLC->restarting, 0);
+#endif
+        libvlc_media_player_set_media(pVLC->media_player, media);
+#ifdef USE_TK_PHOTO
+        libVLCRepeat(pVLC);
+        libVLCUnblock(pVLC, 0);
+#endif
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
+        status = libvlc_media_parse_with_options(media, libvlc_media_parse_local, -1);
+        if (status < 0) {
+            Tcl_AppendResult(interp, "libvlc_media_parse_with_options failed.", (char*)0);
+            return TCL_ERROR;
+        }
+#else
+        libvlc_media_parse(media);
+#endif
+
+        if (pVLC->file_name != NULL) {
+            Tcl_DecrRefCount(pVLC->file_name);
+        }
+        pVLC->file_name = Tcl_NewStringObj(filename, -1);
+        Tcl_IncrRefCount(pVLC->file_name);
+        pVLC->is_location = 1;
+        libvlc_media_player_play(pVLC->media_player); // Play media
+        libvlc_media_release(media);
+
+        break;
+    }
+
+    case TKVLC_PLAY: {
+        if( objc != 2 ){
+            Tcl_WrongNumArgs(interp, 2, objv, 0);
+            return TCL_ERROR;
+        }
+
+#ifdef USE_TK_PHOTO
+        if (pVLC->restart_pending && libVLCRestartVideo(pVLC, 1)) {
+            /* size changed while paused, resumes with the new size */
+            break;
+        }
+#endif
+        if(libvlc_media_player_is_playing(pVLC->media_player) == 0) {
+            libvlc_media_player_play(pVLC->media_player);
+        }
+
+        break;
+    }
+
+    case TKVLC_PAUSE: {
+        if( objc != 2 ){
+            Tcl_WrongNumArgs(interp, 2, objv, 0);
+            return TCL_ERROR;
+        }
+
+        if(libvlc_media_player_is_playing(pVLC->media_player) == 1) {
+            libvlc_media_player_pause(pVLC->media_player);
+        }
+
+        break;
+    }
+
+    case TKVLC_STOP: {
+        if( objc != 2 ){
+            Tcl_WrongNumArgs(interp, 2, objv, 0);
+            return TCL_ERROR;
+        }
+
+#ifdef USE_TK_PHOTO
+        libVLCUnblock(pVLC, 1);
+        /* report the stop even when a restart is still under way */
+        TKVLC_STORE(pVLC->restarting, 0);
+#endif
+        libvlc_media_player_stop(pVLC->media_player);
+#ifdef USE_TK_PHOTO
+        libVLCUnblock(pVLC, 0);
+#endif
+
+        break;
+    }
+
+    case TKVLC_ISPLAYING: {
+        Tcl_Obj *return_obj;
+
+        if( objc != 2 ){
+            Tcl_WrongNumArgs(interp, 2, objv, 0);
+            return TCL_ERROR;
+        }
+
+        if(libvlc_media_player_is_playing(pVLC->media_player) == 1) {
+            return_obj = Tcl_NewBooleanObj(1);
+        } else {
+            return_obj = Tcl_NewBooleanObj(0);
+        }
+
+        Tcl_SetObjResult(interp, return_obj);
+
+        break;
+    }
+
+    case TKVLC_MUTE: {
+      int mute;
+
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
+        return TCL_ERROR;
+      }
+#ifdef USE_TK_PHOTO
+      if (pVLC->audiolevel) {
+        /* captured audio bypasses the audio output and its mixer */
+        Tcl_SetResult(interp, "no mute while capturing audio", TCL_STATIC);
+        return TCL_ERROR;
+      }
+#endif
+      if (objc > 2) {
+        if (Tcl_GetBooleanFromObj(interp, objv[2], &mute) != TCL_OK) {
+           return TCL_ERROR;
+        }
+        libvlc_audio_set_mute(pVLC->media_player, mute);
+      } else {
+        mute = libvlc_audio_get_mute(pVLC->media_player);
+        if (mute < 0) {
+          mute = 0;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(mute));
+      }
+      break;
+    }
+
+    case TKVLC_VOLUME: {
+      int volume;
+
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
+        return TCL_ERROR;
+      }
+#ifdef USE_TK_PHOTO
+      if (pVLC->audiolevel) {
+        Tcl_SetResult(interp, "no volume while capturing audio", TCL_STATIC);
+        return TCL_ERROR;
+      }
+#endif
+      if (objc > 2) {
+        if (Tcl_GetIntFromObj(interp, objv[2], &volume) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        /* 0 if the volume was set, -1 if it was out of range */
+        if (libvlc_audio_set_volume(pVLC->media_player, volume) == 0) {
+          Tcl_SetObjResult(interp, Tcl_NewBooleanObj(1));
+        } else {
+          Tcl_SetObjResult(interp, Tcl_NewBooleanObj(0));
+        }
+      } else {
+        volume = libvlc_audio_get_volume (pVLC->media_player);
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(volume));
+      }
+      break;
+    }
+
+    case TKVLC_DURATION: {
+        Tcl_Obj *return_obj;
+        libvlc_time_t tm;
+        double result;
+
+        if( objc != 2 ){
+            Tcl_WrongNumArgs(interp, 2, objv, 0);
+            return TCL_ERROR;
+        }
+
+        tm = libvlc_media_player_get_length(pVLC->media_player);
+        if (tm != -1) {
+            Tcl_SetResult(interp, "no media", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        result = (double) tm / 1000.0;
+        return_obj = Tcl_NewDoubleObj(result);
+
+        Tcl_SetObjResult(interp, return_obj);
+
+        break;
+    }
+
+    case TKVLC_TIME: {
+      libvlc_time_t tm;
+      double t;
+
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
+        return TCL_ERROR;
+      }
+      if (objc > 2) {
+        if (Tcl_GetDoubleFromObj(interp, objv[2], &t) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        /* set the movie time in ms, user should give the movie time in sec */
+        tm = (libvlc_time_t) t * 1000;
+        /* not all formats and protocols support this */
+        libvlc_media_player_set_time(pVLC->media_player, tm);
+      } else {
+        tm = libvlc_media_player_get_time(pVLC->media_player);
+        t = (double) tm / 1000.0;
+        Tcl_SetObjResult(interp, Tcl_NewDoubleObj(t));
+      }
+      break;
+    }
+
+    case TKVLC_POSITION: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
+        return TCL_ERROR;
+      }
+      if (objc > 2) {
+        double pos;
+
+        if (Tcl_GetDoubleFromObj(interp, objv[2], &pos) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if (pos < 0.0 || pos > 1.0) {
+          Tcl_SetResult(interp, "position must be between 0 and 1",
+                        TCL_STATIC);
+          return TCL_ERROR;
+        }
+        /*
+         * Set movie position as percentage between 0.0 and 1.0
+         * This has no effect if playback is not enabled.
+         * This might not work depending on the underlying input
+         * format and protocol.
+         */
+        libvlc_media_player_set_position(pVLC->media_player, (float) pos);
+      } else {
+        float pos = libvlc_media_player_get_position(pVLC->media_player);
+
+        Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double) pos));
+      }
+      break;
+    }
+
+    case TKVLC_RATE: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
+        return TCL_ERROR;
+      }
+      if (objc > 2) {
+        double r;
+
+        if (Tcl_GetDoubleFromObj(interp, objv[2], &r) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        /* not all formats and protocols support this */
+        libvlc_media_player_set_rate(pVLC->media_player, (float) r);
+      } else {
+        float r = libvlc_media_player_get_rate(pVLC->media_player);
+
+        Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double) r));
+      }
+      break;
+    }
+
+    case TKVLC_ISSEEKABLE: {
+        Tcl_Obj *return_obj;
+        int result;
+
+        if( objc != 2 ){
+            Tcl_WrongNumArgs(interp, 2, objv, 0);
+            return TCL_ERROR;
+        }
+
+        // true if the media player can seek
+        result = libvlc_media_player_is_seekable(pVLC->media_player);
+        if(result > 0) {
+            return_obj = Tcl_NewBooleanObj(1);
+        } else {
+            return_obj = Tcl_NewBooleanObj(0);
+        }
+
+        Tcl_SetObjResult(interp, return_obj);
+
+        break;
+    }
+
+    case TKVLC_STATE: {
+        Tcl_Obj *return_obj = NULL;
+        libvlc_state_t state;
+
+        if( objc != 2 ){
+            Tcl_WrongNumArgs(interp, 2, objv, 0);
+            return TCL_ERROR;
+        }
+
+        // get the current state of the media player (playing, paused, ...)
+        state = libvlc_media_player_get_state(pVLC->media_player);
+#ifdef USE_TK_PHOTO
+        if (TKVLC_LOAD(pVLC->restarting) && state != libvlc_Ended &&
+            state != libvlc_Error) {
+            /* a restart for a new video format is not a state change */
+            state = libvlc_Playing;
+        }
+#endif
+
+        if(state==libvlc_NothingSpecial) {
+             return_obj = Tcl_NewStringObj("idle", -1);
+        } else if(state==libvlc_Opening) {
+             return_obj = Tcl_NewStringObj("opening", -1);
+        } else if(state==libvlc_Buffering) {
+             return_obj = Tcl_NewStringObj("buffering", -1);
+        } else if(state==libvlc_Playing) {
+             return_obj = Tcl_NewStringObj("playing", -1);
+        } else if(state==libvlc_Paused) {
+             return_obj = Tcl_NewStringObj("paused", -1);
+        } else if(state==libvlc_Stopped) {
+             return_obj = Tcl_NewStringObj("stopped", -1);
+        } else if(state==libvlc_Ended) {
+             return_obj = Tcl_NewStringObj("ended", -1);
+        } else if(state==libvlc_Error) {
+             return_obj = Tcl_NewStringObj("error", -1);
+        }
+
+        Tcl_SetObjResult(interp, return_obj);
+
+        break;
+    }
+
+    case TKVLC_VERSION: {
+      Tcl_Obj *return_obj;
+      const char *result;
+
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      result = libvlc_get_version();
+      return_obj = Tcl_NewStringObj(result, -1);
+
+      Tcl_SetObjResult(interp, return_obj);
+
+      break;
+    }
+
+    case TKVLC_DESTROY: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      Tcl_DeleteCommandFromToken(interp, pVLC->cmd);
+      break;
+    }
+
+#ifdef USE_TK_PHOTO
+    case TKVLC_EVENT: {
+      static const char *EVOPT_strs[] = {
+        "-batch", "-interval", "-types", "-values", NULL
+      };
+      enum EVOPT_enum {
+        TKVLC_EVOPT_BATCH, TKVLC_EVOPT_INTERVAL, TKVLC_EVOPT_TYPES,
+        TKVLC_EVOPT_VALUES
+      };
+      int i, opt, first = 2, last = objc, interval = pVLC->interval;
+      int values = pVLC->values, batch = pVLC->batch, mask = pVLC->ev_mask;
+      Tcl_Obj *cmd = NULL;
+
+      if (objc == 2) {
+        Tcl_SetObjResult(interp,
+        Tcl_NewListObj(pVLC->nSavedCmdObjs, pVLC->savedCmdObjs));
+        break;
+      }
+      /* an odd number of arguments has the command first or last */
+      if (objc % 2) {
+        if (Tcl_GetIndexFromObj(NULL, objv[2], EVOPT_strs, "option", 0,
+                                &opt) == TCL_OK) {
+          cmd = objv[--last];
+        } else {
+          cmd = objv[first++];
+        }
+      }
+      for (i = first; i < last; i += 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], EVOPT_strs, "option", 0,
+                                &opt) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        switch ((enum EVOPT_enum) opt) {
+          case TKVLC_EVOPT_BATCH:
+            if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &batch)
+                != TCL_OK) {
+              return TCL_ERROR;
+            }
+            break;
+          case TKVLC_EVOPT_INTERVAL:
+            if (Tcl_GetIntFromObj(interp, objv[i + 1], &interval) != TCL_OK) {
+              return TCL_ERROR;
+            }
+            if (interval < 0) {
+              Tcl_SetResult(interp, "interval must not be negative",
+                            TCL_STATIC);
+              return TCL_ERROR;
+            }
+            break;
+          case TKVLC_EVOPT_TYPES: {
+            Tcl_Obj **typeObjs;
+            Tcl_Size k, nTypeObjs;
+            int type;
+
+            if (Tcl_ListObjGetElements(interp, objv[i + 1], &nTypeObjs,
+                                       &typeObjs) != TCL_OK) {
+              return TCL_ERROR;
+            }
+            mask = 0;
+            for (k = 0; k < nTypeObjs; k++) {
+              if (Tcl_GetIndexFromObj(interp, typeObjs[k], EV_strs,
+                                      "event type", 0, &type) != TCL_OK) {
+                return TCL_ERROR;
+              }
+              mask |= 1 << type;
+            }
+            break;
+          }
+          case TKVLC_EVOPT_VALUES:
+            if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &values)
+                != TCL_OK) {
+              return TCL_ERROR;
+            }
+            break;
+        }
+      }
+      if (cmd != NULL) {
+        Tcl_Obj **cmdObjs;
+        Tcl_Size nCmdObjs;
+
+        if (Tcl_ListObjGetElements(interp, cmd, &nCmdObjs, &cmdObjs)
+            != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if (nCmdObjs <= 0) {
+          Tcl_SetResult(interp, "empty command", TCL_STATIC);
+          return TCL_ERROR;
+        }
+        if (pVLC->savedCmdObjs != NULL) {
+          for (i = 0; i < pVLC->nSavedCmdObjs; i++) {
+            Tcl_DecrRefCount(pVLC->savedCmdObjs[i]);
+          }
+          ckfree(pVLC->savedCmdObjs);
+        }
+        pVLC->nCmdObjs = nCmdObjs;
+        pVLC->cmdObjs = (Tcl_Obj **) ckalloc(nCmdObjs * sizeof(Tcl_Obj *));
+        for (i = 0; i < nCmdObjs; i++) {
+          pVLC->cmdObjs[i] = cmdObjs[i];
+          Tcl_IncrRefCount(pVLC->cmdObjs[i]);
+        }
+        pVLC->nSavedCmdObjs = pVLC->nCmdObjs;
+        pVLC->savedCmdObjs = pVLC->cmdObjs;
+      }
+      pVLC->interval = interval;
+      pVLC->values = values;
+      pVLC->batch = batch;
+      if (mask != pVLC->ev_mask) {
+        pVLC->ev_mask = mask;
+        libVLCSubscribe(pVLC);
+      }
+      break;
+    }
+
+    case TKVLC_REPEAT: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?flag?");
+        return TCL_ERROR;
+      }
+      if (objc > 2) {
+        int flag;
+
+        if (Tcl_GetBooleanFromObj(interp, objv[2], &flag) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        pVLC->repeat = flag;
+        libVLCRepeat(pVLC);
+      } else {
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(pVLC->repeat));
+      }
+      break;
+    }
+
+    case TKVLC_LOOP: {
+      double a, b;
+
+      if (objc != 2 && objc != 3 && objc != 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?A B|off?");
+        return TCL_ERROR;
+      }
+      if (objc == 2) {
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+
+        if (pVLC->loop_b > 0) {
+          Tcl_ListObjAppendElement(NULL, list,
+                                   Tcl_NewDoubleObj(pVLC->loop_a / 1000.0));
+          Tcl_ListObjAppendElement(NULL, list,
+                                   Tcl_NewDoubleObj(pVLC->loop_b / 1000.0));
+        }
+        Tcl_SetObjResult(interp, list);
+        break;
+      }
+      if (objc == 3) {
+        if (strcmp(Tcl_GetString(objv[2]), "off") != 0) {
+          Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+              "expected A B or off but got \"%s\"", Tcl_GetString(objv[2])));
+          return TCL_ERROR;
+        }
+        TKVLC_STORE(pVLC->loop_b, 0);
+        TKVLC_STORE(pVLC->loop_a, 0);
+        libVLCRepeat(pVLC);
+        libVLCSubscribe(pVLC);
+        break;
+      }
+      if (Tcl_GetDoubleFromObj(interp, objv[2], &a) != TCL_OK ||
+          Tcl_GetDoubleFromObj(interp, objv[3], &b) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      if (a < 0.0 || b <= a || b > INT_MAX / 1000) {
+        Tcl_SetResult(interp, "loop range must satisfy 0 <= A < B",
+                      TCL_STATIC);
+        return TCL_ERROR;
+      }
+      /* loop_b last, libvlc threads check it first */
+      TKVLC_STORE(pVLC->loop_b, 0);
+      TKVLC_STORE(pVLC->loop_a, (int) (a * 1000.0));
+      TKVLC_STORE(pVLC->loop_b, (int) (b * 1000.0));
+      libVLCRepeat(pVLC);
+      libVLCSubscribe(pVLC);
+      if (libvlc_media_player_is_playing(pVLC->media_player) == 1) {
+        libvlc_time_t tm = libvlc_media_player_get_time(pVLC->media_player);
+
+        if (tm < pVLC->loop_a || tm >= pVLC->loop_b) {
+          libvlc_media_player_set_time(pVLC->media_player, pVLC->loop_a);
+        }
+      }
+      break;
+    }
+
+    case TKVLC_INFO: {
+      Tcl_Obj *list = Tcl_NewListObj(0, NULL), *types;
+      int type;
+
+#define TLOAE(elem) Tcl_ListObjAppendElement(NULL, list, (elem))
+#define TLOAE_STR(s) TLOAE(Tcl_NewStringObj((s), -1))
+#define TLOAE_INT(i) TLOAE(Tcl_NewIntObj((i)))
+#define TLOAE_DBL(d) TLOAE(Tcl_NewDoubleObj((d)))
+#define TLOAE_BOOL(b) TLOAE(Tcl_NewBooleanObj((b)))
+
+      TLOAE_STR("media");
+      if (pVLC->file_name != NULL) {
+         TLOAE(pVLC->file_name);
+      } else {
+         TLOAE(Tcl_NewObj());
+      }
+      TLOAE_STR("mode");
+      TLOAE_STR((pVLC->photo_name != NULL) ? "photo" :
+                pVLC->headless ? "headless" : "window");
+      TLOAE_STR("shared");
+      TLOAE_BOOL(pVLC->shared);
+      TLOAE_STR("target");
+      if (pVLC->photo_name != NULL) {
+        TLOAE(pVLC->photo_name);
+      } else if (pVLC->headless) {
+        TLOAE(Tcl_NewObj());
+      } else {
+        char buffer[64];
+
+        sprintf(buffer, "0x%" TCL_LL_MODIFIER "x", pVLC->window_id);
+        TLOAE_STR(buffer);
+      }
+      TLOAE_STR("width");
+      TLOAE_INT(pVLC->width);
+      TLOAE_STR("height");
+      TLOAE_INT(pVLC->height);
+      TLOAE_STR("fit");
+      TLOAE_BOOL(pVLC->fit);
+      TLOAE_STR("state");
+      TLOAE_STR(libVLCstatestr(pVLC));
+      TLOAE_STR("mute");
+      TLOAE_BOOL(libvlc_audio_get_mute(pVLC->media_player) > 0);
+      TLOAE_STR("volume");
+      TLOAE_INT(libvlc_audio_get_volume (pVLC->media_player));
+      TLOAE_STR("duration");
+      TLOAE_DBL((double)
+      libvlc_media_player_get_length(pVLC->media_player) / 1000.0);
+      TLOAE_STR("time");
+      TLOAE_DBL((double)
+      libvlc_media_player_get_time(pVLC->media_player) / 1000.0);
+      TLOAE_STR("position");
+      TLOAE_DBL(libvlc_media_player_get_position(pVLC->media_player));
+      TLOAE_STR("rate");
+      TLOAE_DBL(libvlc_media_player_get_rate(pVLC->media_player));
+      TLOAE_STR("seekable");
+      TLOAE_BOOL(libvlc_media_player_is_seekable(pVLC->media_player) > 0);
+      TLOAE_STR("repeat");
+      TLOAE_BOOL(pVLC->repeat);
+      TLOAE_STR("format");
+      TLOAE_STR(FMT_strs[pVLC->format]);
+      TLOAE_STR("buffers");
+      TLOAE_INT(pVLC->nbuffers);
+      TLOAE_STR("frames");
+      TLOAE(Tcl_NewWideIntObj(TKVLC_LOAD(pVLC->nframes)));
+      TLOAE_STR("dropped");
+      TLOAE(Tcl_NewWideIntObj(TKVLC_LOAD(pVLC->ndropped)));
+      TLOAE_STR("delta");
+      TLOAE_BOOL(pVLC->delta);
+      TLOAE_STR("mailbox");
+      TLOAE_BOOL(pVLC->mailbox);
+      TLOAE_STR("events");
+      types = Tcl_NewObj();
+      for (type = EV_MEDIA_CHANGED; type <= EV_LEVEL; type++) {
+        if (pVLC->ev_mask & (1 << type)) {
+          Tcl_ListObjAppendElement(NULL, types,
+                                   Tcl_NewStringObj(EV_strs[type], -1));
+        }
+      }
+      TLOAE(types);
+      TLOAE_STR("unchanged");
+      TLOAE(Tcl_NewWideIntObj(TKVLC_LOAD(pVLC->nunchanged)));
+      TLOAE_STR("render");
+      TLOAE_INT(TKVLC_LOAD(pVLC->render_us));
+      TLOAE_STR("convert");
+      TLOAE_INT(TKVLC_LOAD(pVLC->convert_us));
+      TLOAE_STR("converter");
+      TLOAE_STR(FMT_PLANAR(pVLC->format) ? libVLCYuvRowName : "none");
+      TLOAE_STR("maxfps");
+      TLOAE_INT(pVLC->maxfps);
+      TLOAE_STR("skipped");
+      TLOAE(Tcl_NewWideIntObj(TKVLC_LOAD(pVLC->nskipped)));
+      TLOAE_STR("interval");
+      TLOAE(Tcl_NewLongObj(pVLC->interval_us));
+      TLOAE_STR("jitter");
+      TLOAE(Tcl_NewLongObj(pVLC->jitter_us));
+      TLOAE_STR("standby");
+      TLOAE_STR((pVLC->standby == NULL) ? "none" :
+                pVLC->standby->prerolled ? "ready" : "loading");
+      TLOAE_STR("preroll");
+      TLOAE(Tcl_NewLongObj((pVLC->standby != NULL) ?
+                           pVLC->standby->preroll_us : pVLC->preroll_us));
+      TLOAE_STR("switch");
+      TLOAE(Tcl_NewLongObj(pVLC->switch_us));
+      TLOAE_STR("backpressure");
+      TLOAE_STR(pVLC->block ? "block" : "drop");
+      TLOAE_STR("blocked");
+      TLOAE(Tcl_NewWideIntObj(TKVLC_LOAD(pVLC->nblocked)));
+
+#undef TLOAE
+#undef TLOAE_STR
+#undef TLOAE_INT
+#undef TLOAE_DBL
+#undef TLOAE_BOOL
+
+      Tcl_SetObjResult(interp, list);
+      break;
+    }
+
+    case TKVLC_SIZE: {
+      if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?WxH|native|fit?");
+        return TCL_ERROR;
+      }
+      if (objc > 2) {
+        const char *str = Tcl_GetString(objv[2]);
+        int width, height;
+        char c;
+
+        if (pVLC->photo_name == NULL && !pVLC->headless) {
+          Tcl_SetResult(interp, "not rendering to a photo image", TCL_STATIC);
+          return TCL_ERROR;
+        }
+        if (strcmp(str, "native") == 0) {
+          pVLC->fit = 0;
+          pVLC->req_width = pVLC->req_height = 0;
+        } else if (strcmp(str, "fit") == 0) {
+          if (pVLC->headless) {
+            Tcl_SetResult(interp, "not rendering to a photo image",
+                          TCL_STATIC);
+            return TCL_ERROR;
+          }
+          /* picked up with the next frame */
+          pVLC->fit = 1;
+          pVLC->req_width = pVLC->req_height = 0;
+          break;
+        } else if (sscanf(str, "%dx%d%c", &width, &height, &c) == 2 &&
+                   width > 0 && height > 0 &&
+                   width <= TKVLC_MAX_SIZE && height <= TKVLC_MAX_SIZE) {
+          pVLC->fit = 0;
+          pVLC->req_width = width;
+          pVLC->req_height = height;
+        } else {
+          Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+              "expected WxH, native, or fit but got \"%s\"", str));
+          return TCL_ERROR;
+        }
+        libVLCRestartVideo(pVLC, 0);
+      } else {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%dx%d",
+                         pVLC->width, pVLC->height));
+      }
+      break;
+    }
+
+    case TKVLC_CANCEL: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+      Tcl_SetObjResult(interp, Tcl_NewBooleanObj(libVLCCancelOpen(pVLC, 0)));
+      break;
+    }
+
+    case TKVLC_PRELOAD: {
+      if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "filename");
+        return TCL_ERROR;
+      }
+      rc = libVLCPreload(pVLC, interp, objv[2]);
+      break;
+    }
+
+    case TKVLC_SWITCH: {
+      if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+      /* pVLC is gone afterwards */
+      rc = libVLCSwitch(pVLC, interp);
+      break;
+    }
+
+    case TKVLC_PLAYLIST: {
+      static const char *PL_strs[] = {
+        "set", "add", "next", "prev", "index", NULL
+      };
+      enum PL_enum {
+        PL_SET, PL_ADD, PL_NEXT, PL_PREV, PL_INDEX
+      };
+      int sub, index, status;
+
+      if (objc == 2) {
+        if (pVLC->playlist != NULL) {
+          Tcl_SetObjResult(interp, pVLC->playlist);
+        }
+        break;
+      }
+      if (Tcl_GetIndexFromObj(interp, objv[2], PL_strs, "subcommand", 0,
+                              &sub) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      if (sub == PL_SET) {
+        libVLCCancelOpen(pVLC, 0);
+        /* the first item replaces the media of a running player */
+        libVLCUnblock(pVLC, 1);
+        TKVLC_STORE(pVLC->restarting, 0);
+        libVLCPlaylistFree(pVLC);
+        libVLCPlaylistNew(pVLC);
+        rc = libVLCPlaylistAdd(pVLC, interp, objc - 3, objv + 3);
+        if (rc == TCL_OK && objc > 3) {
+          libvlc_media_list_player_play(pVLC->mlplayer);
+        }
+        libVLCUnblock(pVLC, 0);
+        break;
+      }
+      if (pVLC->playlist == NULL) {
+        Tcl_SetResult(interp, "no playlist", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      switch ((enum PL_enum) sub) {
+        case PL_ADD:
+          if (objc < 4) {
+            Tcl_WrongNumArgs(interp, 3, objv, "name ?name ...?");
+            return TCL_ERROR;
+          }
+          rc = libVLCPlaylistAdd(pVLC, interp, objc - 3, objv + 3);
+          break;
+        case PL_NEXT:
+        case PL_PREV:
+          if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, 0);
+            return TCL_ERROR;
+          }
+          libVLCUnblock(pVLC, 1);
+          status = (sub == PL_NEXT) ?
+              libvlc_media_list_player_next(pVLC->mlplayer) :
+              libvlc_media_list_player_previous(pVLC->mlplayer);
+          libVLCUnblock(pVLC, 0);
+          if (status != 0) {
+            Tcl_SetResult(interp, "no such playlist item", TCL_STATIC);
+            return TCL_ERROR;
+          }
+          break;
+        case PL_INDEX:
+          if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 3, objv, "?index?");
+            return TCL_ERROR;
+          }
+          if (objc == 3) {
+            Tcl_SetObjResult(interp,
+                             Tcl_NewIntObj(libVLCPlaylistIndex(pVLC)));
+            break;
+          }
+          if (Tcl_GetIntFromObj(interp, objv[3], &index) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          libVLCUnblock(pVLC, 1);
+          status = libvlc_media_list_player_play_item_at_index(pVLC->mlplayer,
+                                                               index);
+          libVLCUnblock(pVLC, 0);
+          if (status != 0) {
+            Tcl_SetResult(interp, "no such playlist item", TCL_STATIC);
+            return TCL_ERROR;
+          }
+          break;
+        default:
+          break;
+      }
+      break;
+    }
+
+    case TKVLC_SNAPSHOT: {
+      static const char *SNAPOPT_strs[] = {
+        "-format", NULL
+      };
+      static const char *SNAP_strs[] = {
+        "rgb", "rgba", "ppm", NULL
+      };
+      int format = (pVLC->pixel_size == 3) ? 0 : 1, option;
+
+      if (objc != 2 && objc != 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-format rgb|rgba|ppm?");
+        return TCL_ERROR;
+      }
+      if (objc == 4) {
+        if (Tcl_GetIndexFromObj(interp, objv[2], SNAPOPT_strs, "option", 0,
+                                &option) != TCL_OK ||
+            Tcl_GetIndexFromObj(interp, objv[3], SNAP_strs, "format", 0,
+                                &format) != TCL_OK) {
+          return TCL_ERROR;
+        }
+      }
+      if (pVLC->photo_name == NULL && !pVLC->headless) {
+        Tcl_SetResult(interp, "not rendering to a photo image", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      rc = libVLCSnapshot(pVLC, interp, format);
+      break;
+    }
+
+    case TKVLC_SINK: {
+      static const char *SINK_strs[] = {
+        "-channel", "-command", NULL
+      };
+      enum SINK_enum {
+        SINK_CHANNEL, SINK_COMMAND
+      };
+      Tcl_Obj **slot;
+      Tcl_Size len;
+      int i, option, mode;
+
+      if (objc % 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-channel chan? ?-command cmd?");
+        return TCL_ERROR;
+      }
+      if (pVLC->target == NULL && !pVLC->headless) {
+        Tcl_SetResult(interp, "not rendering to a photo image", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      if (objc == 2) {
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+
+        Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-channel", -1));
+        Tcl_ListObjAppendElement(NULL, list, (pVLC->sink_chan != NULL) ?
+                                 pVLC->sink_chan : Tcl_NewObj());
+        Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-command", -1));
+        Tcl_ListObjAppendElement(NULL, list, (pVLC->sink_cmd != NULL) ?
+                                 pVLC->sink_cmd : Tcl_NewObj());
+        Tcl_SetObjResult(interp, list);
+        break;
+      }
+      /* check all options before changing anything */
+      for (i = 2; i < objc; i += 2) {
+        Tcl_Channel chan;
+
+        if (Tcl_GetIndexFromObj(interp, objv[i], SINK_strs, "option", 0,
+                                &option) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if (option == SINK_COMMAND) {
+          if (Tcl_ListObjLength(interp, objv[i + 1], &len) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          continue;
+        }
+        if (Tcl_GetCharLength(objv[i + 1]) == 0) {
+          continue;
+        }
+        chan = Tcl_GetChannel(interp, Tcl_GetString(objv[i + 1]), &mode);
+        if (chan == NULL) {
+          return TCL_ERROR;
+        }
+        if (!(mode & TCL_WRITABLE)) {
+          Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+              "channel \"%s\" wasn't opened for writing",
+              Tcl_GetString(objv[i + 1])));
+          return TCL_ERROR;
+        }
+        /* frames are raw pixels */
+        if (Tcl_SetChannelOption(interp, chan, "-translation",
+                                 "binary") != TCL_OK) {
+          return TCL_ERROR;
+        }
+      }
+      for (i = 2; i < objc; i += 2) {
+        Tcl_GetIndexFromObj(NULL, objv[i], SINK_strs, "option", 0, &option);
+        slot = (option == SINK_CHANNEL) ? &pVLC->sink_chan : &pVLC->sink_cmd;
+        if (*slot != NULL) {
+          Tcl_DecrRefCount(*slot);
+          *slot = NULL;
+        }
+        if (Tcl_GetCharLength(objv[i + 1]) > 0) {
+          *slot = objv[i + 1];
+          Tcl_IncrRefCount(*slot);
+        }
+      }
+      break;
+    }
+
+    case TKVLC_EXPORT: {
+      static const char *EXPORT_strs[] = {
+        "shm", "off", NULL
+      };
+      static const char *EXPOPT_strs[] = {
+        "-slots", NULL
+      };
+      enum EXPORT_enum {
+        EXPORT_SHM, EXPORT_OFF
+      };
+      int kind, option, nslots = TKVLC_SHM_SLOTS;
+#ifdef TKVLC_HAVE_SHM
+      libVLCShm *shm;
+#endif
+
+      if (objc != 2 && objc != 3 && objc != 4 && objc != 6) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?shm name ?-slots N?|off?");
+        return TCL_ERROR;
+      }
+      if (objc > 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[2], EXPORT_strs, "type", 0,
+                                &kind) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if ((kind == EXPORT_OFF) != (objc == 3)) {
+          Tcl_WrongNumArgs(interp, 2, objv, "?shm name ?-slots N?|off?");
+          return TCL_ERROR;
+        }
+      }
+      if (objc == 6) {
+        if (Tcl_GetIndexFromObj(interp, objv[4], EXPOPT_strs, "option", 0,
+                                &option) != TCL_OK ||
+            Tcl_GetIntFromObj(interp, objv[5], &nslots) != TCL_OK) {
+          return TCL_ERROR;
+        }
+        if (nslots < TKVLC_MIN_SHM_SLOTS || nslots > TKVLC_MAX_SHM_SLOTS) {
+          Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+              "number of slots must be between %d and %d",
+              TKVLC_MIN_SHM_SLOTS, TKVLC_MAX_SHM_SLOTS));
+          return TCL_ERROR;
+        }
+      }
+      if (pVLC->target == NULL && !pVLC->headless) {
+        Tcl_SetResult(interp, "not rendering to a photo image", TCL_STATIC);
+        return TCL_ERROR;
+      }
+#ifdef TKVLC_HAVE_SHM
+      if (objc == 2) {
+        Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+
+        Tcl_MutexLock(&pVLC->shm_lock);
+        if ((shm = pVLC->shm) != NULL) {
+          TkvlcShmHeader *hdr = (TkvlcShmHeader *) shm->hdr;
+
+          Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("shm", -1));
+          Tcl_ListObjAppendElement(NULL, list, shm->name);
+          Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-slots", -1));
+          Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(shm->nslots));
+          Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-frames", -1));
+          Tcl_ListObjAppendElement(NULL, list,
+                                   Tcl_NewWideIntObj((Tcl_WideInt) hdr->seq));
+          if (shm->error != 0) {
+            Tcl_ListObjAppendElement(NULL, list,
+                                     Tcl_NewStringObj("-error", -1));
+            Tcl_ListObjAppendElement(NULL, list,
+                Tcl_NewStringObj(Tcl_ErrnoMsg(shm->error), -1));
+          }
+        }
+        Tcl_MutexUnlock(&pVLC->shm_lock);
+        Tcl_SetObjResult(interp, list);
+        break;
+      }
+      /* the old object goes first, it may have the same name */
+      Tcl_MutexLock(&pVLC->shm_lock);
+      shm = pVLC->shm;
+      pVLC->shm = NULL;
+      Tcl_MutexUnlock(&pVLC->shm_lock);
+      if (shm != NULL) {
+        libVLCShmClose(shm);
+      }
+      if (kind == EXPORT_SHM) {
+        if ((shm = libVLCShmOpen(interp, objv[3], nslots)) == NULL) {
+          return TCL_ERROR;
+        }
+        Tcl_MutexLock(&pVLC->shm_lock);
+        pVLC->shm = shm;
+        Tcl_MutexUnlock(&pVLC->shm_lock);
+      }
+#else
+      if (objc > 2 && kind == EXPORT_SHM) {
+        Tcl_SetResult(interp, "shared memory export is not supported",
+                      TCL_STATIC);
+        return TCL_ERROR;
+      }
+#endif
+      break;
+    }
+
+    case TKVLC_AUDIOLEVEL: {
+      static const char *LEVEL_strs[] = {
+        "-channel", NULL
+      };
+      float rms[TKVLC_MAX_CHANNELS], peak[TKVLC_MAX_CHANNELS];
+      Tcl_Obj *list, *rmsObj, *peakObj;
+      Tcl_Channel chan;
+      unsigned int seq;
+      int c, nch, option, mode;
+
+      if (objc > 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-channel ?chan??");
+        return TCL_ERROR;
+      }
+      if (objc > 2 && Tcl_GetIndexFromObj(interp, objv[2], LEVEL_strs,
+                                          "option", 0, &option) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      if (!pVLC->audiolevel) {
+        Tcl_SetResult(interp, "not capturing audio", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      if (objc == 3) {
+        if (pVLC->pcm_chan != NULL) {
+          Tcl_SetObjResult(interp, pVLC->pcm_chan);
+        }
+        break;
+      }
+      if (objc == 4) {
+        if (Tcl_GetCharLength(objv[3]) == 0) {
+          libVLCPcmChannel(pVLC, NULL);
+          break;
+        }
+        chan = Tcl_GetChannel(interp, Tcl_GetString(objv[3]), &mode);
+        if (chan == NULL) {
+          return TCL_ERROR;
+        }
+        if (!(mode & TCL_WRITABLE)) {
+          Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+              "channel \"%s\" wasn't opened for writing",
+              Tcl_GetString(objv[3])));
+          return TCL_ERROR;
+        }
+        /* samples are raw floats */
+        if (Tcl_SetChannelOption(interp, chan, "-translation",
+                                 "binary") != TCL_OK) {
+          return TCL_ERROR;
+        }
+        libVLCPcmChannel(pVLC, objv[3]);
+        break;
+      }
+      /* consistent levels of one block from the audio thread */
+      do {
+        while ((seq = TKVLC_LOAD(pVLC->level_seq)) & 1) {
+          /* being written */
+        }
+        nch = TKVLC_LOAD(pVLC->achannels);
+        memcpy(rms, pVLC->rms, sizeof(rms));
+        memcpy(peak, pVLC->peak, sizeof(peak));
+        TKVLC_FENCE();
+      } while (TKVLC_LOAD(pVLC->level_seq) != seq);
+      rmsObj = Tcl_NewListObj(0, NULL);
+      peakObj = Tcl_NewListObj(0, NULL);
+      for (c = 0; c < nch; c++) {
+        Tcl_ListObjAppendElement(NULL, rmsObj,
+                                 Tcl_NewDoubleObj(libVLCDecibel(rms[c])));
+        Tcl_ListObjAppendElement(NULL, peakObj,
+                                 Tcl_NewDoubleObj(libVLCDecibel(peak[c])));
+      }
+      list = Tcl_NewListObj(0, NULL);
+      Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("channels", -1));
+      Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(nch));
+      Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("rate", -1));
+      Tcl_ListObjAppendElement(NULL, list,
+                               Tcl_NewWideIntObj(nch ? pVLC->arate : 0));
+      Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("rms", -1));
+      Tcl_ListObjAppendElement(NULL, list, rmsObj);
+      Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("peak", -1));
+      Tcl_ListObjAppendElement(NULL, list, peakObj);
+      Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("blocks", -1));
+      Tcl_ListObjAppendElement(NULL, list,
+          Tcl_NewWideIntObj(TKVLC_LOAD(pVLC->nablocks)));
+      Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("dropped", -1));
+      Tcl_ListObjAppendElement(NULL, list,
+          Tcl_NewWideIntObj(TKVLC_LOAD(pVLC->npcmdropped)));
+      Tcl_SetObjResult(interp, list);
+      break;
+    }
+#endif
+
+  } /* End of the SWITCH statement */
+
+#undef OPEN_ARGS
+
+  return rc;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeData --
+ *
+ *  Callback to cleanup libVLCData struct.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Resources are released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#if (TCL_MAJOR_VERSION > 8)
+static void FreeData(void *clientData)
+#else
+static void FreeData(char *clientData)
+#endif
+
+{
+  libVLCData *p = (libVLCData *) clientData;
+  libvlc_media_player_t *m;
+#ifdef USE_TK_PHOTO
+  int i;
+#endif
+
+#ifdef USE_TK_PHOTO
+  /* invalidate event callback */
+  if (p->cmdObjs != NULL) {
+    for (i = 0; i < p->nCmdObjs; i++) {
+      Tcl_DecrRefCount(p->cmdObjs[i]);
+    }
+    ckfree(p->cmdObjs);
+  }
+  p->nCmdObjs = p->nSavedCmdObjs = 0;
+  p->cmdObjs = p->savedCmdObjs = NULL;
+  for (i = EV_MEDIA_CHANGED; i <= EV_LEVEL; i++) {
+    Tcl_DecrRefCount(p->ev_names[i]);
+  }
+  /* before stopping, so it does not advance */
+  libVLCPlaylistFree(p);
+  /* a stalled decoder must not hold up the stop */
+  libVLCUnblock(p, 1);
+#endif
+  m = p->media_player;
+  p->media_player = NULL;
+  /* stop media player */
+  if (m != NULL) {
+    libvlc_media_player_stop(m);
+  }
+#ifdef USE_TK_PHOTO
+  libVLCDropStandby(p);
+  /* an open in flight finishes without the handle */
+  libVLCCancelOpen(p, 1);
+  /* invalidate queued events */
+  Tcl_MutexLock(&p->ev_lock);
+  if (p->doorbell != NULL) {
+    p->doorbell->p = NULL;
+    p->doorbell = NULL;
+  }
+  Tcl_MutexUnlock(&p->ev_lock);
+  /* invalidate queued frames */
+  if (p->frame_ev != NULL) {
+    p->frame_ev->p = NULL;
+  }
+  if (p->frame_next != NULL) {
+    ckfree((char *) p->frame_next);
+    p->frame_next = NULL;
+  }
+  if (p->pcm_ev != NULL) {
+    p->pcm_ev->p = NULL;
+  }
+  Tcl_CancelIdleCall(libVLCrearm, p);
+  Tcl_CancelIdleCall(libVLCresize, p);
+  for (i = 0; i < 3; i++) {
+    if (p->coal[i].timer != NULL) {
+      Tcl_DeleteTimerHandler(p->coal[i].timer);
+      p->coal[i].timer = NULL;
+    }
+  }
+  if (p->timer != NULL) {
+    Tcl_DeleteTimerHandler(p->timer);
+    p->timer = NULL;
+  }
+#endif
+  /* release media player */
+  if (m != NULL) {
+    libvlc_media_player_stop(m);
+    libvlc_media_player_release(m);
+  }
+  libVLCReleaseInstance(p->vlc_inst);
+#ifdef USE_TK_PHOTO
+  if (p->photo_name != NULL) {
+    Tcl_DecrRefCount(p->photo_name);
+  }
+  if (p->sink_cmd != NULL) {
+    Tcl_DecrRefCount(p->sink_cmd);
+  }
+  if (p->sink_chan != NULL) {
+    Tcl_DecrRefCount(p->sink_chan);
+  }
+  if (p->sink_frame != NULL) {
+    Tcl_DecrRefCount(p->sink_frame);
+  }
+  if (p->pcm_chan != NULL) {
+    Tcl_DecrRefCount(p->pcm_chan);
+  }
+  if (p->pcm != NULL) {
+    ckfree((char *) p->pcm);
+  }
+#ifdef TKVLC_HAVE_SHM
+  /* the decoder is stopped by now */
+  if (p->shm != NULL) {
+    libVLCShmClose(p->shm);
+  }
+#endif
+#endif
+  if (p->file_name != NULL) {
+    Tcl_DecrRefCount(p->file_name);
+  }
+  if (p->vlc_args != NULL) {
+    Tcl_DecrRefCount(p->vlc_args);
+  }
+  if (p->target != NULL) {
+    Tcl_DecrRefCount(p->target);
+  }
+ 
+#ifdef USE_TK_PHOTO
+  /* cleanup frame buffers and event records */
+  libVLCFreeFrames(p);
+  while (p->slabs != NULL) {
+    libVLCSlab *slab = p->slabs;
+
+    p->slabs = slab->next;
+    ckfree(slab);
+  }
+  Tcl_ConditionFinalize(&p->free_cond);
+  Tcl_MutexFinalize(&p->shm_lock);
+  Tcl_MutexFinalize(&p->frame_lock);
+  Tcl_MutexFinalize(&p->ev_lock);
 #endif
+  ckfree(p);
+}
 
-        if (pVLC->file_name != NULL) {
-            Tcl_DecrRefCount(pVLC->file_name);
-        }
-        pVLC->file_name = Tcl_NewStringObj(filename, -1);
-        Tcl_IncrRefCount(pVLC->file_name);
-        Tcl_DStringFree(&ds);
-        pVLC->is_location = 0;
-        libvlc_media_player_play(pVLC->media_player); // Play media
-        libvlc_media_release(media);
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCObjCmdDeleted --
+ *
+ *  Destructor of libvlc media player object and command.
+ *
+ * Results:
+ *  None.
+ *
+ * Side effects:
+ *  Resources are released.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        break;
+static void libVLCObjCmdDeleted(ClientData clientData)
+{
+#ifdef USE_TK_PHOTO
+  /* stops delivery of pending events */
+  ((libVLCData *) clientData)->destroyed = 1;
+#endif
+  Tcl_EventuallyFree((char *) clientData, FreeData);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCArgs --
+ *
+ *      Build the libvlc argument vector from the default arguments
+ *      and the given extra arguments.
+ *
+ * Results:
+ *      A ckalloc'ed argument vector, its strings are owned by the
+ *      given objects.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char **libVLCArgs(int nargs, Tcl_Obj *const *args, int *argcPtr)
+{
+  const char **argv = (const char **) ckalloc((nargs + 1) * sizeof(char *));
+  int i, argc = 0;
+
+#if !defined(_WIN32)
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
+  argv[argc++] = "--no-xlib";
+#endif
+#endif
+  for (i = 0; i < nargs; i++) {
+    argv[argc++] = Tcl_GetString(args[i]);
+  }
+  *argcPtr = argc;
+  return argv;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCAttachTarget --
+ *
+ *      Direct the output of a new media player to the photo image
+ *      or window given to ::tkvlc::init, or to the frame sinks of
+ *      a headless handle.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      Video callbacks and events are set up for photo images.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCAttachTarget(libVLCData *p, Tcl_Interp *interp)
+{
+    Tcl_Obj *target = p->target;
+    int is_win = 0;
+
+#ifdef USE_TK_PHOTO
+    if (p->headless) {
+      /* frames for the sinks only, without Tk */
+      libvlc_video_set_callbacks(p->media_player, libVLClock, NULL,
+                 libVLCdisplay, p);
+      libvlc_video_set_format_callbacks(p->media_player, libVLCsetup, NULL);
+      return TCL_OK;
+    }
+#endif
+    if (target == NULL) {
+      return TCL_OK;
     }
 
-    case TKVLC_OPENURL: {
-        char *filename = NULL;
-        int status = 0;
-        libvlc_media_t *media;
+#ifdef USE_TK_PHOTO
 
-        if (objc != 3){
-            Tcl_WrongNumArgs(interp, 2, objv, "url");
-            return TCL_ERROR;
-        }
+    if (!is_win) {
+      Tk_PhotoHandle photo;
 
-        filename = Tcl_GetString(objv[2]);
-        if (filename == NULL) {
-            return TCL_ERROR;
-        }
+#ifdef linux
+      /*
+       * Raspberry Pi: the mmal_vout (or whatever other component)
+       * is unable to provide the proper callback behavior for
+       * rendering to photo images. Thus we don't support it for now.
+       */
+      if (Raspi_complain(interp) != TCL_OK) {
+        return TCL_ERROR;
+      }
+#endif
 
-        media = libvlc_media_new_location(pVLC->vlc_inst, filename);
-        if(media == NULL) {  // Is it necessary?
-            Tcl_AppendResult(interp, "libvlc_media_new_path failed.", (char*)0);
+      if (Tk_check(p, interp) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      if (Tk_MainWindow(interp) == NULL) {
+        Tcl_SetResult(interp, "application has been destroyed", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      photo = Tk_FindPhoto(interp, Tcl_GetString(target));
+      if (photo == NULL) {
+        Tcl_SetResult(interp, "no valid photo image given", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      if (p->fit) {
+        Tk_PhotoGetSize(photo, &p->req_width, &p->req_height);
+      }
+      p->photo_name = target;
+      Tcl_IncrRefCount(p->photo_name);
+      libvlc_video_set_callbacks(p->media_player, libVLClock, NULL,
+                 libVLCdisplay, p);
+      libvlc_video_set_format_callbacks(p->media_player, libVLCsetup, NULL);
+    }
+
+#else
+
+#ifdef _WIN32
+    Tcl_GetIntFromObj(interp, target, (int*)&hwnd);
+    libvlc_media_player_set_hwnd(p->media_player, (void *) hwnd);
+    is_win = 1;
+#else
+#ifdef __APPLE__
+    /* TBD */
+#else
+    Tcl_GetIntFromObj(interp, target, (int *) &drawable);
+    libvlc_media_player_set_xwindow(p->media_player, (uint32_t) drawable);
+    is_win = 1;
+#endif
+#endif
+
+#endif
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * libVLCCreatePlayer --
+ *
+ *      Create the libvlc instance and media player of a handle, on
+ *      ::tkvlc::init or, for lazy handles, on first use.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The libvlc instance and media player are created.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int libVLCCreatePlayer(libVLCData *p, Tcl_Interp *interp)
+{
+    const char **argv;
+    int argc;
+    Tcl_Size nargs = 0;
+    Tcl_Obj **args = NULL, *vlcargs = p->vlc_args;
+
+#ifdef USE_TK_PHOTO
+    if (p->block) {
+      /* every frame is decoded and displayed, however late */
+      vlcargs = (vlcargs != NULL) ? Tcl_DuplicateObj(vlcargs) : Tcl_NewObj();
+      Tcl_ListObjAppendElement(NULL, vlcargs,
+                               Tcl_NewStringObj("--no-drop-late-frames", -1));
+      Tcl_ListObjAppendElement(NULL, vlcargs,
+                               Tcl_NewStringObj("--no-skip-frames", -1));
+    }
+#endif
+    if (vlcargs != NULL) {
+      Tcl_IncrRefCount(vlcargs);
+      Tcl_ListObjGetElements(NULL, vlcargs, &nargs, &args);
+    }
+    argv = libVLCArgs(nargs, args, &argc);
+    p->vlc_inst = libVLCNewInstance(argc, argv, p->shared);
+    ckfree((char *) argv);
+    if (vlcargs != NULL) {
+      Tcl_DecrRefCount(vlcargs);
+    }
+    if (p->vlc_inst == NULL) {
+      Tcl_SetResult(interp, "vlc setup failed", TCL_STATIC);
+      return TCL_ERROR;
+    }
+
+#ifdef USE_TK_PHOTO
+    libvlc_log_set(p->vlc_inst, silence, NULL);
+#endif
+
+    p->media_player = libvlc_media_player_new(p->vlc_inst);
+    if (p->media_player == NULL) {
+      Tcl_SetResult(interp, "media player setup failed", TCL_STATIC);
+      libVLCReleaseInstance(p->vlc_inst);
+      p->vlc_inst = NULL;
+      return TCL_ERROR;
+    }
+
+    /*
+     * Tcl side use "winfo id window" to give a low-level
+     * platform-specific identifier for window.
+     *
+     * On Unix platforms, this is the X window identifier.
+     * Under Windows, this is the Windows HWND.
+     */
+    if (libVLCAttachTarget(p, interp) != TCL_OK) {
+      libvlc_media_player_release(p->media_player);
+      p->media_player = NULL;
+      libVLCReleaseInstance(p->vlc_inst);
+      p->vlc_inst = NULL;
+      return TCL_ERROR;
+    }
+#ifdef USE_TK_PHOTO
+    if (p->audiolevel) {
+      /* samples come to us instead of the audio device */
+      libvlc_audio_set_callbacks(p->media_player, libVLCaplay, NULL, NULL,
+                                 NULL, NULL, p);
+      libvlc_audio_set_format_callbacks(p->media_player, libVLCasetup,
+                                        libVLCacleanup);
+    }
+    /* events are used for repeat and loops even without a photo image */
+    libVLCAddSlab(p);
+    libVLCSubscribe(p);
+#endif
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TKVLC_INIT --
+ *
+ *  Initialize a libvlc media player given window identifier
+ *  or photo image name.
+ *
+ * Results:
+ *  A standard Tcl result.
+ *
+ * Side effects:
+ *  Memory and resources are allocated, a Tcl command is
+ *  created to refer to the media player.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int TKVLC_INIT(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv)
+{
+    const char *zArg;
+    libVLCData *p;
+    Tcl_Obj *target = NULL;
+    Tcl_Obj *vlcargs = NULL;
+    int shared = 1, lazy = 0;
+#ifdef USE_TK_PHOTO
+    int i, nbuffers = TKVLC_MIN_BUFFERS, format = FMT_RGBA, delta = 0;
+    int fit = 0, mailbox = 0, maxfps = 0, block = 0, headless = 0;
+    int audiolevel = 0;
+    int width = 0, height = 0;
+    Tcl_Size nargs;
+
+    static const char *INIT_strs[] = {
+      "-audiolevel", "-backpressure", "-buffers", "-delta", "-fit", "-format",
+      "-headless", "-lazy", "-mailbox", "-maxfps", "-shared", "-vlcargs", NULL
+    };
+    enum INIT_enum {
+      TKVLC_INIT_AUDIOLEVEL, TKVLC_INIT_BACKPRESSURE, TKVLC_INIT_BUFFERS,
+      TKVLC_INIT_DELTA, TKVLC_INIT_FIT, TKVLC_INIT_FORMAT,
+      TKVLC_INIT_HEADLESS, TKVLC_INIT_LAZY, TKVLC_INIT_MAILBOX,
+      TKVLC_INIT_MAXFPS, TKVLC_INIT_SHARED, TKVLC_INIT_VLCARGS
+    };
+    static const char *BP_strs[] = {
+      "drop", "block", NULL
+    };
+
+    if (objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "HANDLE ?photo? ?-option value ...?");
+      return TCL_ERROR;
+    }
+
+    /* the photo or window comes first, options start with a dash */
+    i = 2;
+    if (objc > 2 && Tcl_GetString(objv[2])[0] != '-') {
+      target = objv[i++];
+    }
+    for (; i < objc; i += 2) {
+      int choice;
+
+      if (Tcl_GetIndexFromObj(interp, objv[i], INIT_strs, "option", 0,
+                              &choice) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      if (i + 1 >= objc) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for %s",
+                                               Tcl_GetString(objv[i])));
+        return TCL_ERROR;
+      }
+      switch ((enum INIT_enum) choice) {
+        case TKVLC_INIT_AUDIOLEVEL:
+          if (Tcl_GetBooleanFromObj(interp, objv[i + 1],
+                                    &audiolevel) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_INIT_BACKPRESSURE:
+          if (Tcl_GetIndexFromObj(interp, objv[i + 1], BP_strs,
+                                  "backpressure", 0, &block) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_INIT_BUFFERS:
+          if (Tcl_GetIntFromObj(interp, objv[i + 1], &nbuffers) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          if (nbuffers < TKVLC_MIN_BUFFERS || nbuffers > TKVLC_MAX_BUFFERS) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "number of buffers must be between %d and %d",
+                TKVLC_MIN_BUFFERS, TKVLC_MAX_BUFFERS));
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_INIT_DELTA:
+          if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &delta) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_INIT_FIT:
+          if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &fit) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_INIT_FORMAT:
+          if (Tcl_GetIndexFromObj(interp, objv[i + 1], FMT_strs, "format", 0,
+                                  &format) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_INIT_HEADLESS: {
+          const char *str = Tcl_GetString(objv[i + 1]);
+          char c;
+
+          if (target != NULL) {
+            Tcl_SetResult(interp, "-headless cannot be used with a target",
+                          TCL_STATIC);
+            return TCL_ERROR;
+          }
+          if (strcmp(str, "native") == 0) {
+            width = height = 0;
+          } else if (sscanf(str, "%dx%d%c", &width, &height, &c) != 2 ||
+                     width <= 0 || height <= 0 ||
+                     width > TKVLC_MAX_SIZE || height > TKVLC_MAX_SIZE) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "expected WxH or native but got \"%s\"", str));
             return TCL_ERROR;
+          }
+          headless = 1;
+          break;
         }
-
-        libvlc_media_player_set_media(pVLC->media_player, media);
-#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
-        status = libvlc_media_parse_with_options(media, libvlc_media_parse_local, -1);
-        if (status < 0) {
-            Tcl_AppendResult(interp, "libvlc_media_parse_with_options failed.", (char*)0);
+        case TKVLC_INIT_LAZY:
+          if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &lazy) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_INIT_MAILBOX:
+          if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &mailbox) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_INIT_MAXFPS:
+          if (Tcl_GetIntFromObj(interp, objv[i + 1], &maxfps) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          if (maxfps < 0 || maxfps > TKVLC_MAX_FPS) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "maximum frame rate must be between 0 and %d",
+                TKVLC_MAX_FPS));
             return TCL_ERROR;
-        }
+          }
+          break;
+        case TKVLC_INIT_SHARED:
+          if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &shared) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_INIT_VLCARGS:
+          if (Tcl_ListObjLength(interp, objv[i + 1], &nargs) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          vlcargs = objv[i + 1];
+          break;
+      }
+    }
 #else
-        libvlc_media_parse(media);
+    if( objc != 2 && objc != 3 ) {
+      Tcl_WrongNumArgs(interp, 1, objv, "HANDLE ?HWND?");
+      return TCL_ERROR;
+    }
+    if (objc == 3) {
+      target = objv[2];
+    }
 #endif
 
-        if (pVLC->file_name != NULL) {
-            Tcl_DecrRefCount(pVLC->file_name);
-        }
-        pVLC->file_name = Tcl_NewStringObj(filename, -1);
-        Tcl_IncrRefCount(pVLC->file_name);
-        pVLC->is_location = 1;
-        libvlc_media_player_play(pVLC->media_player); // Play media
-        libvlc_media_release(media);
-
-        break;
+    p = (libVLCData *)Tcl_Alloc( sizeof(*p) );
+    if( p==0 ) {
+      Tcl_SetResult(interp, (char *)"malloc failed", TCL_STATIC);
+      return TCL_ERROR;
     }
 
-    case TKVLC_PLAY: {
-        if( objc != 2 ){
-            Tcl_WrongNumArgs(interp, 2, objv, 0);
-            return TCL_ERROR;
-        }
-
-        if(libvlc_media_player_is_playing(pVLC->media_player) == 0) {
-            libvlc_media_player_play(pVLC->media_player);
-        }
+    memset(p, 0, sizeof(*p));
+    p->shared = shared;
+#ifdef USE_TK_PHOTO
+    p->fit = fit;
+    p->format = format;
+    p->nbuffers = nbuffers;
+    p->delta = delta;
+    p->mailbox = mailbox;
+    p->maxfps = maxfps;
+    p->block = block;
+    p->headless = headless;
+    p->audiolevel = audiolevel;
+#endif
+    libVLCInitData(p, interp);
+#ifdef USE_TK_PHOTO
+    p->req_width = width;
+    p->req_height = height;
+#endif
 
-        break;
+    if (vlcargs != NULL) {
+      p->vlc_args = vlcargs;
+      Tcl_IncrRefCount(p->vlc_args);
     }
-
-    case TKVLC_PAUSE: {
-        if( objc != 2 ){
-            Tcl_WrongNumArgs(interp, 2, objv, 0);
-            return TCL_ERROR;
-        }
-
-        if(libvlc_media_player_is_playing(pVLC->media_player) == 1) {
-            libvlc_media_player_pause(pVLC->media_player);
-        }
-
-        break;
+    if (target != NULL) {
+      p->target = target;
+      Tcl_IncrRefCount(p->target);
+    }
+    if (!lazy && libVLCCreatePlayer(p, interp) != TCL_OK) {
+      if (p->vlc_args != NULL) {
+        Tcl_DecrRefCount(p->vlc_args);
+      }
+      if (p->target != NULL) {
+        Tcl_DecrRefCount(p->target);
+      }
+#ifdef USE_TK_PHOTO
+      ckfree((char *) p->frame_next);
+#endif
+      ckfree((char *) p);
+      return TCL_ERROR;
     }
 
-    case TKVLC_STOP: {
-        if( objc != 2 ){
-            Tcl_WrongNumArgs(interp, 2, objv, 0);
-            return TCL_ERROR;
-        }
-
-        libvlc_media_player_stop(pVLC->media_player);
-
-        break;
+#ifdef USE_TK_PHOTO
+    for (i = EV_MEDIA_CHANGED; i <= EV_LEVEL; i++) {
+      p->ev_names[i] = Tcl_NewStringObj(EV_strs[i], -1);
+      Tcl_IncrRefCount(p->ev_names[i]);
     }
+#endif
 
-    case TKVLC_ISPLAYING: {
-        Tcl_Obj *return_obj;
+    zArg = Tcl_GetStringFromObj(objv[1], 0);
+    p->cmd = Tcl_CreateObjCommand(interp, zArg, libVLCObjCmd, (char*)p, 
+                        (Tcl_CmdDeleteProc *) libVLCObjCmdDeleted);
 
-        if( objc != 2 ){
-            Tcl_WrongNumArgs(interp, 2, objv, 0);
-            return TCL_ERROR;
-        }
+    return TCL_OK;
+}
 
-        if(libvlc_media_player_is_playing(pVLC->media_player) == 1) {
-            return_obj = Tcl_NewBooleanObj(1);
-        } else {
-            return_obj = Tcl_NewBooleanObj(0);
-        }
 
-        Tcl_SetObjResult(interp, return_obj);
+/*
+ *----------------------------------------------------------------------
+ *
+ * TKVLC_PREWARM --
+ *
+ *  Create the shared libvlc instance for the given libvlc arguments
+ *  on a background thread, so that later handles start quickly.
+ *
+ * Results:
+ *  A standard Tcl result.
+ *
+ * Side effects:
+ *  A thread is started and a libvlc instance is created.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        break;
-    }
+static int TKVLC_PREWARM(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv)
+{
+    const char **argv;
+    int argc, choice;
+    Tcl_Size nargs = 0;
+    Tcl_Obj **args = NULL;
 
-    case TKVLC_MUTE: {
-      int mute;
+    static const char *PREWARM_strs[] = {
+      "-vlcargs", NULL
+    };
 
-      if (objc > 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
-        return TCL_ERROR;
-      }
-      if (objc > 2) {
-        if (Tcl_GetBooleanFromObj(interp, objv[2], &mute) != TCL_OK) {
-           return TCL_ERROR;
-        }
-        libvlc_audio_set_mute(pVLC->media_player, mute);
-      } else {
-        mute = libvlc_audio_get_mute(pVLC->media_player);
-        if (mute < 0) {
-          mute = 0;
-        }
-        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(mute));
-      }
-      break;
+    if (objc != 1 && objc != 3) {
+      Tcl_WrongNumArgs(interp, 1, objv, "?-vlcargs list?");
+      return TCL_ERROR;
     }
-
-    case TKVLC_VOLUME: {
-      int volume;
-
-      if (objc > 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
+    if (objc == 3) {
+      if (Tcl_GetIndexFromObj(interp, objv[1], PREWARM_strs, "option", 0,
+                              &choice) != TCL_OK) {
         return TCL_ERROR;
       }
-      if (objc > 2) {
-        if (Tcl_GetIntFromObj(interp, objv[2], &volume) != TCL_OK) {
-          return TCL_ERROR;
-        }
-        /* 0 if the volume was set, -1 if it was out of range */
-        if (libvlc_audio_set_volume(pVLC->media_player, volume) == 0) {
-          Tcl_SetObjResult(interp, Tcl_NewBooleanObj(1));
-        } else {
-          Tcl_SetObjResult(interp, Tcl_NewBooleanObj(0));
-        }
-      } else {
-        volume = libvlc_audio_get_volume (pVLC->media_player);
-        Tcl_SetObjResult(interp, Tcl_NewIntObj(volume));
+      if (Tcl_ListObjGetElements(interp, objv[2], &nargs, &args) != TCL_OK) {
+        return TCL_ERROR;
       }
-      break;
     }
+    argv = libVLCArgs(nargs, args, &argc);
+    libVLCStartPrewarm(Tcl_Merge(argc, argv));
+    ckfree((char *) argv);
 
-    case TKVLC_DURATION: {
-        Tcl_Obj *return_obj;
-        libvlc_time_t tm;
-        double result;
-
-        if( objc != 2 ){
-            Tcl_WrongNumArgs(interp, 2, objv, 0);
-            return TCL_ERROR;
-        }
+    return TCL_OK;
+}
 
-        tm = libvlc_media_player_get_length(pVLC->media_player);
-        if (tm != -1) {
-            Tcl_SetResult(interp, "no media", TCL_STATIC);
-            return TCL_ERROR;
-        }
-        result = (double) tm / 1000.0;
-        return_obj = Tcl_NewDoubleObj(result);
 
-        Tcl_SetObjResult(interp, return_obj);
+/*
+ *----------------------------------------------------------------------
+ *
+ * TKVLC_PROBE --
+ *
+ *  Parse media files on a pool of threads without creating media
+ *  players and return their duration and tracks, optionally using
+ *  a cache file keyed by file name, size, and modification time.
+ *
+ * Results:
+ *  A standard Tcl result.
+ *
+ * Side effects:
+ *  Threads are started, the cache file may be rewritten.
+ *
+ *----------------------------------------------------------------------
+ */
 
+static int TKVLC_PROBE(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv)
+{
+    libVLCProbe job;
+    Tcl_Obj *cacheFile = NULL, *cache = NULL, *result;
+    Tcl_Obj **norms, **infos;
+    Tcl_WideInt *stats;
+    const char **errors;
+    int *todo;
+    int i, k, n, argc, first, choice, nthreads = 0, dirty = 0, rc = TCL_OK;
+
+    static const char *PROBE_strs[] = {
+      "-cache", "-threads", NULL
+    };
+    enum PROBE_enum {
+      TKVLC_PROBE_CACHE, TKVLC_PROBE_THREADS
+    };
+
+    for (i = 1; i < objc; i += 2) {
+      const char *opt = Tcl_GetString(objv[i]);
+
+      if (opt[0] != '-') {
         break;
-    }
-
-    case TKVLC_TIME: {
-      libvlc_time_t tm;
-      double t;
-
-      if (objc > 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
-        return TCL_ERROR;
       }
-      if (objc > 2) {
-        if (Tcl_GetDoubleFromObj(interp, objv[2], &t) != TCL_OK) {
-          return TCL_ERROR;
-        }
-        /* set the movie time in ms, user should give the movie time in sec */
-        tm = (libvlc_time_t) t * 1000;
-        /* not all formats and protocols support this */
-        libvlc_media_player_set_time(pVLC->media_player, tm);
-      } else {
-        tm = libvlc_media_player_get_time(pVLC->media_player);
-        t = (double) tm / 1000.0;
-        Tcl_SetObjResult(interp, Tcl_NewDoubleObj(t));
+      if (strcmp(opt, "--") == 0) {
+        i++;
+        break;
       }
-      break;
-    }
-
-    case TKVLC_POSITION: {
-      if (objc > 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
+      if (Tcl_GetIndexFromObj(interp, objv[i], PROBE_strs, "option", 0,
+                              &choice) != TCL_OK) {
         return TCL_ERROR;
       }
-      if (objc > 2) {
-        double pos;
-
-        if (Tcl_GetDoubleFromObj(interp, objv[2], &pos) != TCL_OK) {
-          return TCL_ERROR;
-        }
-        if (pos < 0.0 || pos > 1.0) {
-          Tcl_SetResult(interp, "position must be between 0 and 1",
-                        TCL_STATIC);
-          return TCL_ERROR;
-        }
-        /*
-         * Set movie position as percentage between 0.0 and 1.0
-         * This has no effect if playback is not enabled.
-         * This might not work depending on the underlying input
-         * format and protocol.
-         */
-        libvlc_media_player_set_position(pVLC->media_player, (float) pos);
-      } else {
-        float pos = libvlc_media_player_get_position(pVLC->media_player);
-
-        Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double) pos));
+      if (i + 1 >= objc) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for %s",
+                                               opt));
+        return TCL_ERROR;
+      }
+      switch ((enum PROBE_enum) choice) {
+        case TKVLC_PROBE_CACHE:
+          cacheFile = objv[i + 1];
+          break;
+        case TKVLC_PROBE_THREADS:
+          if (Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          if (nthreads < 1 || nthreads > TKVLC_MAX_PROBE_THREADS) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "number of threads must be between 1 and %d",
+                TKVLC_MAX_PROBE_THREADS));
+            return TCL_ERROR;
+          }
+          break;
       }
-      break;
     }
-
-    case TKVLC_RATE: {
-      if (objc > 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "?value?");
-        return TCL_ERROR;
+    first = i;
+    n = objc - first;
+    if (n < 1) {
+      Tcl_WrongNumArgs(interp, 1, objv,
+                       "?-cache file? ?-threads N? file ?file ...?");
+      return TCL_ERROR;
+    }
+    if (nthreads == 0) {
+      /* parsing mostly waits for I/O, more threads than processors help */
+      nthreads = libVLCNumCpus();
+      if (nthreads < TKVLC_MIN_PROBE_THREADS) {
+        nthreads = TKVLC_MIN_PROBE_THREADS;
+      } else if (nthreads > TKVLC_MAX_PROBE_THREADS) {
+        nthreads = TKVLC_MAX_PROBE_THREADS;
       }
-      if (objc > 2) {
-        double r;
-
-        if (Tcl_GetDoubleFromObj(interp, objv[2], &r) != TCL_OK) {
-          return TCL_ERROR;
-        }
-        /* not all formats and protocols support this */
-        libvlc_media_player_set_rate(pVLC->media_player, (float) r);
-      } else {
-        float r = libvlc_media_player_get_rate(pVLC->media_player);
+    }
+    if (cacheFile != NULL) {
+      cache = libVLCProbeLoad(cacheFile);
+      Tcl_IncrRefCount(cache);
+    }
 
-        Tcl_SetObjResult(interp, Tcl_NewDoubleObj((double) r));
+    memset(&job, 0, sizeof(job));
+    job.items = (libVLCProbeItem *) ckalloc(n * sizeof(libVLCProbeItem));
+    memset(job.items, 0, n * sizeof(libVLCProbeItem));
+    norms = (Tcl_Obj **) ckalloc(n * sizeof(Tcl_Obj *));
+    infos = (Tcl_Obj **) ckalloc(n * sizeof(Tcl_Obj *));
+    stats = (Tcl_WideInt *) ckalloc(2 * n * sizeof(Tcl_WideInt));
+    errors = (const char **) ckalloc(n * sizeof(const char *));
+    todo = (int *) ckalloc(n * sizeof(int));
+
+    /* stat all files and look them up in the cache */
+    for (k = 0; k < n; k++) {
+      Tcl_StatBuf *sb = Tcl_AllocStatBuf();
+      Tcl_Obj *entry = NULL, **elems;
+      Tcl_Size nelems;
+      Tcl_WideInt size, mtime;
+
+      infos[k] = NULL;
+      errors[k] = NULL;
+      todo[k] = -1;
+      norms[k] = Tcl_FSGetNormalizedPath(NULL, objv[first + k]);
+      if (norms[k] == NULL) {
+        errors[k] = "invalid file name";
+      } else if (Tcl_FSStat(norms[k], sb) != 0) {
+        errors[k] = Tcl_ErrnoMsg(Tcl_GetErrno());
+        norms[k] = NULL;
       }
-      break;
+      if (errors[k] != NULL) {
+        ckfree((char *) sb);
+        continue;
+      }
+      Tcl_IncrRefCount(norms[k]);
+      size = (Tcl_WideInt) Tcl_GetSizeFromStat(sb);
+      mtime = (Tcl_WideInt) Tcl_GetModificationTimeFromStat(sb);
+      ckfree((char *) sb);
+      stats[2 * k] = size;
+      stats[2 * k + 1] = mtime;
+      if (cache != NULL &&
+          Tcl_DictObjGet(NULL, cache, norms[k], &entry) == TCL_OK &&
+          entry != NULL &&
+          Tcl_ListObjGetElements(NULL, entry, &nelems, &elems) == TCL_OK &&
+          nelems == 3 &&
+          Tcl_GetWideIntFromObj(NULL, elems[0], &size) == TCL_OK &&
+          Tcl_GetWideIntFromObj(NULL, elems[1], &mtime) == TCL_OK &&
+          size == stats[2 * k] && mtime == stats[2 * k + 1]) {
+        infos[k] = elems[2];
+        continue;
+      }
+      todo[k] = job.nitems;
+      job.items[job.nitems].job = &job;
+      job.items[job.nitems].path = Tcl_GetString(norms[k]);
+      job.items[job.nitems].duration = -1;
+      job.nitems++;
     }
 
-    case TKVLC_ISSEEKABLE: {
-        Tcl_Obj *return_obj;
-        int result;
+    if (job.nitems > 0) {
+      const char **argv;
+      Tcl_Obj *vlcarg = NULL;
 
-        if( objc != 2 ){
-            Tcl_WrongNumArgs(interp, 2, objv, 0);
-            return TCL_ERROR;
-        }
+      if (nthreads > job.nitems) {
+        nthreads = job.nitems;
+      }
+#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
+      /* libvlc parses on one preparser thread unless told otherwise */
+      vlcarg = Tcl_ObjPrintf("--preparse-threads=%d", nthreads);
+      Tcl_IncrRefCount(vlcarg);
+#endif
+      argv = libVLCArgs((vlcarg != NULL) ? 1 : 0, &vlcarg, &argc);
+      job.vlc_inst = libVLCNewInstance(argc, argv, 1);
+      ckfree((char *) argv);
+      if (vlcarg != NULL) {
+        Tcl_DecrRefCount(vlcarg);
+      }
+      if (job.vlc_inst == NULL) {
+        Tcl_SetResult(interp, "vlc setup failed", TCL_STATIC);
+        rc = TCL_ERROR;
+        goto done;
+      }
+      libVLCRunThreads(libVLCProbeThread, &job, nthreads);
+      libVLCReleaseInstance(job.vlc_inst);
+    }
 
-        // true if the media player can seek
-        result = libvlc_media_player_is_seekable(pVLC->media_player);
-        if(result > 0) {
-            return_obj = Tcl_NewBooleanObj(1);
-        } else {
-            return_obj = Tcl_NewBooleanObj(0);
+    result = Tcl_NewDictObj();
+    for (k = 0; k < n; k++) {
+      if (errors[k] != NULL) {
+        infos[k] = Tcl_NewStringObj("error", -1);
+        Tcl_ListObjAppendElement(NULL, infos[k],
+                                 Tcl_NewStringObj(errors[k], -1));
+      } else if (todo[k] >= 0) {
+        infos[k] = libVLCProbeInfo(&job.items[todo[k]]);
+        /* failures may be transient, they are tried again next time */
+        if (cache != NULL && job.items[todo[k]].error == NULL) {
+          Tcl_Obj *entry = Tcl_NewWideIntObj(stats[2 * k]);
+
+          Tcl_ListObjAppendElement(NULL, entry,
+                                   Tcl_NewWideIntObj(stats[2 * k + 1]));
+          Tcl_ListObjAppendElement(NULL, entry, infos[k]);
+          Tcl_DictObjPut(NULL, cache, norms[k], entry);
+          dirty = 1;
         }
-
-        Tcl_SetObjResult(interp, return_obj);
-
-        break;
+      }
+      Tcl_DictObjPut(NULL, result, objv[first + k], infos[k]);
+    }
+    if (dirty) {
+      rc = libVLCSaveFile(interp, cacheFile, cache, 0);
+    }
+    if (rc == TCL_OK) {
+      Tcl_SetObjResult(interp, result);
+    } else {
+      Tcl_DecrRefCount(result);
     }
 
-    case TKVLC_STATE: {
-        Tcl_Obj *return_obj = NULL;
-        libvlc_state_t state;
+done:
+    for (k = 0; k < job.nitems; k++) {
+      if (job.items[k].tracks != NULL) {
+        ckfree((char *) job.items[k].tracks);
+      }
+    }
+    for (k = 0; k < n; k++) {
+      if (norms[k] != NULL) {
+        Tcl_DecrRefCount(norms[k]);
+      }
+    }
+    if (cache != NULL) {
+      Tcl_DecrRefCount(cache);
+    }
+    Tcl_MutexFinalize(&job.lock);
+    Tcl_ConditionFinalize(&job.cond);
+    ckfree((char *) job.items);
+    ckfree((char *) norms);
+    ckfree((char *) infos);
+    ckfree((char *) stats);
+    ckfree((char *) errors);
+    ckfree((char *) todo);
+    return rc;
+}
 
-        if( objc != 2 ){
-            Tcl_WrongNumArgs(interp, 2, objv, 0);
-            return TCL_ERROR;
-        }
 
-        // get the current state of the media player (playing, paused, ...)
-        state = libvlc_media_player_get_state(pVLC->media_player);
+/*
+ *----------------------------------------------------------------------
+ *
+ * TKVLC_THUMBNAIL --
+ *
+ *  Decode one frame for each pair of file and time offset on a pool
+ *  of threads with headless, muted media players, and return the
+ *  thumbnails as RGB byte arrays or put them into photo images.
+ *
+ * Results:
+ *  A standard Tcl result.
+ *
+ * Side effects:
+ *  Threads and media players are created, photo images may change.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        if(state==libvlc_NothingSpecial) {
-             return_obj = Tcl_NewStringObj("idle", -1);
-        } else if(state==libvlc_Opening) {
-             return_obj = Tcl_NewStringObj("opening", -1);
-        } else if(state==libvlc_Buffering) {
-             return_obj = Tcl_NewStringObj("buffering", -1);
-        } else if(state==libvlc_Playing) {
-             return_obj = Tcl_NewStringObj("playing", -1);
-        } else if(state==libvlc_Paused) {
-             return_obj = Tcl_NewStringObj("paused", -1);
-        } else if(state==libvlc_Stopped) {
-             return_obj = Tcl_NewStringObj("stopped", -1);
-        } else if(state==libvlc_Ended) {
-             return_obj = Tcl_NewStringObj("ended", -1);
-        } else if(state==libvlc_Error) {
-             return_obj = Tcl_NewStringObj("error", -1);
-        }
+#ifdef USE_TK_PHOTO
+#define THUMB_ARGS "?-size WxH? ?-threads N? ?-timeout ms? ?-images list? "
+#else
+#define THUMB_ARGS "?-size WxH? ?-threads N? ?-timeout ms? "
+#endif
 
-        Tcl_SetObjResult(interp, return_obj);
+static int TKVLC_THUMBNAIL(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv)
+{
+    libVLCThumbs job;
+    Tcl_Obj *result, *thumbs, **norms;
+#ifdef USE_TK_PHOTO
+    Tcl_Obj **images = NULL;
+    Tcl_Size nimages = 0;
+#endif
+    Tcl_Time start, stop;
+    double secs;
+    int i, k, first, choice, argc, nthreads = 0, ndone = 0, rc = TCL_OK;
 
-        break;
-    }
+    static const char *THUMB_strs[] = {
+      "-size", "-threads", "-timeout",
+#ifdef USE_TK_PHOTO
+      "-images",
+#endif
+      NULL
+    };
+    enum THUMB_enum {
+      TKVLC_THUMB_SIZE, TKVLC_THUMB_THREADS, TKVLC_THUMB_TIMEOUT,
+#ifdef USE_TK_PHOTO
+      TKVLC_THUMB_IMAGES,
+#endif
+    };
 
-    case TKVLC_VERSION: {
-      Tcl_Obj *return_obj;
-      const char *result;
+    memset(&job, 0, sizeof(job));
+    job.max_width = 160;
+    job.max_height = 120;
+    job.timeout = 5000;
+    for (i = 1; i < objc; i += 2) {
+      const char *opt = Tcl_GetString(objv[i]);
 
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
+      if (opt[0] != '-') {
+        break;
+      }
+      if (strcmp(opt, "--") == 0) {
+        i++;
+        break;
+      }
+      if (Tcl_GetIndexFromObj(interp, objv[i], THUMB_strs, "option", 0,
+                              &choice) != TCL_OK) {
         return TCL_ERROR;
       }
-
-      result = libvlc_get_version();
-      return_obj = Tcl_NewStringObj(result, -1);
-
-      Tcl_SetObjResult(interp, return_obj);
-
-      break;
-    }
-
-    case TKVLC_DESTROY: {
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
+      if (i + 1 >= objc) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for %s",
+                                               opt));
         return TCL_ERROR;
       }
-
-      Tcl_DeleteCommandFromToken(interp, pVLC->cmd);
-      break;
+      switch ((enum THUMB_enum) choice) {
+        case TKVLC_THUMB_SIZE: {
+          const char *str = Tcl_GetString(objv[i + 1]);
+          char c;
+
+          if (sscanf(str, "%dx%d%c", &job.max_width, &job.max_height,
+                     &c) != 2 || job.max_width < 1 || job.max_height < 1 ||
+              job.max_width > TKVLC_MAX_THUMB_SIZE ||
+              job.max_height > TKVLC_MAX_THUMB_SIZE) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "bad size \"%s\": must be WxH", str));
+            return TCL_ERROR;
+          }
+          break;
+        }
+        case TKVLC_THUMB_THREADS:
+          if (Tcl_GetIntFromObj(interp, objv[i + 1], &nthreads) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          if (nthreads < 1 || nthreads > TKVLC_MAX_THUMB_THREADS) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "number of threads must be between 1 and %d",
+                TKVLC_MAX_THUMB_THREADS));
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_THUMB_TIMEOUT:
+          if (Tcl_GetIntFromObj(interp, objv[i + 1], &job.timeout)
+              != TCL_OK) {
+            return TCL_ERROR;
+          }
+          if (job.timeout < 0) {
+            Tcl_SetResult(interp, "timeout must not be negative",
+                          TCL_STATIC);
+            return TCL_ERROR;
+          }
+          break;
+#ifdef USE_TK_PHOTO
+        case TKVLC_THUMB_IMAGES:
+          if (Tcl_ListObjGetElements(interp, objv[i + 1], &nimages,
+                                     &images) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          break;
+#endif
+      }
     }
-
+    first = i;
+    if (objc - first < 2 || (objc - first) % 2 != 0) {
+      Tcl_WrongNumArgs(interp, 1, objv,
+                       THUMB_ARGS "file offset ?file offset ...?");
+      return TCL_ERROR;
+    }
+    job.nitems = (objc - first) / 2;
 #ifdef USE_TK_PHOTO
-    case TKVLC_EVENT: {
-      if (objc > 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "?cmd?");
+    if (images != NULL) {
+      if (nimages != job.nitems) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("expected %d images",
+                                               job.nitems));
         return TCL_ERROR;
       }
-      if (objc == 2) {
-        Tcl_SetObjResult(interp,
-        Tcl_NewListObj(pVLC->nSavedCmdObjs, pVLC->savedCmdObjs));
-      } else {
-        Tcl_Obj **cmdObjs;
-        int i;
-        Tcl_Size nCmdObjs;
-
-        if (Tcl_ListObjGetElements(interp, objv[2], &nCmdObjs, &cmdObjs)
-            != TCL_OK) {
-          return TCL_ERROR;
-        }
-        if (nCmdObjs <= 0) {
-          Tcl_SetResult(interp, "empty command", TCL_STATIC);
+#ifdef USE_TK_STUBS
+      if (Tk_InitStubs(interp, TCL_VERSION, 0) == NULL) {
+        return TCL_ERROR;
+      }
+#endif
+      for (k = 0; k < job.nitems; k++) {
+        if (Tk_FindPhoto(interp, Tcl_GetString(images[k])) == NULL) {
+          Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+              "image \"%s\" doesn't exist or is not a photo image",
+              Tcl_GetString(images[k])));
           return TCL_ERROR;
         }
-        if (pVLC->savedCmdObjs != NULL) {
-          for (i = 0; i < pVLC->nSavedCmdObjs; i++) {
-            Tcl_DecrRefCount(pVLC->savedCmdObjs[i]);
-          }
-          ckfree(pVLC->savedCmdObjs);
-        }
-        pVLC->nCmdObjs = nCmdObjs;
-        pVLC->cmdObjs = (Tcl_Obj **) ckalloc(nCmdObjs * sizeof(Tcl_Obj *));
-        for (i = 0; i < nCmdObjs; i++) {
-          pVLC->cmdObjs[i] = cmdObjs[i];
-          Tcl_IncrRefCount(pVLC->cmdObjs[i]);
-        }
-        pVLC->nSavedCmdObjs = pVLC->nCmdObjs;
-        pVLC->savedCmdObjs = pVLC->cmdObjs;
       }
-      break;
+    }
+#endif
+    if (nthreads == 0) {
+      nthreads = libVLCNumCpus();
+      if (nthreads > TKVLC_MAX_THUMB_THREADS) {
+        nthreads = TKVLC_MAX_THUMB_THREADS;
+      }
     }
 
-    case TKVLC_REPEAT: {
-      if (objc > 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "?flag?");
-        return TCL_ERROR;
+    job.items = (libVLCThumb *) ckalloc(job.nitems * sizeof(libVLCThumb));
+    memset(job.items, 0, job.nitems * sizeof(libVLCThumb));
+    norms = (Tcl_Obj **) ckalloc(job.nitems * sizeof(Tcl_Obj *));
+    memset(norms, 0, job.nitems * sizeof(Tcl_Obj *));
+    for (k = 0; k < job.nitems; k++) {
+      libVLCThumb *item = &job.items[k];
+
+      if (Tcl_GetDoubleFromObj(interp, objv[first + 2 * k + 1],
+                               &item->offset) != TCL_OK) {
+        rc = TCL_ERROR;
+        goto done;
       }
-      if (objc > 2) {
-        int flag;
+      if (item->offset < 0.0) {
+        Tcl_SetResult(interp, "offset must not be negative", TCL_STATIC);
+        rc = TCL_ERROR;
+        goto done;
+      }
+      norms[k] = Tcl_FSGetNormalizedPath(interp, objv[first + 2 * k]);
+      if (norms[k] == NULL) {
+        rc = TCL_ERROR;
+        goto done;
+      }
+      Tcl_IncrRefCount(norms[k]);
+      item->path = Tcl_GetString(norms[k]);
+    }
 
-        if (Tcl_GetBooleanFromObj(interp, objv[2], &flag) != TCL_OK) {
-          return TCL_ERROR;
-        }
-        pVLC->repeat = flag;
-      } else {
-        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(pVLC->repeat));
+    {
+      const char **argv = libVLCArgs(0, NULL, &argc);
+
+      job.vlc_inst = libVLCNewInstance(argc, argv, 1);
+      ckfree((char *) argv);
+    }
+    if (job.vlc_inst == NULL) {
+      Tcl_SetResult(interp, "vlc setup failed", TCL_STATIC);
+      rc = TCL_ERROR;
+      goto done;
+    }
+    Tcl_GetTime(&start);
+    libVLCRunThreads(libVLCThumbThread, &job,
+                     (nthreads > job.nitems) ? job.nitems : nthreads);
+    Tcl_GetTime(&stop);
+    libVLCReleaseInstance(job.vlc_inst);
+
+    thumbs = Tcl_NewObj();
+    for (k = 0; k < job.nitems; k++) {
+      libVLCThumb *item = &job.items[k];
+      Tcl_Obj *thumb = Tcl_NewObj();
+
+      if (item->pixels != NULL) {
+        Tcl_ListObjAppendElement(NULL, thumb, Tcl_NewIntObj(item->width));
+        Tcl_ListObjAppendElement(NULL, thumb, Tcl_NewIntObj(item->height));
+#ifdef USE_TK_PHOTO
+        if (images != NULL) {
+          Tk_PhotoHandle photo = Tk_FindPhoto(interp,
+                                              Tcl_GetString(images[k]));
+          Tk_PhotoImageBlock blk;
+
+          blk.pixelPtr = item->pixels;
+          blk.width = item->width;
+          blk.height = item->height;
+          blk.pixelSize = 3;
+          blk.pitch = item->width * 3;
+          blk.offset[0] = 0;
+          blk.offset[1] = 1;
+          blk.offset[2] = 2;
+          blk.offset[3] = 0;
+          if (photo == NULL ||
+              Tk_PhotoSetSize(interp, photo, blk.width, blk.height)
+              != TCL_OK ||
+              Tk_PhotoPutBlock(interp, photo, &blk, 0, 0, blk.width,
+                               blk.height, TK_PHOTO_COMPOSITE_SET)
+              != TCL_OK) {
+            Tcl_DecrRefCount(thumb);
+            Tcl_DecrRefCount(thumbs);
+            rc = TCL_ERROR;
+            goto done;
+          }
+          Tcl_ListObjAppendElement(NULL, thumb, images[k]);
+        } else
+#endif
+        Tcl_ListObjAppendElement(NULL, thumb,
+            Tcl_NewByteArrayObj(item->pixels, item->width * item->height * 3));
+        ndone++;
+      }
+      Tcl_ListObjAppendElement(NULL, thumbs, thumb);
+    }
+    secs = (stop.sec - start.sec) + (stop.usec - start.usec) / 1.0e6;
+    result = Tcl_NewObj();
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("thumbnails", -1));
+    Tcl_ListObjAppendElement(NULL, result, thumbs);
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("rate", -1));
+    Tcl_ListObjAppendElement(NULL, result,
+                             Tcl_NewDoubleObj(secs > 0.0 ? ndone / secs : 0.0));
+    Tcl_SetObjResult(interp, result);
+
+done:
+    for (k = 0; k < job.nitems; k++) {
+      if (job.items[k].pixels != NULL) {
+        ckfree((char *) job.items[k].pixels);
+      }
+      if (norms[k] != NULL) {
+        Tcl_DecrRefCount(norms[k]);
       }
-      break;
     }
+    Tcl_MutexFinalize(&job.lock);
+    ckfree((char *) job.items);
+    ckfree((char *) norms);
+    return rc;
+}
 
-    case TKVLC_INFO: {
-      Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+#undef THUMB_ARGS
 
-#define TLOAE(elem) Tcl_ListObjAppendElement(NULL, list, (elem))
-#define TLOAE_STR(s) TLOAE(Tcl_NewStringObj((s), -1))
-#define TLOAE_INT(i) TLOAE(Tcl_NewIntObj((i)))
-#define TLOAE_DBL(d) TLOAE(Tcl_NewDoubleObj((d)))
-#define TLOAE_BOOL(b) TLOAE(Tcl_NewBooleanObj((b)))
 
-      TLOAE_STR("media");
-      if (pVLC->file_name != NULL) {
-         TLOAE(pVLC->file_name);
-      } else {
-         TLOAE(Tcl_NewObj());
+/*
+ *----------------------------------------------------------------------
+ *
+ * TKVLC_WAVEFORM --
+ *
+ *  Return the minimum and maximum samples of the audio of a file per
+ *  bucket, at the level of detail matching a width in pixels. All
+ *  levels are built by one decoding run and cached next to the file
+ *  or in a cache directory, so that zooming does not decode again.
+ *
+ * Results:
+ *  A standard Tcl result.
+ *
+ * Side effects:
+ *  A media player is created, the cache file may be rewritten.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define WAVE_ARGS "?-cache dir? ?-levels N? ?-range {start end}? " \
+                  "?-timeout ms? ?-width pixels? "
+
+static int TKVLC_WAVEFORM(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv)
+{
+    libVLCWave w;
+    Tcl_Obj *cacheDir = NULL, *cacheFile = NULL, *norm, *peaks, *result;
+    Tcl_StatBuf *sb;
+    Tcl_WideInt from, to, first, last, bucket, j;
+    double start = 0.0, end = -1.0;
+    const char *error;
+    int i, l, first_arg, choice, argc, level, width = 0;
+    int nlevels = TKVLC_WAVE_LEVELS, timeout = 60000, rc = TCL_OK;
+
+    static const char *WAVE_strs[] = {
+      "-cache", "-levels", "-range", "-timeout", "-width", NULL
+    };
+    enum WAVE_enum {
+      TKVLC_WF_CACHE, TKVLC_WF_LEVELS, TKVLC_WF_RANGE, TKVLC_WF_TIMEOUT,
+      TKVLC_WF_WIDTH
+    };
+
+    for (i = 1; i < objc; i += 2) {
+      const char *opt = Tcl_GetString(objv[i]);
+
+      if (opt[0] != '-') {
+        break;
       }
-      TLOAE_STR("mode");
-      TLOAE_STR((pVLC->photo_name != NULL) ? "photo" : "window");
-      TLOAE_STR("target");
-      if (pVLC->photo_name != NULL) {
-        TLOAE(pVLC->photo_name);
-      } else {
-        char buffer[64];
+      if (strcmp(opt, "--") == 0) {
+        i++;
+        break;
+      }
+      if (Tcl_GetIndexFromObj(interp, objv[i], WAVE_strs, "option", 0,
+                              &choice) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      if (i + 1 >= objc) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("missing value for %s",
+                                               opt));
+        return TCL_ERROR;
+      }
+      switch ((enum WAVE_enum) choice) {
+        case TKVLC_WF_CACHE:
+          cacheDir = objv[i + 1];
+          break;
+        case TKVLC_WF_LEVELS:
+          if (Tcl_GetIntFromObj(interp, objv[i + 1], &nlevels) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          if (nlevels < 1 || nlevels > TKVLC_MAX_WAVE_LEVELS) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "number of levels must be between 1 and %d",
+                TKVLC_MAX_WAVE_LEVELS));
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_WF_RANGE: {
+          Tcl_Obj **elems;
+          Tcl_Size nelems;
+
+          if (Tcl_ListObjGetElements(NULL, objv[i + 1], &nelems,
+                                     &elems) != TCL_OK || nelems != 2 ||
+              Tcl_GetDoubleFromObj(NULL, elems[0], &start) != TCL_OK ||
+              Tcl_GetDoubleFromObj(NULL, elems[1], &end) != TCL_OK ||
+              start < 0.0 || end <= start) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "bad range \"%s\": must be {start end}",
+                Tcl_GetString(objv[i + 1])));
+            return TCL_ERROR;
+          }
+          break;
+        }
+        case TKVLC_WF_TIMEOUT:
+          if (Tcl_GetIntFromObj(interp, objv[i + 1], &timeout) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          if (timeout < 0) {
+            Tcl_SetResult(interp, "timeout must not be negative",
+                          TCL_STATIC);
+            return TCL_ERROR;
+          }
+          break;
+        case TKVLC_WF_WIDTH:
+          if (Tcl_GetIntFromObj(interp, objv[i + 1], &width) != TCL_OK) {
+            return TCL_ERROR;
+          }
+          if (width < 0) {
+            Tcl_SetResult(interp, "width must not be negative", TCL_STATIC);
+            return TCL_ERROR;
+          }
+          break;
+      }
+    }
+    first_arg = i;
+    if (objc - first_arg != 1) {
+      Tcl_WrongNumArgs(interp, 1, objv, WAVE_ARGS "file");
+      return TCL_ERROR;
+    }
 
-        sprintf(buffer, "0x%" TCL_LL_MODIFIER "x", pVLC->window_id);
-        TLOAE_STR(buffer);
+    norm = Tcl_FSGetNormalizedPath(interp, objv[first_arg]);
+    if (norm == NULL) {
+      return TCL_ERROR;
+    }
+    Tcl_IncrRefCount(norm);
+    memset(&w, 0, sizeof(w));
+    sb = Tcl_AllocStatBuf();
+    if (Tcl_FSStat(norm, sb) != 0) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't stat \"%s\": %s",
+          Tcl_GetString(objv[first_arg]), Tcl_PosixError(interp)));
+      ckfree((char *) sb);
+      rc = TCL_ERROR;
+      goto done;
+    }
+    memcpy(w.hdr.magic, TKVLC_WAVE_MAGIC, 8);
+    w.hdr.nlevels = nlevels;
+    w.hdr.bucket = TKVLC_WAVE_BUCKET;
+    w.hdr.size = (Tcl_WideInt) Tcl_GetSizeFromStat(sb);
+    w.hdr.mtime = (Tcl_WideInt) Tcl_GetModificationTimeFromStat(sb);
+    ckfree((char *) sb);
+
+    /* next to the file, or named by a hash of its path */
+    if (cacheDir == NULL) {
+      cacheFile = Tcl_DuplicateObj(norm);
+      Tcl_AppendToObj(cacheFile, ".peaks", -1);
+    } else if (Tcl_GetCharLength(cacheDir) > 0) {
+      const unsigned char *c = (const unsigned char *) Tcl_GetString(norm);
+      Tcl_WideUInt h = 14695981039346656037ULL;
+      Tcl_Obj *nameObj;
+      char name[32];
+
+      while (*c != '\0') {
+        h = (h ^ *c++) * 1099511628211ULL;
       }
-      TLOAE_STR("width");
-      TLOAE_INT(pVLC->width);
-      TLOAE_STR("height");
-      TLOAE_INT(pVLC->height);
-      TLOAE_STR("state");
-      TLOAE_STR(libVLCstatestr(pVLC));
-      TLOAE_STR("mute");
-      TLOAE_BOOL(libvlc_audio_get_mute(pVLC->media_player) > 0);
-      TLOAE_STR("volume");
-      TLOAE_INT(libvlc_audio_get_volume (pVLC->media_player));
-      TLOAE_STR("duration");
-      TLOAE_DBL((double)
-      libvlc_media_player_get_length(pVLC->media_player) / 1000.0);
-      TLOAE_STR("time");
-      TLOAE_DBL((double)
-      libvlc_media_player_get_time(pVLC->media_player) / 1000.0);
-      TLOAE_STR("position");
-      TLOAE_DBL(libvlc_media_player_get_position(pVLC->media_player));
-      TLOAE_STR("rate");
-      TLOAE_DBL(libvlc_media_player_get_rate(pVLC->media_player));
-      TLOAE_STR("seekable");
-      TLOAE_BOOL(libvlc_media_player_is_seekable(pVLC->media_player) > 0);
-      TLOAE_STR("repeat");
-      TLOAE_BOOL(pVLC->repeat);
+      /* in two halves, the 64 bit printf modifier is not portable */
+      sprintf(name, "%08x%08x.peaks", (unsigned) (h >> 32), (unsigned) h);
+      nameObj = Tcl_NewStringObj(name, -1);
+      Tcl_IncrRefCount(nameObj);
+      cacheFile = Tcl_FSJoinToPath(cacheDir, 1, &nameObj);
+      Tcl_DecrRefCount(nameObj);
+    }
+    if (cacheFile != NULL) {
+      Tcl_IncrRefCount(cacheFile);
+    }
 
-#undef TLOAE
-#undef TLOAE_STR
-#undef TLOAE_INT
-#undef TLOAE_DBL
-#undef TLOAE_BOOL
+    if (cacheFile == NULL || !libVLCWaveLoad(cacheFile, &w, nlevels)) {
+      const char **argv = libVLCArgs(0, NULL, &argc);
+      libvlc_instance_t *inst = libVLCNewInstance(argc, argv, 1);
 
-      Tcl_SetObjResult(interp, list);
-      break;
+      ckfree((char *) argv);
+      if (inst == NULL) {
+        Tcl_SetResult(interp, "vlc setup failed", TCL_STATIC);
+        rc = TCL_ERROR;
+        goto done;
+      }
+      error = libVLCWaveDecode(inst, Tcl_GetString(norm), &w, timeout);
+      libVLCReleaseInstance(inst);
+      if (error != NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't decode \"%s\": %s",
+            Tcl_GetString(objv[first_arg]), error));
+        rc = TCL_ERROR;
+        goto done;
+      }
+      libVLCWaveLevels(&w, 1);
+      if (cacheFile != NULL &&
+          libVLCWaveSave(interp, cacheFile, &w) != TCL_OK) {
+        if (cacheDir != NULL) {
+          rc = TCL_ERROR;
+          goto done;
+        }
+        /* the directory of the file may be read-only */
+        Tcl_ResetResult(interp);
+      }
     }
-#endif
 
-  } /* End of the SWITCH statement */
+    /* the coarsest level with at least width buckets in the range */
+    from = (Tcl_WideInt) (start * w.hdr.rate);
+    to = (end < 0.0) ? w.hdr.frames : (Tcl_WideInt) (end * w.hdr.rate + 0.5);
+    if (to > w.hdr.frames) {
+      to = w.hdr.frames;
+    }
+    if (from > to) {
+      from = to;
+    }
+    level = 0;
+    bucket = TKVLC_WAVE_BUCKET;
+    for (l = 1; l < w.hdr.nlevels; l++) {
+      bucket *= TKVLC_WAVE_FACTOR;
+    }
+    for (l = w.hdr.nlevels - 1; width > 0 && l > 0; l--) {
+      if ((to + bucket - 1) / bucket - from / bucket >= width) {
+        level = l;
+        break;
+      }
+      bucket /= TKVLC_WAVE_FACTOR;
+    }
+    if (level == 0) {
+      bucket = TKVLC_WAVE_BUCKET;
+    }
+    first = from / bucket;
+    last = (to + bucket - 1) / bucket;
+    if (last > w.count[level]) {
+      last = w.count[level];
+    }
 
-  return rc;
+    peaks = Tcl_NewListObj(0, NULL);
+    for (j = first; j < last; j++) {
+      Tcl_ListObjAppendElement(NULL, peaks,
+          Tcl_NewDoubleObj(w.peaks[level][2 * j] / 32767.0));
+      Tcl_ListObjAppendElement(NULL, peaks,
+          Tcl_NewDoubleObj(w.peaks[level][2 * j + 1] / 32767.0));
+    }
+    result = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("rate", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewIntObj(w.hdr.rate));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("channels", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewIntObj(w.hdr.channels));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("duration", -1));
+    Tcl_ListObjAppendElement(NULL, result,
+        Tcl_NewDoubleObj((double) w.hdr.frames / w.hdr.rate));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("level", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewIntObj(level));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("bucket", -1));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewWideIntObj(bucket));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("offset", -1));
+    Tcl_ListObjAppendElement(NULL, result,
+        Tcl_NewDoubleObj((double) (first * bucket) / w.hdr.rate));
+    Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("peaks", -1));
+    Tcl_ListObjAppendElement(NULL, result, peaks);
+    Tcl_SetObjResult(interp, result);
+
+done:
+    for (l = 0; l < TKVLC_MAX_WAVE_LEVELS; l++) {
+      if (w.peaks[l] != NULL) {
+        ckfree((char *) w.peaks[l]);
+      }
+    }
+    if (w.buffer != NULL) {
+      ckfree((char *) w.buffer);
+    }
+    if (cacheFile != NULL) {
+      Tcl_DecrRefCount(cacheFile);
+    }
+    Tcl_DecrRefCount(norm);
+    return rc;
 }
 
+#undef WAVE_ARGS
+
+
+#ifdef USE_TK_PHOTO
+
 /*
  *----------------------------------------------------------------------
  *
- * FreeData --
+ * libVLCCheckLevel --
  *
- *  Callback to cleanup libVLCData struct.
+ *      Compare libVLCLevel with libVLCLevelScalar on a block of
+ *      pseudo-random samples with nch channels, long enough for the
+ *      vector loop and a scalar tail. Sums may differ by rounding,
+ *      peaks must be equal.
  *
  * Results:
- *  None.
+ *      A new Tcl object, "ok" or the first difference.
  *
  * Side effects:
- *  Resources are released.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-#if (TCL_MAJOR_VERSION > 8)
-static void FreeData(void *clientData)
-#else
-static void FreeData(char *clientData)
-#endif
-
+static Tcl_Obj *libVLCCheckLevel(int nch)
 {
-  libVLCData *p = (libVLCData *) clientData;
-  libvlc_media_player_t *m;
-#ifdef USE_TK_PHOTO
-  libVLCEvent *e;
-  int i;
-#endif
-
-#ifdef USE_TK_PHOTO
-  /* invalidate event callback */
-  if (p->cmdObjs != NULL) {
-    for (i = 0; i < p->nCmdObjs; i++) {
-      Tcl_DecrRefCount(p->cmdObjs[i]);
-    }
-    ckfree(p->cmdObjs);
-  }
-  p->nCmdObjs = p->nSavedCmdObjs = 0;
-  p->cmdObjs = p->savedCmdObjs = NULL;
-#endif
-  m = p->media_player;
-  p->media_player = NULL;
-  /* stop media player */
-  if (m != NULL) {
-    libvlc_media_player_stop(m);
-  }
-#ifdef USE_TK_PHOTO
-  /* invalidate queued events */
-  Tcl_MutexLock(&p->ev_lock);
-  e = p->ev_queue;
-  while (e != NULL) {
-    e->p = NULL;
-    e = e->next;
+  float s[1001 * TKVLC_MAX_CHANNELS];
+  float sumsq[TKVLC_MAX_CHANNELS], peak[TKVLC_MAX_CHANNELS];
+  float rsumsq[TKVLC_MAX_CHANNELS], rpeak[TKVLC_MAX_CHANNELS];
+  unsigned i, count = 1001, seed = 1;
+  int c;
+
+  /* all of it, so that the compiler sees it initialized */
+  for (i = 0; i < sizeof(s) / sizeof(s[0]); i++) {
+    seed = seed * 1103515245 + 12345;
+    s[i] = (float) ((seed >> 8) & 0xFFFF) / 32768.0f - 1.0f;
   }
-  Tcl_MutexUnlock(&p->ev_lock);
-  /* invalidate queued frames */
-  if (p->frames[0].e != NULL) {
-    p->frames[0].e->f = NULL;
-  }
-  if (p->frames[1].e != NULL) {
-    p->frames[1].e->f = NULL;
-  }
-#endif
-  /* release media player */
-  if (m != NULL) {
-    libvlc_media_player_stop(m);
-    libvlc_media_player_release(m);
-  }
-  libvlc_release(p->vlc_inst);
-#ifdef USE_TK_PHOTO
-  if (p->photo_name != NULL) {
-    Tcl_DecrRefCount(p->photo_name);
-  }
-#endif
-  if (p->file_name != NULL) {
-    Tcl_DecrRefCount(p->file_name);
-  }
- 
-#ifdef USE_TK_PHOTO
-  /* cleanup frame buffers */
-  if (p->frames[0].pixels != NULL) {
-    ckfree(p->frames[0].pixels);
+  libVLCLevel(s, count, nch, sumsq, peak);
+  for (c = 0; c < nch; c++) {
+    rsumsq[c] = rpeak[c] = 0.0f;
   }
-  if (p->frames[1].pixels != NULL) {
-    ckfree(p->frames[1].pixels);
+  libVLCLevelScalar(s, 0, count * nch, nch, rsumsq, rpeak);
+  for (c = 0; c < nch; c++) {
+    if (fabsf(sumsq[c] - rsumsq[c]) > 1e-4f * rsumsq[c] ||
+        peak[c] != rpeak[c]) {
+      return Tcl_ObjPrintf("channel %d: sum %g peak %g, expected %g %g",
+                           c, sumsq[c], peak[c], rsumsq[c], rpeak[c]);
+    }
   }
-  Tcl_MutexFinalize(&p->ev_lock);
-#endif
-  ckfree(p);
+  return Tcl_NewStringObj("ok", -1);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * libVLCObjCmdDeleted --
+ * libVLCCheckYuv --
  *
- *  Destructor of libvlc media player object and command.
+ *      Compare a YUV to RGBA row converter with libVLCYuvRowScalar
+ *      on pseudo-random rows of all widths up to 100 pixels, which
+ *      covers the vector loops, their tails, and clamping at both
+ *      ends. Source and destination are misaligned on purpose.
+ *      The results must be identical.
  *
  * Results:
- *  None.
+ *      A new Tcl object, "ok" or the first difference.
  *
  * Side effects:
- *  Resources are released.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-static void libVLCObjCmdDeleted(ClientData clientData)
+static Tcl_Obj *libVLCCheckYuv(libVLCYuvRowProc *row)
 {
-  Tcl_EventuallyFree((char *) clientData, FreeData);
+  unsigned char y[101], u[51], v[51], dst[4 * 100 + 1], ref[4 * 100];
+  unsigned seed = 1;
+  int width, i;
+
+  for (width = 1; width <= 100; width++) {
+    for (i = 0; i < width; i++) {
+      seed = seed * 1103515245 + 12345;
+      y[1 + i] = (unsigned char) (seed >> 16);
+      u[1 + i / 2] = (unsigned char) (seed >> 8);
+      v[1 + i / 2] = (unsigned char) (seed >> 24);
+    }
+    row(y + 1, u + 1, v + 1, dst + 1, width);
+    libVLCYuvRowScalar(y + 1, u + 1, v + 1, ref, width);
+    for (i = 0; i < 4 * width; i++) {
+      if (dst[1 + i] != ref[i]) {
+        return Tcl_ObjPrintf("width %d, pixel %d: %d %d %d %d, "
+                             "expected %d %d %d %d", width, i / 4,
+                             dst[1 + i / 4 * 4], dst[2 + i / 4 * 4],
+                             dst[3 + i / 4 * 4], dst[4 + i / 4 * 4],
+                             ref[i / 4 * 4], ref[i / 4 * 4 + 1],
+                             ref[i / 4 * 4 + 2], ref[i / 4 * 4 + 3]);
+      }
+    }
+  }
+  return Tcl_NewStringObj("ok", -1);
 }
 
-
 /*
  *----------------------------------------------------------------------
  *
- * TKVLC_INIT --
+ * TKVLC_SELFTEST --
  *
- *  Initialize a libvlc media player given window identifier
- *  or photo image name.
+ *  Run the vectorized kernels of this build which the CPU supports
+ *  on generated data and compare them with their scalar versions.
+ *  Registered as ::tkvlc::_selftest for the test suite, it is not
+ *  part of the documented commands.
  *
  * Results:
- *  A standard Tcl result.
+ *  A standard Tcl result, a dictionary mapping each check to "ok"
+ *  or a description of the first difference.
  *
  * Side effects:
- *  Memory and resources are allocated, a Tcl command is
- *  created to refer to the media player.
+ *  None.
  *
  *----------------------------------------------------------------------
  */
 
-static int TKVLC_INIT(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv)
+static int TKVLC_SELFTEST(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv)
 {
-    const char *zArg;
-    libVLCData *p;
-#if !defined(_WIN32)
-#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
-    const char *argv[] ={"--no-xlib"};
-#endif
-#endif
-#ifdef USE_TK_PHOTO
-    libvlc_event_manager_t *em;
-#endif
-
-    if( objc != 2 && objc != 3 ) {
-#ifdef USE_TK_PHOTO
-      Tcl_WrongNumArgs(interp, 1, objv, "HANDLE ?photo?");
-#else
-      Tcl_WrongNumArgs(interp, 1, objv, "HANDLE ?HWND?");
-#endif
-      return TCL_ERROR;
-    }
+    static const int nchs[] = { 1, 2, 6, 8 };
+    Tcl_Obj *result;
+    int i;
 
-    p = (libVLCData *)Tcl_Alloc( sizeof(*p) );
-    if( p==0 ) {
-      Tcl_SetResult(interp, (char *)"malloc failed", TCL_STATIC);
+    if (objc != 1) {
+      Tcl_WrongNumArgs(interp, 1, objv, NULL);
       return TCL_ERROR;
     }
-
-    memset(p, 0, sizeof(*p));
-    p->interp = interp;
-    p->vlc_inst = NULL;
-    p->media_player = NULL;
-    p->file_name = NULL;
-    p->is_location = 0;
-
-#ifdef USE_TK_PHOTO
-    p->repeat = 0;
-    p->tk_checked = 0;
-    p->window_id = 0;
-    p->photo_name = NULL;
-    p->width = p->height = 0;
-    p->tid = Tcl_GetCurrentThread();
-    p->ev_lock = NULL;
-    p->ev_queue = NULL;
-    p->nCmdObjs = p->nSavedCmdObjs = 0;
-    p->cmdObjs = p->savedCmdObjs = NULL;
-    memset(&p->frames, 0, sizeof(p->frames));
-    p->frames[0].p = p->frames[1].p = p;
-#endif
-
-#ifdef _WIN32
-    p->vlc_inst = libvlc_new(0, NULL);
-#else
-#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
-    p->vlc_inst = libvlc_new(1, argv);
-#else
-    p->vlc_inst = libvlc_new(0, NULL);
-#endif
-#endif
-    if (p->vlc_inst == NULL) {
-      Tcl_SetResult(interp, "vlc setup failed", TCL_STATIC);
-      ckfree((char *) p);
-      return TCL_ERROR;
+    result = Tcl_NewDictObj();
+    for (i = 0; i < (int) (sizeof(nchs) / sizeof(nchs[0])); i++) {
+      Tcl_DictObjPut(NULL, result, Tcl_ObjPrintf("level/%d", nchs[i]),
+                     libVLCCheckLevel(nchs[i]));
     }
-
-#ifdef USE_TK_PHOTO
-    libvlc_log_set(p->vlc_inst, silence, NULL);
-#endif
-
-    p->media_player = libvlc_media_player_new(p->vlc_inst);
-    if (p->media_player == NULL) {
-      Tcl_SetResult(interp, "media player setup failed", TCL_STATIC);
-      libvlc_release(p->vlc_inst);
-      ckfree((char *) p);
-      return TCL_ERROR;
+#if defined(TKVLC_X86_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+      Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("yuv/sse4.1", -1),
+                     libVLCCheckYuv(libVLCYuvRowSSE41));
     }
-
-    /*
-     * Tcl side use "winfo id window" to give a low-level
-     * platform-specific identifier for window.
-     *
-     * On Unix platforms, this is the X window identifier.
-     * Under Windows, this is the Windows HWND.
-     */
-    if (objc == 3) {
-      int is_win = 0;
-
-#ifdef USE_TK_PHOTO
-
-    if (!is_win) {
-      Tk_PhotoHandle photo;
-
-#ifdef linux
-      /*
-       * Raspberry Pi: the mmal_vout (or whatever other component)
-       * is unable to provide the proper callback behavior for
-       * rendering to photo images. Thus we don't support it for now.
-       */
-      if (Raspi_complain(interp) != TCL_OK) {
-        libvlc_media_player_release(p->media_player);
-        libvlc_release(p->vlc_inst);
-        ckfree(p);
-        return TCL_ERROR;
-      }
-#endif
-
-      if (Tk_check(p, interp) != TCL_OK) {
-        libvlc_media_player_release(p->media_player);
-        libvlc_release(p->vlc_inst);
-        ckfree((char *) p);
-        return TCL_ERROR;
-      }
-      if (Tk_MainWindow(interp) == NULL) {
-        Tcl_SetResult(interp, "application has been destroyed", TCL_STATIC);
-        libvlc_media_player_release(p->media_player);
-        libvlc_release(p->vlc_inst);
-        ckfree((char *) p);
-        return TCL_ERROR;
-      }
-      photo = Tk_FindPhoto(interp, Tcl_GetString(objv[2]));
-      if (photo == NULL) {
-        Tcl_SetResult(interp, "no valid photo image given", TCL_STATIC);
-        libvlc_media_player_release(p->media_player);
-        libvlc_release(p->vlc_inst);
-        ckfree((char *) p);
-        return TCL_ERROR;
-      }
-      Tk_PhotoGetSize(photo, &p->width, &p->height);
-      if (p->width <= 0 || p->height <= 0) {
-        p->width = 640;
-        p->height = 480;
-      }
-      p->photo_name = objv[2];
-      Tcl_IncrRefCount(p->photo_name);
-      libvlc_video_set_callbacks(p->media_player, libVLClock, NULL,
-                 libVLCdisplay, p);
-      libvlc_video_set_format(p->media_player, "RV24", p->width, p->height,
-                  p->width * 3);
-      p->frames[0].pixels = ckalloc(p->width * p->height * 3);
-      p->frames[1].pixels = ckalloc(p->width * p->height * 3);
-
-      em = libvlc_media_player_event_manager(p->media_player);
-      libvlc_event_attach(em, libvlc_MediaPlayerMediaChanged, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerNothingSpecial, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerOpening, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerBuffering, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerPlaying, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerPaused, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerStopped, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerForward, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerBackward, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerEndReached, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerEncounteredError, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerTimeChanged, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerPositionChanged, libVLChandler, p);
-
-#if LIBVLC_VERSION_INT >= LIBVLC_VERSION(3, 0, 0, 0)
-      libvlc_event_attach(em, libvlc_MediaPlayerMuted, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerUnmuted, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerAudioVolume, libVLChandler, p);
-      libvlc_event_attach(em, libvlc_MediaPlayerAudioDevice, libVLChandler, p);
-#endif
+    if (__builtin_cpu_supports("avx2")) {
+      Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("yuv/avx2", -1),
+                     libVLCCheckYuv(libVLCYuvRowAVX2));
     }
-
-#else
-
-#ifdef _WIN32
-    Tcl_GetIntFromObj(interp, objv[2], (int*)&hwnd);
-    libvlc_media_player_set_hwnd(p->media_player, (void *) hwnd);
-    is_win = 1;
-#else
-#ifdef __APPLE__
-    /* TBD */
-#else
-    Tcl_GetIntFromObj(interp, objv[2], (int *) &drawable);
-    libvlc_media_player_set_xwindow(p->media_player, (uint32_t) drawable);
-    is_win = 1;
-#endif
-#endif
-
+#elif defined(__ARM_NEON)
+    Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("yuv/neon", -1),
+                   libVLCCheckYuv(libVLCYuvRowNEON));
 #endif
-    }
-
-    zArg = Tcl_GetStringFromObj(objv[1], 0);
-    p->cmd = Tcl_CreateObjCommand(interp, zArg, libVLCObjCmd, (char*)p, 
-                        (Tcl_CmdDeleteProc *) libVLCObjCmdDeleted);
-
+    Tcl_SetObjResult(interp, result);
     return TCL_OK;
 }
 
+#endif
 
 /*
  *----------------------------------------------------------------------
@@ -1546,8 +9444,29 @@ int Tkvlc_Init(Tcl_Interp *interp)
     return TCL_ERROR;
   }
 
+#ifdef USE_TK_PHOTO
+  libVLCInitConverter();
+#endif
+
   Tcl_CreateObjCommand(interp, "::tkvlc::init", (Tcl_ObjCmdProc *) TKVLC_INIT,
      (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+  Tcl_CreateObjCommand(interp, "::tkvlc::prewarm",
+     (Tcl_ObjCmdProc *) TKVLC_PREWARM, (ClientData)NULL,
+     (Tcl_CmdDeleteProc *)NULL);
+  Tcl_CreateObjCommand(interp, "::tkvlc::probe",
+     (Tcl_ObjCmdProc *) TKVLC_PROBE, (ClientData)NULL,
+     (Tcl_CmdDeleteProc *)NULL);
+  Tcl_CreateObjCommand(interp, "::tkvlc::thumbnail",
+     (Tcl_ObjCmdProc *) TKVLC_THUMBNAIL, (ClientData)NULL,
+     (Tcl_CmdDeleteProc *)NULL);
+  Tcl_CreateObjCommand(interp, "::tkvlc::waveform",
+     (Tcl_ObjCmdProc *) TKVLC_WAVEFORM, (ClientData)NULL,
+     (Tcl_CmdDeleteProc *)NULL);
+#ifdef USE_TK_PHOTO
+  Tcl_CreateObjCommand(interp, "::tkvlc::_selftest",
+     (Tcl_ObjCmdProc *) TKVLC_SELFTEST, (ClientData)NULL,
+     (Tcl_CmdDeleteProc *)NULL);
+#endif
 
   return TCL_OK;
 }
@@ -0,0 +1,61 @@
+/*
+ * tkvlcshm.h
+ *
+ * Layout of the POSIX shared memory frame ring written by
+ * "HANDLE export shm NAME", for readers in other processes.
+ *
+ * The object starts with a header, followed by nslots slots of
+ * slot_size bytes each, at offsets aligned to TKVLC_SHM_ALIGN.
+ * Frame number n (counting from 1) is written to the slot
+ * TKVLC_SHM_SLOT(hdr, n), and the header's seq is set to n once the
+ * frame is complete. Each slot is guarded by a sequence lock which
+ * is odd while the slot is written: a reader loads the lock, reads
+ * the frame in place, and accepts it when the lock is unchanged and
+ * even and the slot's seq is the frame number it expected.
+ *
+ * The layout changes when the frames outgrow the slots. The header's
+ * generation is odd while that happens and different afterwards; a
+ * reader then maps the object again with its new size. The object
+ * never shrinks, so an old mapping stays valid.
+ */
+
+#ifndef _TKVLCSHM_H
+#define _TKVLCSHM_H
+
+#include <stdint.h>
+
+#define TKVLC_SHM_MAGIC    "TKVLCSHM"   /* Header magic, 8 bytes. */
+#define TKVLC_SHM_VERSION  1
+#define TKVLC_SHM_ALIGN    64           /* Header size, slot alignment. */
+
+typedef struct TkvlcShmHeader {
+  char magic[8];                /* TKVLC_SHM_MAGIC, set when ready. */
+  uint32_t version;             /* TKVLC_SHM_VERSION. */
+  uint32_t nslots;              /* Number of frame slots. */
+  uint32_t slot_size;           /* Bytes per slot, slot header included. */
+  uint32_t generation;          /* Layout lock, odd while changed. */
+  uint64_t seq;                 /* Number of the newest frame, 0 if none. */
+  uint64_t size;                /* Size of the object in bytes. */
+} TkvlcShmHeader;
+
+typedef struct TkvlcShmSlot {
+  uint32_t lock;                /* Sequence lock, odd while written. */
+  uint32_t width;               /* Frame width in pixels. */
+  uint32_t height;              /* Frame height in pixels. */
+  uint32_t pixel_size;          /* 3 for RGB, 4 for RGBA pixels. */
+  uint64_t seq;                 /* Frame number or 0. */
+  int64_t time_us;              /* Wall clock time of the frame. */
+} TkvlcShmSlot;
+
+/*
+ * Slot of frame number n, and the pixels of a slot, which are rows
+ * of width * pixel_size bytes without padding.
+ */
+
+#define TKVLC_SHM_SLOT(hdr, n) \
+  ((TkvlcShmSlot *) ((unsigned char *) (hdr) + TKVLC_SHM_ALIGN + \
+    (size_t) (((n) - 1) % (hdr)->nslots) * (hdr)->slot_size))
+#define TKVLC_SHM_DATA(slot) \
+  ((unsigned char *) (slot) + TKVLC_SHM_ALIGN)
+
+#endif /* _TKVLCSHM_H */